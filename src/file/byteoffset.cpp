@@ -0,0 +1,465 @@
+#include "byteoffset.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QVector>
+#include <QByteArray>
+
+#include <cstdlib>
+#include <cmath>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define BYTEOFFSET_X86
+#include <immintrin.h>
+#endif
+
+/* The vectorized decoders look for runs of single byte deltas. A run is loaded into a register, sign extended to 32
+ * bit, prefix summed in-register and added to the running value. Escaped (multi byte) deltas are rare in diffraction
+ * data and are handed to the scalar step. */
+
+static inline bool decodeOne(const char * buf, size_t buf_size, size_t * id, int * value)
+{
+    if (*id >= buf_size)
+    {
+        return false;
+    }
+
+    const unsigned char * ubuf = reinterpret_cast<const unsigned char *>(buf);
+
+    if (buf[*id] == (char) -128)
+    {
+        if (*id + 3 > buf_size)
+        {
+            return false;
+        }
+
+        int int16 = (short) ((ubuf[*id + 2] << 8) | ubuf[*id + 1]);
+
+        if (int16 == -32768)
+        {
+            if (*id + 7 > buf_size)
+            {
+                return false;
+            }
+
+            int int32 = (int) (((unsigned int) ubuf[*id + 6] << 24) | ((unsigned int) ubuf[*id + 5] << 16) | ((unsigned int) ubuf[*id + 4] << 8) | (unsigned int) ubuf[*id + 3]);
+            *value += int32;
+            *id += 7;
+        }
+        else
+        {
+            *value += int16;
+            *id += 3;
+        }
+    }
+    else
+    {
+        *value += (signed char) buf[*id];
+        (*id)++;
+    }
+
+    return true;
+}
+
+static inline void storeOne(float * out, size_t i, int value, float * max_counts)
+{
+    float counts = (value < 0) ? 0.0f : (float) value;
+
+    out[i] = counts;
+
+    if (*max_counts < counts)
+    {
+        *max_counts = counts;
+    }
+}
+
+long byteOffsetDecodeScalar(const char * buf, size_t buf_size, float * out, size_t n, int * prev, float * max_counts)
+{
+    size_t id = 0;
+    int value = *prev;
+    float max = *max_counts;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!decodeOne(buf, buf_size, &id, &value))
+        {
+            return -1;
+        }
+
+        storeOne(out, i, value, &max);
+    }
+
+    *prev = value;
+    *max_counts = max;
+
+    return (long) id;
+}
+
+#ifdef BYTEOFFSET_X86
+
+__attribute__((target("sse4.1")))
+static long byteOffsetDecodeSSE41(const char * buf, size_t buf_size, float * out, size_t n, int * prev, float * max_counts)
+{
+    size_t id = 0;
+    size_t i = 0;
+    int value = *prev;
+    float max = *max_counts;
+
+    const __m128i escape = _mm_set1_epi8((char) -128);
+    const __m128i zero = _mm_setzero_si128();
+    __m128 vmax = _mm_set1_ps(max);
+
+    while (i < n)
+    {
+        if ((i + 16 <= n) && (id + 16 <= buf_size))
+        {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + id));
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, escape));
+
+            if (mask == 0)
+            {
+                __m128i run = _mm_set1_epi32(value);
+
+                for (int g = 0; g < 4; g++)
+                {
+                    __m128i d = _mm_cvtepi8_epi32(bytes);
+                    bytes = _mm_srli_si128(bytes, 4);
+
+                    // Inclusive prefix sum of four deltas
+                    d = _mm_add_epi32(d, _mm_slli_si128(d, 4));
+                    d = _mm_add_epi32(d, _mm_slli_si128(d, 8));
+                    d = _mm_add_epi32(d, run);
+                    run = _mm_shuffle_epi32(d, 0xFF);
+
+                    __m128 f = _mm_cvtepi32_ps(_mm_max_epi32(d, zero));
+                    vmax = _mm_max_ps(vmax, f);
+                    _mm_storeu_ps(out + i + 4 * g, f);
+                }
+
+                value = _mm_cvtsi128_si32(run);
+                id += 16;
+                i += 16;
+                continue;
+            }
+
+            // Plain deltas up to the first escape, then the escaped delta itself
+            int n_plain = __builtin_ctz(mask);
+
+            for (int k = 0; k <= n_plain && i < n; k++, i++)
+            {
+                if (!decodeOne(buf, buf_size, &id, &value))
+                {
+                    return -1;
+                }
+
+                storeOne(out, i, value, &max);
+            }
+
+            continue;
+        }
+
+        if (!decodeOne(buf, buf_size, &id, &value))
+        {
+            return -1;
+        }
+
+        storeOne(out, i, value, &max);
+        i++;
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, vmax);
+
+    for (int k = 0; k < 4; k++)
+    {
+        if (max < lanes[k]) max = lanes[k];
+    }
+
+    *prev = value;
+    *max_counts = max;
+
+    return (long) id;
+}
+
+__attribute__((target("avx2")))
+static long byteOffsetDecodeAVX2(const char * buf, size_t buf_size, float * out, size_t n, int * prev, float * max_counts)
+{
+    size_t id = 0;
+    size_t i = 0;
+    int value = *prev;
+    float max = *max_counts;
+
+    const __m256i escape = _mm256_set1_epi8((char) -128);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i last = _mm256_set1_epi32(7);
+    __m256 vmax = _mm256_set1_ps(max);
+
+    while (i < n)
+    {
+        if ((i + 32 <= n) && (id + 32 <= buf_size))
+        {
+            __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf + id));
+            unsigned int mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, escape));
+
+            if (mask == 0)
+            {
+                __m256i run = _mm256_set1_epi32(value);
+
+                for (int g = 0; g < 4; g++)
+                {
+                    __m256i d = _mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(buf + id + 8 * g)));
+
+                    // Inclusive prefix sum within each 128 bit lane, then carry the low lane total into the high lane
+                    d = _mm256_add_epi32(d, _mm256_slli_si256(d, 4));
+                    d = _mm256_add_epi32(d, _mm256_slli_si256(d, 8));
+                    __m256i carry = _mm256_shuffle_epi32(d, 0xFF);
+                    d = _mm256_add_epi32(d, _mm256_permute2x128_si256(carry, carry, 0x08));
+                    d = _mm256_add_epi32(d, run);
+                    run = _mm256_permutevar8x32_epi32(d, last);
+
+                    __m256 f = _mm256_cvtepi32_ps(_mm256_max_epi32(d, zero));
+                    vmax = _mm256_max_ps(vmax, f);
+                    _mm256_storeu_ps(out + i + 8 * g, f);
+                }
+
+                value = _mm256_cvtsi256_si32(run);
+                id += 32;
+                i += 32;
+                continue;
+            }
+
+            // Plain deltas up to the first escape, then the escaped delta itself
+            int n_plain = __builtin_ctz(mask);
+
+            for (int k = 0; k <= n_plain && i < n; k++, i++)
+            {
+                if (!decodeOne(buf, buf_size, &id, &value))
+                {
+                    return -1;
+                }
+
+                storeOne(out, i, value, &max);
+            }
+
+            continue;
+        }
+
+        if (!decodeOne(buf, buf_size, &id, &value))
+        {
+            return -1;
+        }
+
+        storeOne(out, i, value, &max);
+        i++;
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, vmax);
+
+    for (int k = 0; k < 8; k++)
+    {
+        if (max < lanes[k]) max = lanes[k];
+    }
+
+    *prev = value;
+    *max_counts = max;
+
+    return (long) id;
+}
+
+#endif
+
+typedef long (*PROTOTYPE_byteOffsetDecode)(const char *, size_t, float *, size_t, int *, float *);
+
+struct ByteOffsetDecoder
+{
+    PROTOTYPE_byteOffsetDecode function;
+    const char * name;
+};
+
+static ByteOffsetDecoder selectDecoder()
+{
+    ByteOffsetDecoder decoder = {byteOffsetDecodeScalar, "Scalar"};
+
+#ifdef BYTEOFFSET_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        decoder.function = byteOffsetDecodeAVX2;
+        decoder.name = "AVX2";
+    }
+    else if (__builtin_cpu_supports("sse4.1"))
+    {
+        decoder.function = byteOffsetDecodeSSE41;
+        decoder.name = "SSE4.1";
+    }
+#endif
+
+    return decoder;
+}
+
+static const ByteOffsetDecoder & decoder()
+{
+    // Resolved once, on first use
+    static const ByteOffsetDecoder instance = selectDecoder();
+    return instance;
+}
+
+long byteOffsetDecode(const char * buf, size_t buf_size, float * out, size_t n, int * prev, float * max_counts)
+{
+    return decoder().function(buf, buf_size, out, n, prev, max_counts);
+}
+
+long byteOffsetDecodeWindow(const char * buf, size_t buf_size, float * out, size_t fast, size_t x, size_t y, size_t w, size_t h, float * max_counts)
+{
+    QVector<float> row(fast);
+
+    long id = 0;
+    int prev = 0;
+    float max = *max_counts;
+
+    for (size_t j = 0; j < y + h; j++)
+    {
+        float row_max = 0;
+        long n_bytes = byteOffsetDecode(buf + id, buf_size - id, row.data(), fast, &prev, &row_max);
+
+        if (n_bytes < 0)
+        {
+            return -1;
+        }
+
+        id += n_bytes;
+
+        if (j < y)
+        {
+            continue;
+        }
+
+        float * out_row = out + (j - y) * w;
+
+        for (size_t i = 0; i < w; i++)
+        {
+            out_row[i] = row[x + i];
+
+            if (max < out_row[i]) max = out_row[i];
+        }
+    }
+
+    *max_counts = max;
+
+    return id;
+}
+
+const char * byteOffsetDecoderName()
+{
+    return decoder().name;
+}
+
+void byteOffsetEncode(const float * in, size_t n, QByteArray * out)
+{
+    out->clear();
+    out->reserve(n + 64);
+
+    int prev = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        int value = (int) lrintf(in[i]);
+        int delta = value - prev;
+        prev = value;
+
+        if ((delta > -128) && (delta < 128))
+        {
+            out->append((char) delta);
+        }
+        else if ((delta > -32768) && (delta < 32768))
+        {
+            out->append((char) -128);
+            out->append((char) (delta & 0xff));
+            out->append((char) ((delta >> 8) & 0xff));
+        }
+        else
+        {
+            out->append((char) -128);
+            out->append((char) 0x00);
+            out->append((char) 0x80);
+            out->append((char) (delta & 0xff));
+            out->append((char) ((delta >> 8) & 0xff));
+            out->append((char) ((delta >> 16) & 0xff));
+            out->append((char) ((delta >> 24) & 0xff));
+        }
+    }
+}
+
+void byteOffsetBenchmark()
+{
+    // Synthetic PILATUS 6M frames: a low background, a few Bragg peaks, and negative values in the module gaps
+    const int fast = 2463;
+    const int slow = 2527;
+    const int n_frames = 10;
+
+    qDebug() << "Byte offset decoder:" << byteOffsetDecoderName();
+
+    srand(42);
+
+    for (int peak_fraction = 0; peak_fraction <= 2; peak_fraction++)
+    {
+        QVector<float> counts(fast * slow);
+
+        for (int i = 0; i < counts.size(); i++)
+        {
+            int x = i % fast;
+            int y = i / fast;
+
+            if ((x % 494 >= 487) || (y % 212 >= 195))
+            {
+                counts[i] = -1;
+            }
+            else if (rand() % 1000 < peak_fraction * 5)
+            {
+                counts[i] = rand() % 1000000;
+            }
+            else
+            {
+                counts[i] = rand() % 20;
+            }
+        }
+
+        QByteArray stream;
+        byteOffsetEncode(counts.data(), counts.size(), &stream);
+
+        QVector<float> reference(counts.size());
+        QVector<float> result(counts.size());
+
+        QElapsedTimer timer;
+
+        timer.start();
+
+        float max_scalar = 0;
+
+        for (int j = 0; j < n_frames; j++)
+        {
+            int prev = 0;
+            max_scalar = 0;
+            byteOffsetDecodeScalar(stream.data(), stream.size(), reference.data(), reference.size(), &prev, &max_scalar);
+        }
+
+        qint64 t_scalar = timer.restart();
+
+        float max_simd = 0;
+
+        for (int j = 0; j < n_frames; j++)
+        {
+            int prev = 0;
+            max_simd = 0;
+            byteOffsetDecode(stream.data(), stream.size(), result.data(), result.size(), &prev, &max_simd);
+        }
+
+        qint64 t_simd = timer.elapsed();
+
+        bool is_equal = (max_scalar == max_simd) && (reference == result);
+
+        qDebug() << "Peak fraction" << peak_fraction * 0.5 << "%:" << stream.size() / 1e6 << "MB per frame, scalar" << t_scalar / (double) n_frames << "ms, vectorized" << t_simd / (double) n_frames << "ms, identical:" << is_equal;
+    }
+}
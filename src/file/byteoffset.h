@@ -0,0 +1,36 @@
+#ifndef BYTEOFFSET_H
+#define BYTEOFFSET_H
+
+/*
+ * Decompression of the CBF "byte_offset" scheme used by PILATUS detectors. Each pixel is stored as a delta to the
+ * previous pixel. Deltas in [-127, 127] take one byte, larger deltas are escaped by 0x80 followed by a 16 bit value,
+ * which in turn may be escaped by 0x8000 followed by a 32 bit value.
+ * */
+
+#include <cstddef>
+
+class QByteArray;
+
+// Decode n pixels starting at buf. Negative counts are clamped to zero. The running value is read from and written back
+// to *prev so that a frame can be decoded in several calls. The maximum count is accumulated in *max_counts. Returns
+// the number of bytes consumed, or -1 if the stream ended prematurely.
+long byteOffsetDecode(const char * buf, size_t buf_size, float * out, size_t n, int * prev, float * max_counts);
+
+// Same as above, but never uses vector instructions. This is the reference implementation.
+long byteOffsetDecodeScalar(const char * buf, size_t buf_size, float * out, size_t n, int * prev, float * max_counts);
+
+// Decode a frame that is fast pixels wide, but store only the w x h window at (x, y). Every row up to the bottom of the
+// window still has to be decoded to track the running value; rows below it are not touched. The maximum count is taken
+// over the window. Returns the number of bytes consumed, or -1 if the stream ended prematurely.
+long byteOffsetDecodeWindow(const char * buf, size_t buf_size, float * out, size_t fast, size_t x, size_t y, size_t w, size_t h, float * max_counts);
+
+// Encode n pixels, rounded to integers, as a byte offset stream. The inverse of byteOffsetDecode().
+void byteOffsetEncode(const float * in, size_t n, QByteArray * out);
+
+// The name of the instruction set picked at runtime ("AVX2", "SSE4.1" or "Scalar")
+const char * byteOffsetDecoderName();
+
+// Compare the scalar and the vectorized decoder on synthetic frames. Results are written to the debug stream.
+void byteOffsetBenchmark();
+
+#endif // BYTEOFFSET_H
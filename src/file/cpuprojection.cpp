@@ -0,0 +1,481 @@
+#include "cpuprojection.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include "math/rotationmatrix.h"
+#include "file/projectioncontext.h"
+
+#if defined(__SSE2__)
+#define CPUPROJECTION_SSE2
+#include <emmintrin.h>
+#endif
+
+/* The detector frame has its axes like this, looking from the source to the detector in the zero rotation position
+ * (doi:10.1107/S0021889899007347). The fast dimension runs against z, the slow dimension against y.
+ *         y
+ *         ^
+ *         |
+ * z <-----x------ (fast)
+ *         |
+ *       (slow)
+ * */
+
+struct Vec3
+{
+    float x, y, z;
+};
+
+static inline Vec3 scaledNormal(float x, float y, float z, float k)
+{
+    float s = k / std::sqrt(x * x + y * y + z * z);
+
+    Vec3 v = {x * s, y * s, z * s};
+
+    return v;
+}
+
+static inline float crossLength(const Vec3 & a, const Vec3 & b)
+{
+    float x = a.y * b.z - a.z * b.y;
+    float y = a.z * b.x - a.x * b.z;
+    float z = a.x * b.y - a.y * b.x;
+
+    return std::sqrt(x * x + y * y + z * z);
+}
+
+// The area of the pixel projected onto the Ewald sphere, given its four corners there. The two spherical triangles are
+// approximated by planar ones since they are small.
+static inline float spanArea(const Vec3 & a, const Vec3 & b, const Vec3 & c, const Vec3 & d)
+{
+    Vec3 ab = {b.x - a.x, b.y - a.y, b.z - a.z};
+    Vec3 ac = {c.x - a.x, c.y - a.y, c.z - a.z};
+    Vec3 ad = {d.x - a.x, d.y - a.y, d.z - a.z};
+
+    return 0.5f * crossLength(ab, ac) + 0.5f * crossLength(ac, ad);
+}
+
+static inline float forwardProjectedArea(const ProjectionParameters & p, float k)
+{
+    float hx = p.pixel_size_x * 0.5f;
+    float hy = p.pixel_size_y * 0.5f;
+
+    return spanArea(scaledNormal(-p.detector_distance, hx, -hy, k),
+                    scaledNormal(-p.detector_distance, -hx, -hy, k),
+                    scaledNormal(-p.detector_distance, -hx, hy, k),
+                    scaledNormal(-p.detector_distance, hx, hy, k));
+}
+
+// One pixel, with OP the real space vector from the sample to the pixel. Returns false if the pixel is dropped.
+static inline bool projectPixel(float value, float op_x, float op_y, float op_z, float k, float forward_area, const ProjectionParameters & p, xyzw32 * sample)
+{
+    // Flat background subtraction
+    if (p.flat_background_correction)
+    {
+        value = std::min(std::max(value, p.noise_low), value) - p.noise_low;
+    }
+
+    float factor = 1.0f;
+
+    // Correct for the area of the projection of the pixel onto the Ewald sphere
+    if (p.pixel_projection_correction)
+    {
+        float hx = p.pixel_size_x * 0.5f;
+        float hy = p.pixel_size_y * 0.5f;
+
+        float area = spanArea(scaledNormal(op_x, op_y + hx, op_z - hy, k),
+                              scaledNormal(op_x, op_y - hx, op_z - hy, k),
+                              scaledNormal(op_x, op_y - hx, op_z + hy, k),
+                              scaledNormal(op_x, op_y + hx, op_z + hy, k));
+
+        factor *= forward_area / area;
+    }
+
+    Vec3 k_f = scaledNormal(op_x, op_y, op_z, k);
+
+    float q_x = k_f.x + k;
+    float q_y = k_f.y;
+    float q_z = k_f.z;
+
+    // Lorentz correction for rotation around z (omega)
+    if (p.lorentz_correction)
+    {
+        Vec3 n = scaledNormal(k_f.x, k_f.y, k_f.z, 1.0f);
+
+        factor *= p.wavelength * std::fabs(-q_y * n.x + q_x * n.y);
+    }
+
+    float w = factor * value;
+
+    if (!(w > 0.0f))
+    {
+        return false;
+    }
+
+    // Sample rotation
+    sample->x = q_x * p.rotation[0] + q_y * p.rotation[1] + q_z * p.rotation[2];
+    sample->y = q_x * p.rotation[4] + q_y * p.rotation[5] + q_z * p.rotation[6];
+    sample->z = q_x * p.rotation[8] + q_y * p.rotation[9] + q_z * p.rotation[10];
+    sample->w = w;
+
+    return true;
+}
+
+// Project pixels [first, last) of a window row. Also the tail of the vectorized version.
+static void projectRowScalar(const float * row, int first, int last, int row_index, const int * selection, float k, float forward_area, const ProjectionParameters & p, QVector<xyzw32> * samples)
+{
+    float op_x = -p.detector_distance;
+    float op_y = p.pixel_size_x * ((float) (p.slow_dimension - row_index) - 0.5f - p.beam_center_x);
+
+    xyzw32 sample;
+
+    for (int i = first; i < last; i++)
+    {
+        float op_z = p.pixel_size_y * -(((float) (selection[0] + i) + 0.5f) - p.beam_center_y);
+
+        if (projectPixel(row[i], op_x, op_y, op_z, k, forward_area, p, &sample))
+        {
+            samples->append(sample);
+        }
+    }
+}
+
+void cpuProjectWindowScalar(const float * in, const int * selection, const ProjectionParameters & parameters, QVector<xyzw32> * samples)
+{
+    int width = selection[1] - selection[0];
+    int height = selection[3] - selection[2];
+
+    float k = 1.0f / parameters.wavelength;
+    float forward_area = forwardProjectedArea(parameters, k);
+
+    for (int j = 0; j < height; j++)
+    {
+        projectRowScalar(in + (size_t) j * width, 0, width, selection[2] + j, selection, k, forward_area, parameters, samples);
+    }
+}
+
+#ifdef CPUPROJECTION_SSE2
+
+struct Vec3x4
+{
+    __m128 x, y, z;
+};
+
+static inline Vec3x4 scaledNormal4(__m128 x, __m128 y, __m128 z, __m128 k)
+{
+    __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+    __m128 s = _mm_div_ps(k, len);
+
+    Vec3x4 v = {_mm_mul_ps(x, s), _mm_mul_ps(y, s), _mm_mul_ps(z, s)};
+
+    return v;
+}
+
+static inline __m128 crossLength4(const Vec3x4 & a, const Vec3x4 & b)
+{
+    __m128 x = _mm_sub_ps(_mm_mul_ps(a.y, b.z), _mm_mul_ps(a.z, b.y));
+    __m128 y = _mm_sub_ps(_mm_mul_ps(a.z, b.x), _mm_mul_ps(a.x, b.z));
+    __m128 z = _mm_sub_ps(_mm_mul_ps(a.x, b.y), _mm_mul_ps(a.y, b.x));
+
+    return _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+}
+
+static inline __m128 spanArea4(const Vec3x4 & a, const Vec3x4 & b, const Vec3x4 & c, const Vec3x4 & d)
+{
+    Vec3x4 ab = {_mm_sub_ps(b.x, a.x), _mm_sub_ps(b.y, a.y), _mm_sub_ps(b.z, a.z)};
+    Vec3x4 ac = {_mm_sub_ps(c.x, a.x), _mm_sub_ps(c.y, a.y), _mm_sub_ps(c.z, a.z)};
+    Vec3x4 ad = {_mm_sub_ps(d.x, a.x), _mm_sub_ps(d.y, a.y), _mm_sub_ps(d.z, a.z)};
+
+    __m128 half = _mm_set1_ps(0.5f);
+
+    return _mm_add_ps(_mm_mul_ps(half, crossLength4(ab, ac)), _mm_mul_ps(half, crossLength4(ac, ad)));
+}
+
+void cpuProjectWindow(const float * in, const int * selection, const ProjectionParameters & p, QVector<xyzw32> * samples)
+{
+    int width = selection[1] - selection[0];
+    int height = selection[3] - selection[2];
+
+    float k = 1.0f / p.wavelength;
+    float forward_area = forwardProjectedArea(p, k);
+
+    __m128 k4 = _mm_set1_ps(k);
+    __m128 one4 = _mm_set1_ps(1.0f);
+    __m128 zero4 = _mm_setzero_ps();
+    __m128 half4 = _mm_set1_ps(0.5f);
+    __m128 hx4 = _mm_set1_ps(p.pixel_size_x * 0.5f);
+    __m128 hy4 = _mm_set1_ps(p.pixel_size_y * 0.5f);
+    __m128 noise4 = _mm_set1_ps(p.noise_low);
+    __m128 forward_area4 = _mm_set1_ps(forward_area);
+    __m128 wavelength4 = _mm_set1_ps(p.wavelength);
+    __m128 pixel_size_y4 = _mm_set1_ps(p.pixel_size_y);
+    __m128 beam_center_y4 = _mm_set1_ps(p.beam_center_y);
+    __m128 abs_mask4 = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 lane4 = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+
+    __m128 rotation4[9];
+
+    for (int r = 0; r < 3; r++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            rotation4[r * 3 + c] = _mm_set1_ps(p.rotation[r * 4 + c]);
+        }
+    }
+
+    float x[4], y[4], z[4], w[4];
+
+    for (int j = 0; j < height; j++)
+    {
+        const float * row = in + (size_t) j * width;
+        int row_index = selection[2] + j;
+
+        __m128 op_x = _mm_set1_ps(-p.detector_distance);
+        __m128 op_y = _mm_set1_ps(p.pixel_size_x * ((float) (p.slow_dimension - row_index) - 0.5f - p.beam_center_x));
+
+        int i = 0;
+
+        for (; i + 4 <= width; i += 4)
+        {
+            __m128 value = _mm_loadu_ps(row + i);
+
+            // Flat background subtraction
+            if (p.flat_background_correction)
+            {
+                value = _mm_sub_ps(_mm_min_ps(_mm_max_ps(value, noise4), value), noise4);
+            }
+
+            __m128 column = _mm_add_ps(_mm_set1_ps((float) (selection[0] + i)), lane4);
+            __m128 op_z = _mm_mul_ps(pixel_size_y4, _mm_sub_ps(zero4, _mm_sub_ps(_mm_add_ps(column, half4), beam_center_y4)));
+
+            __m128 factor = one4;
+
+            // Correct for the area of the projection of the pixel onto the Ewald sphere
+            if (p.pixel_projection_correction)
+            {
+                __m128 area = spanArea4(scaledNormal4(op_x, _mm_add_ps(op_y, hx4), _mm_sub_ps(op_z, hy4), k4),
+                                        scaledNormal4(op_x, _mm_sub_ps(op_y, hx4), _mm_sub_ps(op_z, hy4), k4),
+                                        scaledNormal4(op_x, _mm_sub_ps(op_y, hx4), _mm_add_ps(op_z, hy4), k4),
+                                        scaledNormal4(op_x, _mm_add_ps(op_y, hx4), _mm_add_ps(op_z, hy4), k4));
+
+                factor = _mm_mul_ps(factor, _mm_div_ps(forward_area4, area));
+            }
+
+            Vec3x4 k_f = scaledNormal4(op_x, op_y, op_z, k4);
+
+            __m128 q_x = _mm_add_ps(k_f.x, k4);
+            __m128 q_y = k_f.y;
+            __m128 q_z = k_f.z;
+
+            // Lorentz correction for rotation around z (omega)
+            if (p.lorentz_correction)
+            {
+                Vec3x4 n = scaledNormal4(k_f.x, k_f.y, k_f.z, one4);
+
+                __m128 lorentz = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(zero4, q_y), n.x), _mm_mul_ps(q_x, n.y));
+
+                factor = _mm_mul_ps(factor, _mm_mul_ps(wavelength4, _mm_and_ps(lorentz, abs_mask4)));
+            }
+
+            __m128 w4 = _mm_mul_ps(factor, value);
+
+            int mask = _mm_movemask_ps(_mm_cmpgt_ps(w4, zero4));
+
+            if (!mask)
+            {
+                continue;
+            }
+
+            // Sample rotation
+            _mm_storeu_ps(x, _mm_add_ps(_mm_add_ps(_mm_mul_ps(q_x, rotation4[0]), _mm_mul_ps(q_y, rotation4[1])), _mm_mul_ps(q_z, rotation4[2])));
+            _mm_storeu_ps(y, _mm_add_ps(_mm_add_ps(_mm_mul_ps(q_x, rotation4[3]), _mm_mul_ps(q_y, rotation4[4])), _mm_mul_ps(q_z, rotation4[5])));
+            _mm_storeu_ps(z, _mm_add_ps(_mm_add_ps(_mm_mul_ps(q_x, rotation4[6]), _mm_mul_ps(q_y, rotation4[7])), _mm_mul_ps(q_z, rotation4[8])));
+            _mm_storeu_ps(w, w4);
+
+            for (int l = 0; l < 4; l++)
+            {
+                if (mask & (1 << l))
+                {
+                    xyzw32 sample = {x[l], y[l], z[l], w[l]};
+                    samples->append(sample);
+                }
+            }
+        }
+
+        projectRowScalar(row, i, width, row_index, selection, k, forward_area, p, samples);
+    }
+}
+
+const char * cpuProjectionName()
+{
+    return "SSE2";
+}
+
+#else
+
+void cpuProjectWindow(const float * in, const int * selection, const ProjectionParameters & parameters, QVector<xyzw32> * samples)
+{
+    cpuProjectWindowScalar(in, selection, parameters, samples);
+}
+
+const char * cpuProjectionName()
+{
+    return "Scalar";
+}
+
+#endif
+
+// Sums of x, y, z and w, and the number of samples
+static void accumulate(const QVector<xyzw32> & samples, double * sum)
+{
+    for (int i = 0; i < samples.size(); i++)
+    {
+        sum[0] += samples[i].x;
+        sum[1] += samples[i].y;
+        sum[2] += samples[i].z;
+        sum[3] += samples[i].w;
+    }
+
+    sum[4] += samples.size();
+}
+
+void cpuProjectionBenchmark(OpenCLContextQueueProgram * context_cl)
+{
+    // A synthetic PILATUS 6M frame: a low background and a few Bragg peaks
+    const int fast = 2463;
+    const int slow = 2527;
+    const int n_frames = 10;
+
+    qDebug() << "CPU projection:" << cpuProjectionName();
+
+    srand(42);
+
+    QVector<float> frame(fast * slow);
+
+    for (int i = 0; i < frame.size(); i++)
+    {
+        frame[i] = (rand() % 1000 < 5) ? rand() % 1000000 : rand() % 20;
+    }
+
+    ProjectionParameters parameters;
+    parameters.fast_dimension = fast;
+    parameters.slow_dimension = slow;
+    parameters.lorentz_correction = 1;
+    parameters.flat_background_correction = 1;
+    parameters.pixel_projection_correction = 1;
+    parameters.detector_distance = 0.3;
+    parameters.beam_center_x = 1263.5;
+    parameters.beam_center_y = 1231.5;
+    parameters.pixel_size_x = 172e-6;
+    parameters.pixel_size_y = 172e-6;
+    parameters.wavelength = 0.7;
+    parameters.noise_low = 2;
+
+    RotationMatrix<double> omega;
+    omega.setZRotation(0.5);
+
+    Matrix<float> rotation = omega.toFloat();
+    memcpy(parameters.rotation, rotation.data(), sizeof(parameters.rotation));
+
+    int selection[4] = {0, fast, 0, slow};
+
+    QVector<xyzw32> reference, result;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    for (int j = 0; j < n_frames; j++)
+    {
+        reference.clear();
+        cpuProjectWindowScalar(frame.constData(), selection, parameters, &reference);
+    }
+
+    qint64 t_scalar = timer.restart();
+
+    for (int j = 0; j < n_frames; j++)
+    {
+        result.clear();
+        cpuProjectWindow(frame.constData(), selection, parameters, &result);
+    }
+
+    qint64 t_simd = timer.elapsed();
+
+    // Both keep pixel order, so the samples can be compared one by one
+    float max_difference = 0;
+
+    if (reference.size() == result.size())
+    {
+        for (int i = 0; i < reference.size(); i++)
+        {
+            float q = std::sqrt(reference[i].x * reference[i].x + reference[i].y * reference[i].y + reference[i].z * reference[i].z);
+
+            max_difference = std::max(max_difference, std::fabs(result[i].x - reference[i].x) / q);
+            max_difference = std::max(max_difference, std::fabs(result[i].y - reference[i].y) / q);
+            max_difference = std::max(max_difference, std::fabs(result[i].z - reference[i].z) / q);
+            max_difference = std::max(max_difference, std::fabs(result[i].w - reference[i].w) / reference[i].w);
+        }
+    }
+
+    qDebug() << reference.size() << "samples per frame, scalar" << t_scalar / (double) n_frames << "ms, vectorized" << t_simd / (double) n_frames << "ms, samples" << (reference.size() == result.size() ? "match" : "differ") << ", max relative difference" << max_difference;
+
+    if (!context_cl)
+    {
+        return;
+    }
+
+    // The same frames through the OpenCL batch path. The samples come back in no particular order, so sums are compared.
+    ProjectionContext * projection_context = ProjectionContext::local(context_cl);
+
+    cl_int info[8] = {0, selection[0], selection[1], selection[2], selection[3], fast, slow, 0};
+
+    float geometry[24] = {parameters.detector_distance, parameters.beam_center_x, parameters.beam_center_y, parameters.pixel_size_x, parameters.pixel_size_y, parameters.wavelength, parameters.noise_low, 0};
+    memcpy(geometry + 8, parameters.rotation, sizeof(parameters.rotation));
+
+    QVector<xyzw32> samples;
+    double cl_sum[5] = {0, 0, 0, 0, 0};
+
+    timer.restart();
+
+    for (int j = 0; j < n_frames; j++)
+    {
+        float * staged = projection_context->stageFrame(frame.size(), info, geometry);
+
+        if (!staged)
+        {
+            projection_context->launch(parameters.lorentz_correction, parameters.flat_background_correction, parameters.pixel_projection_correction, &samples);
+            accumulate(samples, cl_sum);
+
+            staged = projection_context->stageFrame(frame.size(), info, geometry);
+        }
+
+        memcpy(staged, frame.constData(), frame.size() * sizeof(float));
+    }
+
+    if (projection_context->isStaged())
+    {
+        projection_context->launch(parameters.lorentz_correction, parameters.flat_background_correction, parameters.pixel_projection_correction, &samples);
+        accumulate(samples, cl_sum);
+    }
+
+    projection_context->drain(&samples);
+    accumulate(samples, cl_sum);
+
+    qint64 t_cl = timer.elapsed();
+
+    double sum[5] = {0, 0, 0, 0, 0};
+    accumulate(result, sum);
+
+    double max_sum_difference = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        max_sum_difference = std::max(max_sum_difference, std::fabs(cl_sum[i] / n_frames - sum[i]) / std::fabs(sum[i]));
+    }
+
+    qDebug() << "OpenCL" << t_cl / (double) n_frames << "ms per frame including transfers," << cl_sum[4] / n_frames << "samples per frame, max relative difference of the sums" << max_sum_difference;
+}
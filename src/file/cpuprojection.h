@@ -0,0 +1,52 @@
+#ifndef CPUPROJECTION_H
+#define CPUPROJECTION_H
+
+/*
+ * Correction and projection of detector pixels onto the Ewald sphere without OpenCL. The arithmetic follows
+ * correctProjectPixel in kernels/scattering_data_operations.cl step by step, so results agree with the OpenCL path to
+ * within float rounding. Pixels are treated four at a time along the fast dimension with SSE2 where available.
+ * */
+
+#include <QVector>
+
+#include "../misc/smallstuff.h"
+
+class OpenCLContextQueueProgram;
+
+struct ProjectionParameters
+{
+    // Frame size, needed for the geometry
+    int fast_dimension;
+    int slow_dimension;
+
+    int lorentz_correction;
+    int flat_background_correction;
+    int pixel_projection_correction;
+
+    float detector_distance;
+    float beam_center_x;
+    float beam_center_y;
+    float pixel_size_x;
+    float pixel_size_y;
+    float wavelength;
+    float noise_low;
+
+    // The sample rotation, 4x4 and row major
+    float rotation[16];
+};
+
+// Correct and project a window (left, right, top, bottom) of a frame. The window is stored row by row at in. Samples
+// with an intensity above zero after the corrections are appended to *samples in pixel order.
+void cpuProjectWindow(const float * in, const int * selection, const ProjectionParameters & parameters, QVector<xyzw32> * samples);
+
+// Same as above, but never uses vector instructions. This is the reference implementation.
+void cpuProjectWindowScalar(const float * in, const int * selection, const ProjectionParameters & parameters, QVector<xyzw32> * samples);
+
+// The name of the instruction set in use ("SSE2" or "Scalar")
+const char * cpuProjectionName();
+
+// Compare the scalar and the vectorized projection on a synthetic frame, and both against the OpenCL batch path if a
+// context is given. Results are written to the debug stream.
+void cpuProjectionBenchmark(OpenCLContextQueueProgram * context_cl);
+
+#endif // CPUPROJECTION_H
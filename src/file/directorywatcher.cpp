@@ -0,0 +1,101 @@
+#include "directorywatcher.h"
+
+#include <QDir>
+#include <QFileInfo>
+
+DirectoryWatcher::DirectoryWatcher(QObject * parent) :
+    QObject(parent)
+{
+    p_name_filters << "*.cbf";
+
+    p_poll_timer.setInterval(500);
+
+    connect(&p_watcher, SIGNAL(directoryChanged(QString)), this, SLOT(scan()));
+    connect(&p_poll_timer, SIGNAL(timeout()), this, SLOT(poll()));
+}
+
+void DirectoryWatcher::setPath(const QString & path)
+{
+    stop();
+
+    p_path = QDir(path).absolutePath();
+    p_watcher.addPath(p_path);
+
+    scan();
+}
+
+QString DirectoryWatcher::path() const
+{
+    return p_path;
+}
+
+void DirectoryWatcher::setNameFilters(const QStringList & filters)
+{
+    p_name_filters = filters;
+}
+
+void DirectoryWatcher::setPollInterval(int msec)
+{
+    p_poll_timer.setInterval(msec);
+}
+
+void DirectoryWatcher::stop()
+{
+    if (!p_watcher.directories().isEmpty()) p_watcher.removePaths(p_watcher.directories());
+
+    p_poll_timer.stop();
+    p_path.clear();
+    p_known_paths.clear();
+    p_pending_paths.clear();
+}
+
+void DirectoryWatcher::scan()
+{
+    if (p_path.isEmpty()) return;
+
+    QFileInfoList entries = QDir(p_path).entryInfoList(p_name_filters, QDir::Files, QDir::Name);
+
+    foreach (const QFileInfo &info, entries)
+    {
+        QString file_path = info.absoluteFilePath();
+
+        if (!p_known_paths.contains(file_path) && !p_pending_paths.contains(file_path)) p_pending_paths[file_path] = -1;
+    }
+
+    if (!p_pending_paths.isEmpty() && !p_poll_timer.isActive()) p_poll_timer.start();
+}
+
+void DirectoryWatcher::poll()
+{
+    QStringList arrived;
+
+    QMutableMapIterator<QString, qint64> i(p_pending_paths);
+    while (i.hasNext())
+    {
+        i.next();
+
+        QFileInfo info(i.key());
+
+        if (!info.exists())
+        {
+            i.remove();
+            continue;
+        }
+
+        // Unchanged since the last poll, so presumably written in full
+        if ((info.size() > 0) && (info.size() == i.value()))
+        {
+            arrived << i.key();
+            p_known_paths << i.key();
+            i.remove();
+        }
+        else
+        {
+            i.setValue(info.size());
+        }
+    }
+
+    if (p_pending_paths.isEmpty()) p_poll_timer.stop();
+
+    if (!arrived.isEmpty()) emit filesArrived(arrived);
+}
@@ -0,0 +1,50 @@
+#ifndef DIRECTORYWATCHER_H
+#define DIRECTORYWATCHER_H
+
+/*
+ * Watches a directory for new detector frames. A frame is reported once its size has stayed the same between two polls,
+ * so that files that are still being written are not read half way.
+ * */
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QMap>
+#include <QSet>
+#include <QTimer>
+#include <QFileSystemWatcher>
+
+class DirectoryWatcher : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit DirectoryWatcher(QObject * parent = 0);
+
+    // Frames already in the directory are reported as well
+    void setPath(const QString & path);
+    QString path() const;
+
+    void setNameFilters(const QStringList & filters);
+    void setPollInterval(int msec);
+    void stop();
+
+signals:
+    void filesArrived(QStringList paths);
+
+private slots:
+    void scan();
+    void poll();
+
+private:
+    QFileSystemWatcher p_watcher;
+    QTimer p_poll_timer;
+    QString p_path;
+    QStringList p_name_filters;
+
+    // Files that have been reported, and files that were last seen with the given size
+    QSet<QString> p_known_paths;
+    QMap<QString, qint64> p_pending_paths;
+};
+
+#endif // DIRECTORYWATCHER_H
@@ -11,9 +11,25 @@
 #include <QMutexLocker>
 
 #include "math/rotationmatrix.h"
+#include "file/byteoffset.h"
+#include "file/framecache.h"
+#include "file/framestack.h"
+#include "file/projectioncontext.h"
+#include "file/cpuprojection.h"
 #include "misc/smallstuff.h"
 
 #include <limits>
+#include <cmath>
+#include <cstring>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#endif
+
+static const qint64 HEADER_LENGTH_MAX = 4096;
+static const size_t BINARY_OFFSET_MAX = 2000;
+
+QAtomicInt DetectorFile::p_is_cpu_projection(0);
 
 QDebug operator<<(QDebug dbg, const DetectorFile &file)
 {
@@ -34,8 +50,10 @@ DetectorFile::DetectorFile() :
     p_alpha(0.8735582),
     p_beta(0.000891863),
     p_is_data_read(false),
+    p_is_data_cropped(false),
     p_is_header_read(false),
-    p_max_counts(0)
+    p_max_counts(0),
+    p_linear_octree(NULL)
 {
 
 }
@@ -43,6 +61,7 @@ DetectorFile::DetectorFile() :
 DetectorFile::DetectorFile(const DetectorFile &other) :
     p_is_header_read(other.p_is_header_read),
     p_is_data_read(other.p_is_data_read),
+    p_is_data_cropped(other.p_is_data_cropped),
     p_alpha(other.p_alpha),
     p_beta(other.p_beta),
     p_detector(other.p_detector),
@@ -59,6 +78,29 @@ DetectorFile::DetectorFile(const DetectorFile &other) :
     p_kappa(other.p_kappa),
     p_phi(other.p_phi),
     p_omega(other.p_omega),
+    p_silicon_sensor_thickness(other.p_silicon_sensor_thickness),
+    p_exposure_period(other.p_exposure_period),
+    p_tau(other.p_tau),
+    p_count_cutoff(other.p_count_cutoff),
+    p_threshold_setting(other.p_threshold_setting),
+    p_n_excluded_pixels(other.p_n_excluded_pixels),
+    p_gain_setting(other.p_gain_setting),
+    p_excluded_pixels(other.p_excluded_pixels),
+    p_flat_field(other.p_flat_field),
+    p_time_file(other.p_time_file),
+    p_image_path(other.p_image_path),
+    p_energy_range_low(other.p_energy_range_low),
+    p_energy_range_high(other.p_energy_range_high),
+    p_detector_voffset(other.p_detector_voffset),
+    p_filter_transmission(other.p_filter_transmission),
+    p_detector_2theta(other.p_detector_2theta),
+    p_polarization(other.p_polarization),
+    p_chi(other.p_chi),
+    p_n_oscillations(other.p_n_oscillations),
+    p_start_position(other.p_start_position),
+    p_position_increment(other.p_position_increment),
+    p_shutter_time(other.p_shutter_time),
+    p_max_counts(other.p_max_counts),
     p_srchrad_sugg_low(other.p_srchrad_sugg_low),
     p_srchrad_sugg_high(other.p_srchrad_sugg_high),
     p_file_path(other.p_file_path),
@@ -70,7 +112,8 @@ DetectorFile::DetectorFile(const DetectorFile &other) :
     p_context_cl(other.p_context_cl),
     p_area_selection(other.p_area_selection),
     p_correction_args(other.p_correction_args),
-    p_interpolation_octree(other.p_interpolation_octree)
+    p_interpolation_octree(other.p_interpolation_octree),
+    p_linear_octree(other.p_linear_octree)
 //    p_mutex(other.p_mutex)
 {
 }
@@ -78,6 +121,7 @@ DetectorFile::DetectorFile(const DetectorFile &other) :
 DetectorFile::DetectorFile(DetectorFile &&other) :
     p_is_header_read(std::move(other.p_is_header_read)),
     p_is_data_read(std::move(other.p_is_data_read)),
+    p_is_data_cropped(std::move(other.p_is_data_cropped)),
     p_alpha(std::move(other.p_alpha)),
     p_beta(std::move(other.p_beta)),
     p_detector(std::move(other.p_detector)),
@@ -94,6 +138,29 @@ DetectorFile::DetectorFile(DetectorFile &&other) :
     p_kappa(std::move(other.p_kappa)),
     p_phi(std::move(other.p_phi)),
     p_omega(std::move(other.p_omega)),
+    p_silicon_sensor_thickness(std::move(other.p_silicon_sensor_thickness)),
+    p_exposure_period(std::move(other.p_exposure_period)),
+    p_tau(std::move(other.p_tau)),
+    p_count_cutoff(std::move(other.p_count_cutoff)),
+    p_threshold_setting(std::move(other.p_threshold_setting)),
+    p_n_excluded_pixels(std::move(other.p_n_excluded_pixels)),
+    p_gain_setting(std::move(other.p_gain_setting)),
+    p_excluded_pixels(std::move(other.p_excluded_pixels)),
+    p_flat_field(std::move(other.p_flat_field)),
+    p_time_file(std::move(other.p_time_file)),
+    p_image_path(std::move(other.p_image_path)),
+    p_energy_range_low(std::move(other.p_energy_range_low)),
+    p_energy_range_high(std::move(other.p_energy_range_high)),
+    p_detector_voffset(std::move(other.p_detector_voffset)),
+    p_filter_transmission(std::move(other.p_filter_transmission)),
+    p_detector_2theta(std::move(other.p_detector_2theta)),
+    p_polarization(std::move(other.p_polarization)),
+    p_chi(std::move(other.p_chi)),
+    p_n_oscillations(std::move(other.p_n_oscillations)),
+    p_start_position(std::move(other.p_start_position)),
+    p_position_increment(std::move(other.p_position_increment)),
+    p_shutter_time(std::move(other.p_shutter_time)),
+    p_max_counts(std::move(other.p_max_counts)),
     p_srchrad_sugg_low(std::move(other.p_srchrad_sugg_low)),
     p_srchrad_sugg_high(std::move(other.p_srchrad_sugg_high)),
     p_file_path(std::move(other.p_file_path)),
@@ -105,7 +172,8 @@ DetectorFile::DetectorFile(DetectorFile &&other) :
     p_context_cl(std::move(other.p_context_cl)),
     p_area_selection(std::move(other.p_area_selection)),
     p_correction_args(std::move(other.p_correction_args)),
-    p_interpolation_octree(std::move(other.p_interpolation_octree))
+    p_interpolation_octree(std::move(other.p_interpolation_octree)),
+    p_linear_octree(std::move(other.p_linear_octree))
 //    p_mutex(std::move(other.p_mutex))
 {
 }
@@ -124,8 +192,10 @@ DetectorFile::DetectorFile(QString path):
     p_alpha(0.8735582),
     p_beta(0.000891863),
     p_is_data_read(false),
+    p_is_data_cropped(false),
     p_is_header_read(false),
-    p_max_counts(0)
+    p_max_counts(0),
+    p_linear_octree(NULL)
 {
     this->setPath(path);
 }
@@ -180,6 +250,7 @@ void DetectorFile::swap(DetectorFile & other)
     std::swap(this->p_max_counts, other.p_max_counts);
     std::swap(this->p_is_header_read, other.p_is_header_read);
     std::swap(this->p_is_data_read, other.p_is_data_read);
+    std::swap(this->p_is_data_cropped, other.p_is_data_cropped);
     std::swap(this->p_srchrad_sugg_low, other.p_srchrad_sugg_low);
     std::swap(this->p_srchrad_sugg_high, other.p_srchrad_sugg_high);
     std::swap(this->p_file_path, other.p_file_path);
@@ -193,9 +264,74 @@ void DetectorFile::swap(DetectorFile & other)
     std::swap(this->p_area_selection, other.p_area_selection);
     std::swap(this->p_correction_args, other.p_correction_args);
     std::swap(this->p_interpolation_octree, other.p_interpolation_octree);
+    std::swap(this->p_linear_octree, other.p_linear_octree);
 //    std::swap(this->p_mutex, other.p_mutex);
 }
 
+void DetectorFile::copyDecoded(const DetectorFile & other)
+{
+    // Header keywords and pixel data only. Path, selection and processing settings stay as they are
+    p_detector = other.p_detector;
+    p_pixel_size_x = other.p_pixel_size_x;
+    p_pixel_size_y = other.p_pixel_size_y;
+    p_silicon_sensor_thickness = other.p_silicon_sensor_thickness;
+    p_exposure_time = other.p_exposure_time;
+    p_exposure_period = other.p_exposure_period;
+    p_tau = other.p_tau;
+    p_count_cutoff = other.p_count_cutoff;
+    p_threshold_setting = other.p_threshold_setting;
+    p_n_excluded_pixels = other.p_n_excluded_pixels;
+    p_gain_setting = other.p_gain_setting;
+    p_excluded_pixels = other.p_excluded_pixels;
+    p_flat_field = other.p_flat_field;
+    p_time_file = other.p_time_file;
+    p_image_path = other.p_image_path;
+    p_wavelength = other.p_wavelength;
+    p_energy_range_low = other.p_energy_range_low;
+    p_energy_range_high = other.p_energy_range_high;
+    p_detector_distance = other.p_detector_distance;
+    p_detector_voffset = other.p_detector_voffset;
+    p_beam_center_x = other.p_beam_center_x;
+    p_beam_center_y = other.p_beam_center_y;
+    p_flux = other.p_flux;
+    p_filter_transmission = other.p_filter_transmission;
+    p_start_angle = other.p_start_angle;
+    p_angle_increment = other.p_angle_increment;
+    p_detector_2theta = other.p_detector_2theta;
+    p_polarization = other.p_polarization;
+    p_kappa = other.p_kappa;
+    p_phi = other.p_phi;
+    p_chi = other.p_chi;
+    p_omega = other.p_omega;
+    p_n_oscillations = other.p_n_oscillations;
+    p_start_position = other.p_start_position;
+    p_position_increment = other.p_position_increment;
+    p_shutter_time = other.p_shutter_time;
+    p_max_counts = other.p_max_counts;
+    p_is_header_read = other.p_is_header_read;
+    p_is_data_read = other.p_is_data_read;
+    p_is_data_cropped = other.p_is_data_cropped;
+    p_srchrad_sugg_low = other.p_srchrad_sugg_low;
+    p_srchrad_sugg_high = other.p_srchrad_sugg_high;
+    p_fast_dimension = other.p_fast_dimension;
+    p_slow_dimension = other.p_slow_dimension;
+    p_data_buf = other.p_data_buf;
+
+    clampSelection();
+}
+
+void DetectorFile::clampSelection()
+{
+    if (p_area_selection.width() < 0) p_area_selection.setWidth(0);
+    if (p_area_selection.width() > p_fast_dimension) p_area_selection.setWidth(p_fast_dimension);
+    if (p_area_selection.height() < 0) p_area_selection.setHeight(0);
+    if (p_area_selection.height() > p_slow_dimension) p_area_selection.setHeight(p_slow_dimension);
+
+    // The selection may still reach past the frame if it is offset
+    QRect frame_area = p_area_selection.intersected(QRect(0, 0, p_fast_dimension, p_slow_dimension));
+    p_area_selection.setRect(frame_area.left(), frame_area.top(), frame_area.width(), frame_area.height());
+}
+
 QString DetectorFile::detector() const
 {
     return p_detector;
@@ -206,18 +342,43 @@ float DetectorFile::wavelength()  const
     return p_wavelength;
 }
 
+void DetectorFile::setCpuProjection(bool value)
+{
+    p_is_cpu_projection.store(value);
+}
+
+bool DetectorFile::isCpuProjection()
+{
+    return p_is_cpu_projection.load();
+}
+
 bool DetectorFile::isValid()
 {
+    QString stack_path;
+    int index;
+
+    if (FrameStack::isFramePath(p_file_path, &stack_path, &index))
+    {
+        QSharedPointer<FrameStack> stack = FrameStack::open(stack_path);
+
+        return stack && (index >= 0) && (index < stack->size());
+    }
+
     QFileInfo info(p_file_path);
     return  (info.exists() && info.isReadable() && info.isFile());
 }
 
-bool DetectorFile::isDataRead()
+bool DetectorFile::isDataRead() const
 {
     return p_is_data_read;
 }
 
-bool DetectorFile::isHeaderRead()
+bool DetectorFile::isDataCropped() const
+{
+    return p_is_data_cropped;
+}
+
+bool DetectorFile::isHeaderRead() const
 {
     return p_is_header_read;
 }
@@ -227,6 +388,7 @@ void DetectorFile::setPath(QString path)
     if (p_file_path != path)
     {
         p_is_data_read = false;
+        p_is_data_cropped = false;
         p_is_header_read = false;
 
         QFileInfo info(path);
@@ -240,6 +402,14 @@ void DetectorFile::setPath(QString path)
 void DetectorFile::setSubImage(Selection & area)
 {
     p_area_selection = area;
+
+    // Cropped data no longer matches the selection
+    if (p_is_data_cropped) clearData();
+}
+
+const Selection & DetectorFile::subImage() const
+{
+    return p_area_selection;
 }
 
 void DetectorFile::setCorrectionArgs(DataCorrectionArgs & args)
@@ -257,6 +427,11 @@ void DetectorFile::setInterpolationTree(SearchNode * tree)
     p_interpolation_octree = tree;
 }
 
+void DetectorFile::setLinearOctree(LinearOctree * tree)
+{
+    p_linear_octree = tree;
+}
+
 //void DetectorFile::setMutex(QMutex * mutex)
 //{
 //    p_mutex = mutex;
@@ -364,114 +539,147 @@ int DetectorFile::readHeader()
     {
         return p_is_header_read;
     }
-    const float pi = 4.0 * atan(1.0);
 
-    // Based on the PILATUS 1.2 header convention. Regular expressions are used to fetch header values
-    QString reqExpDetector("(?:Detector:\\s+)(\\S+\\s+\\S+),");
-    QString reqExpTime("(?:Exposure_time\\s+)(\\d+(?:\\.\\d+)?)");
-    QString reqPixSizex("(?:Pixel_size\\s+)(\\d+(?:\\.\\d+)?e[+-]\\d+)");
-    QString reqPixSizey("(?:Pixel_size\\s+)(?:\\d+(?:\\.\\d+)?e[+-]\\d+)\\sm\\sx\\s(\\d+(?:\\.\\d+)?e[+-]\\d+)");
+    if (fetchFromCache())
+    {
+        return p_is_header_read;
+    }
 
-    QString optExpWl( "Wavelength\\s+(\\d+(?:\\.\\d+)?)" );
-    QString optExpStAng( "Start_angle\\s+(\\d+(?:\\.\\d+)?)" );
-    QString optExpAngInc( "Angle_increment\\s+(\\d+(?:\\.\\d+)?)" );
-    QString optExpFlux( "Flux\\s+(\\d+(?:\\.\\d+)?)" );
-    QString optExpDd( "Detector_distance\\s+(-?\\d+(?:\\.\\d+)?)" );
-    QString optExpBeamx( "Beam_xy\\s+\\((-?\\d+(?:\\.\\d+)?)" );
-    QString optExpBeamy( "Beam_xy\\s+\\((?:-?\\d+(?:\\.\\d+)?)(?:\\s*\\,\\s*)(-?\\d+(?:\\.\\d+)?)" );
-    QString optExpPhi( "Phi\\s+(-?\\d+(?:\\.\\d+)?)" );
-    QString optExpKappa( "Kappa\\s+(-?\\d+(?:\\.\\d+)?)" );
-    QString optExpOmega( "Omega\\s+(-?\\d+(?:\\.\\d+)?)" );
+    return readHeaderFile();
+}
 
-    // Open file
+int DetectorFile::readHeaderFile(bool is_regexp)
+{
+    if (FrameStack::isFramePath(p_file_path))
+    {
+        return readStack(true, false);
+    }
+
+    QFile file(p_file_path);
+
+    if (!openFile(file))
+    {
+        return 0;
+    }
+
+    // Only the pages holding the header are mapped
+    qint64 header_size = qMin(file.size(), (qint64) HEADER_LENGTH_MAX);
+
+    uchar * map = file.map(0, header_size);
+
+    if (!map)
+    {
+        qDebug() << "Error mapping file: " << p_file_path;
+        return 0;
+    }
+
+    int is_header_read = parseHeader(reinterpret_cast<const char *>(map), header_size, is_regexp);
+
+    file.unmap(map);
+
+    return is_header_read;
+}
+
+bool DetectorFile::fetchFromCache()
+{
+    DetectorFile cached;
+
+    if (!FrameCache::instance().find(p_file_path, &cached))
+    {
+        return false;
+    }
+
+    copyDecoded(cached);
+
+    return true;
+}
+
+bool DetectorFile::openFile(QFile & file)
+{
     QFileInfo file_info(p_file_path);
 
     if (!file_info.exists())
     {
         qDebug() << "File does not exist: " << p_file_path.toStdString().c_str();
-        return 0;
+        return false;
     }
     else if (file_info.size() <= 0)
     {
         qDebug() << "File does not exist: " << p_file_path;
-        return 0;
+        return false;
     }
 
-    // Read file
-    QFile file(p_file_path.toStdString().c_str());
-
     if (!file.open(QIODevice::ReadOnly))
     {
         qDebug() << "Error reading file: " << p_file_path;
-        return 0;
+        return false;
     }
 
-    QString header = file.read(4096);
-    file.close();
+    return true;
+}
 
-    // Fetch keywords
-    p_detector = regExp(reqExpDetector, header, 0, 1);
-    p_pixel_size_x = regExp(reqPixSizex, header, 0, 1).toFloat();
-    p_pixel_size_y = regExp(reqPixSizey, header, 0, 1).toFloat();
-    p_exposure_time = regExp(reqExpTime, header, 0, 1).toFloat();
-    p_wavelength = regExp(optExpWl, header, 0, 1).toFloat();
-    p_detector_distance = regExp(optExpDd, header, 0, 1).toFloat();
-    p_beam_center_x = regExp(optExpBeamx, header, 0, 1).toFloat();
-    p_beam_center_y = regExp(optExpBeamy, header, 0, 1).toFloat();
-    p_flux = regExp(optExpFlux, header, 0, 1).toFloat();
-    p_start_angle = regExp(optExpStAng, header, 0, 1).toFloat() * pi / 180.0;
-    p_angle_increment = regExp(optExpAngInc, header, 0, 1).toFloat() * pi / 180.0;
+int DetectorFile::parseHeader(const char * buf, size_t size, bool is_regexp)
+{
+    // Keywords that are missing from the header read as zero
+    p_detector.clear();
+    p_pixel_size_x = p_pixel_size_y = 0;
+    p_silicon_sensor_thickness = 0;
+    p_exposure_time = p_exposure_period = p_tau = 0;
+    p_count_cutoff = p_threshold_setting = p_n_excluded_pixels = 0;
+    p_gain_setting.clear();
+    p_excluded_pixels.clear();
+    p_flat_field.clear();
+    p_time_file.clear();
+    p_image_path.clear();
+
+    p_wavelength = 0;
+    p_energy_range_low = p_energy_range_high = 0;
+    p_detector_distance = p_detector_voffset = 0;
+    p_beam_center_x = p_beam_center_y = 0;
+    p_flux = p_filter_transmission = 0;
+    p_start_angle = p_angle_increment = 0;
+    p_detector_2theta = p_polarization = 0;
+    p_kappa = p_phi = p_chi = p_omega = 0;
+    p_n_oscillations = 0;
+    p_start_position = p_position_increment = p_shutter_time = 0;
+
+    bool is_omega_defined = false;
+    bool is_kappa_defined = false;
+    bool is_phi_defined = false;
+
+    if (is_regexp)
+    {
+        parseHeaderRegExp(buf, size, &is_omega_defined, &is_kappa_defined, &is_phi_defined);
+    }
+    else
+    {
+        parseHeaderTokens(buf, size, &is_omega_defined, &is_kappa_defined, &is_phi_defined);
+    }
 
-    // Check if defined. If two are defined, the third is active. In any other case, omega is active. Unless the active angle is directly specified.
-    QString omega_str = regExp(optExpOmega, header, 0, 1);
-    QString kappa_str = regExp(optExpKappa, header, 0, 1);
-    QString phi_str = regExp(optExpPhi, header, 0, 1);
+    const float pi = 4.0 * atan(1.0);
 
-    p_omega = omega_str.toFloat() * pi / 180.0;
-    p_kappa = kappa_str.toFloat() * pi / 180.0;
-    p_phi = phi_str.toFloat() * pi / 180.0;
+    p_start_angle *= pi / 180.0;
+    p_angle_increment *= pi / 180.0;
+    p_omega *= pi / 180.0;
+    p_kappa *= pi / 180.0;
+    p_phi *= pi / 180.0;
+    p_chi *= pi / 180.0;
+    p_detector_2theta *= pi / 180.0;
 
-    int num_defined_angles = ((omega_str != "")? 1 : 0) + ((kappa_str != "")? 1 : 0) + ((phi_str != "")? 1 : 0);
+    // Check if defined. If two are defined, the third is active. In any other case, omega is active. Unless the active angle is directly specified.
+    int num_defined_angles = (is_omega_defined ? 1 : 0) + (is_kappa_defined ? 1 : 0) + (is_phi_defined ? 1 : 0);
 
     if (num_defined_angles == 2)
     {
-        if (omega_str == "") p_omega = (p_start_angle+0.5*p_angle_increment);
-        else if (kappa_str == "") p_kappa = (p_start_angle+0.5*p_angle_increment);
-        else if (phi_str == "") p_phi = (p_start_angle+0.5*p_angle_increment);
+        if (!is_omega_defined) p_omega = (p_start_angle+0.5*p_angle_increment);
+        else if (!is_kappa_defined) p_kappa = (p_start_angle+0.5*p_angle_increment);
+        else if (!is_phi_defined) p_phi = (p_start_angle+0.5*p_angle_increment);
     }
     else
     {
         p_omega = (p_start_angle+0.5*p_angle_increment);
     }
 
-    //~ silicon_sensor_thickness = regExp(, header, 0, 1).toFloat();
-    //~ exposure_period = regExp(, header, 0, 1).toFloat();
-    //~ tau = regExp(, header, 0, 1).toFloat();
-    //~ count_cutoff = regExp(, header, 0, 1).toInt();
-    //~ threshold_setting = regExp(, header, 0, 1).toInt();
-    //~ gain_setting = regExp(, header, 0, 1);
-    //~ n_excluded_pixels = regExp(, header, 0, 1).toInt();
-    //~ excluded_pixels = regExp(, header, 0, 1);
-    //~ flat_field = regExp(, header, 0, 1);
-    //~ time_file = regExp(, header, 0, 1);
-    //~ image_path = regExp(, header, 0, 1);
-    //~ energy_range_low = regExp(, header, 0, 1).toInt();
-    //~ energy_range_high = regExp(, header, 0, 1).toInt();
-    //~ detector_voffset = regExp(, header, 0, 1).toFloat();
-    //~ filter_transmission = regExp(, header, 0, 1).toFloat();
-    //~ detector_2theta = regExp(, header, 0, 1).toFloat()*pi/180.0;
-    //~ polarization = regExp(, header, 0, 1).toFloat();
-    //~ alpha = regExp(, header, 0, 1).toFloat()*pi/180.0;
-    //~ phi_increment = regExp(, header, 0, 1).toFloat()*pi/180.0;
-    //~ chi = regExp(, header, 0, 1).toFloat()*pi/180.0;
-    //~ chi_increment = regExp(, header, 0, 1).toFloat()*pi/180.0;
-    //~ omega_increment = regExp(, header, 0, 1).toFloat()*pi/180.0;
-    //~ oscillation_axis = regExp(, header, 0, 1);
-    //~ n_oscillations = regExp(, header, 0, 1).toInt();
-    //~ start_position = regExp(, header, 0, 1).toFloat();
-    //~ position_increment = regExp(, header, 0, 1).toFloat();
-    //~ shutter_time = regExp(, header, 0, 1).toFloat();
-
     if (p_detector == "PILATUS 1M")
     {
         p_fast_dimension = 981;
@@ -494,28 +702,299 @@ int DetectorFile::readHeader()
     }
 
     this->setSearchRadiusHint();
-
-    if (p_area_selection.width() < 0) p_area_selection.setWidth(0);
-    if (p_area_selection.width() > p_fast_dimension) p_area_selection.setWidth(p_fast_dimension);
-    if (p_area_selection.height() < 0) p_area_selection.setHeight(0);
-    if (p_area_selection.height() > p_slow_dimension) p_area_selection.setHeight(p_slow_dimension);
+    this->clampSelection();
 
     p_is_header_read = true;
     return p_is_header_read;
 }
 
-QString DetectorFile::filePath() const
+void DetectorFile::parseHeaderRegExp(const char * buf, size_t size, bool * is_omega_defined, bool * is_kappa_defined, bool * is_phi_defined)
+{
+    // Based on the PILATUS 1.2 header convention. Regular expressions are used to fetch header values
+    QString reqExpDetector("(?:Detector:\\s+)(\\S+\\s+\\S+),");
+    QString reqExpTime("(?:Exposure_time\\s+)(\\d+(?:\\.\\d+)?)");
+    QString reqPixSizex("(?:Pixel_size\\s+)(\\d+(?:\\.\\d+)?e[+-]\\d+)");
+    QString reqPixSizey("(?:Pixel_size\\s+)(?:\\d+(?:\\.\\d+)?e[+-]\\d+)\\sm\\sx\\s(\\d+(?:\\.\\d+)?e[+-]\\d+)");
+
+    QString optExpWl( "Wavelength\\s+(\\d+(?:\\.\\d+)?)" );
+    QString optExpStAng( "Start_angle\\s+(\\d+(?:\\.\\d+)?)" );
+    QString optExpAngInc( "Angle_increment\\s+(\\d+(?:\\.\\d+)?)" );
+    QString optExpFlux( "Flux\\s+(\\d+(?:\\.\\d+)?)" );
+    QString optExpDd( "Detector_distance\\s+(-?\\d+(?:\\.\\d+)?)" );
+    QString optExpBeamx( "Beam_xy\\s+\\((-?\\d+(?:\\.\\d+)?)" );
+    QString optExpBeamy( "Beam_xy\\s+\\((?:-?\\d+(?:\\.\\d+)?)(?:\\s*\\,\\s*)(-?\\d+(?:\\.\\d+)?)" );
+    QString optExpPhi( "Phi\\s+(-?\\d+(?:\\.\\d+)?)" );
+    QString optExpKappa( "Kappa\\s+(-?\\d+(?:\\.\\d+)?)" );
+    QString optExpOmega( "Omega\\s+(-?\\d+(?:\\.\\d+)?)" );
+
+    QString header = QString::fromLatin1(buf, size);
+
+    // Fetch keywords. Angles are in degrees
+    p_detector = regExp(reqExpDetector, header, 0, 1);
+    p_pixel_size_x = regExp(reqPixSizex, header, 0, 1).toFloat();
+    p_pixel_size_y = regExp(reqPixSizey, header, 0, 1).toFloat();
+    p_exposure_time = regExp(reqExpTime, header, 0, 1).toFloat();
+    p_wavelength = regExp(optExpWl, header, 0, 1).toFloat();
+    p_detector_distance = regExp(optExpDd, header, 0, 1).toFloat();
+    p_beam_center_x = regExp(optExpBeamx, header, 0, 1).toFloat();
+    p_beam_center_y = regExp(optExpBeamy, header, 0, 1).toFloat();
+    p_flux = regExp(optExpFlux, header, 0, 1).toFloat();
+    p_start_angle = regExp(optExpStAng, header, 0, 1).toFloat();
+    p_angle_increment = regExp(optExpAngInc, header, 0, 1).toFloat();
+
+    QString omega_str = regExp(optExpOmega, header, 0, 1);
+    QString kappa_str = regExp(optExpKappa, header, 0, 1);
+    QString phi_str = regExp(optExpPhi, header, 0, 1);
+
+    p_omega = omega_str.toFloat();
+    p_kappa = kappa_str.toFloat();
+    p_phi = phi_str.toFloat();
+
+    *is_omega_defined = (omega_str != "");
+    *is_kappa_defined = (kappa_str != "");
+    *is_phi_defined = (phi_str != "");
+}
+
+/* Helpers for the header tokenizer. They work on [p, end) and return the position after whatever was consumed. */
+
+static inline bool isSpace(char c)
+{
+    return (c == ' ') || (c == '\t') || (c == '\r');
+}
+
+static inline bool isDigit(char c)
+{
+    return (c >= '0') && (c <= '9');
+}
+
+static const char * skipSpace(const char * p, const char * end)
+{
+    while ((p < end) && isSpace(*p)) p++;
+    return p;
+}
+
+// Skip to the next character that can start a number
+static const char * skipToNumber(const char * p, const char * end)
+{
+    while ((p < end) && (*p != '\n') && !isDigit(*p) && (*p != '-') && (*p != '+') && (*p != '.')) p++;
+    return p;
+}
+
+// Parse [+-]digits[.digits][(e|E)[+-]digits]
+static const char * parseNumber(const char * p, const char * end, double * value, bool * ok)
+{
+    const char * begin = p;
+    bool is_negative = false;
+
+    if ((p < end) && ((*p == '-') || (*p == '+')))
+    {
+        is_negative = (*p == '-');
+        p++;
+    }
+
+    double mantissa = 0;
+    int exponent = 0;
+    int n_digits = 0;
+
+    while ((p < end) && isDigit(*p))
+    {
+        mantissa = mantissa * 10.0 + (*p - '0');
+        n_digits++;
+        p++;
+    }
+
+    if ((p < end) && (*p == '.'))
+    {
+        p++;
+
+        while ((p < end) && isDigit(*p))
+        {
+            mantissa = mantissa * 10.0 + (*p - '0');
+            exponent--;
+            n_digits++;
+            p++;
+        }
+    }
+
+    if (n_digits == 0)
+    {
+        *ok = false;
+        return begin;
+    }
+
+    if ((p + 1 < end) && ((*p == 'e') || (*p == 'E')) && (isDigit(p[1]) || (((p[1] == '-') || (p[1] == '+')) && (p + 2 < end) && isDigit(p[2]))))
+    {
+        p++;
+
+        bool is_exponent_negative = (*p == '-');
+
+        if ((*p == '-') || (*p == '+')) p++;
+
+        int e = 0;
+
+        while ((p < end) && isDigit(*p))
+        {
+            e = e * 10 + (*p - '0');
+            p++;
+        }
+
+        exponent += is_exponent_negative ? -e : e;
+    }
+
+    // Exact to double precision for the short values found in headers, which is more than a float needs
+    if (exponent < 0) mantissa /= pow(10.0, -exponent);
+    else if (exponent > 0) mantissa *= pow(10.0, exponent);
+
+    *value = is_negative ? -mantissa : mantissa;
+    *ok = true;
+
+    return p;
+}
+
+static const char * parseFloat(const char * p, const char * end, float * value, bool * ok = NULL)
 {
-    return p_file_path;
+    double d = 0;
+    bool is_ok;
+
+    p = parseNumber(skipToNumber(p, end), end, &d, &is_ok);
+
+    if (is_ok) *value = d;
+    if (ok) *ok = is_ok;
+
+    return p;
+}
+
+static const char * parseInt(const char * p, const char * end, int * value)
+{
+    double d = 0;
+    bool is_ok;
+
+    p = parseNumber(skipToNumber(p, end), end, &d, &is_ok);
+
+    if (is_ok) *value = (int) d;
+
+    return p;
 }
 
-QString DetectorFile::fileName() const
+// The rest of the line, without surrounding white space
+static QString lineString(const char * p, const char * end)
 {
-    return p_file_name;
+    p = skipSpace(p, end);
+
+    const char * eol = p;
+
+    while ((eol < end) && (*eol != '\n')) eol++;
+    while ((eol > p) && isSpace(eol[-1])) eol--;
+
+    return QString::fromLatin1(p, eol - p);
 }
-QString DetectorFile::dir() const
+
+static inline bool isKey(const char * key, size_t key_length, const char * name)
 {
-    return p_dir;
+    return (strlen(name) == key_length) && (memcmp(key, name, key_length) == 0);
+}
+
+void DetectorFile::parseHeaderTokens(const char * buf, size_t size, bool * is_omega_defined, bool * is_kappa_defined, bool * is_phi_defined)
+{
+    // Single sweep over the PILATUS 1.2 header. Each line reads "# Key value", where the key may be followed by ':' or '='
+    const char * p = buf;
+    const char * end = buf + size;
+
+    while (p < end)
+    {
+        // The binary section starts with a form feed. Nothing past it is text.
+        if (*p == '\f')
+        {
+            break;
+        }
+
+        if (*p != '#')
+        {
+            while ((p < end) && (*p != '\n')) p++;
+            p++;
+            continue;
+        }
+
+        p = skipSpace(p + 1, end);
+
+        const char * key = p;
+
+        while ((p < end) && ((*p == '_') || isDigit(*p) || ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'z'))) p++;
+
+        size_t key_length = p - key;
+
+        while ((p < end) && (isSpace(*p) || (*p == ':') || (*p == '='))) p++;
+
+        if (isKey(key, key_length, "Detector"))
+        {
+            // "PILATUS 6M, S/N 60-0100"
+            const char * comma = p;
+
+            while ((comma < end) && (*comma != ',') && (*comma != '\n')) comma++;
+
+            p_detector = QString::fromLatin1(p, comma - p).trimmed();
+        }
+        else if (isKey(key, key_length, "Pixel_size"))
+        {
+            // "172e-6 m x 172e-6 m"
+            p = parseFloat(p, end, &p_pixel_size_x);
+
+            while ((p < end) && (*p != 'x') && (*p != '\n')) p++;
+
+            p = parseFloat(p, end, &p_pixel_size_y);
+        }
+        else if (isKey(key, key_length, "Silicon"))
+        {
+            // "sensor, thickness 0.000320 m"
+            while ((p < end) && (*p != ',') && (*p != '\n')) p++;
+
+            p = parseFloat(p, end, &p_silicon_sensor_thickness);
+        }
+        else if (isKey(key, key_length, "Exposure_time")) p = parseFloat(p, end, &p_exposure_time);
+        else if (isKey(key, key_length, "Exposure_period")) p = parseFloat(p, end, &p_exposure_period);
+        else if (isKey(key, key_length, "Tau")) p = parseFloat(p, end, &p_tau);
+        else if (isKey(key, key_length, "Count_cutoff")) p = parseInt(p, end, &p_count_cutoff);
+        else if (isKey(key, key_length, "Threshold_setting")) p = parseInt(p, end, &p_threshold_setting);
+        else if (isKey(key, key_length, "Gain_setting")) p_gain_setting = lineString(p, end);
+        else if (isKey(key, key_length, "N_excluded_pixels")) p = parseInt(p, end, &p_n_excluded_pixels);
+        else if (isKey(key, key_length, "Excluded_pixels")) p_excluded_pixels = lineString(p, end);
+        else if (isKey(key, key_length, "Flat_field")) p_flat_field = lineString(p, end);
+        else if (isKey(key, key_length, "Trim_file") || isKey(key, key_length, "Time_file")) p_time_file = lineString(p, end);
+        else if (isKey(key, key_length, "Image_path")) p_image_path = lineString(p, end);
+        else if (isKey(key, key_length, "Wavelength")) p = parseFloat(p, end, &p_wavelength);
+        else if (isKey(key, key_length, "Energy_range"))
+        {
+            // "(0, 0)"
+            p = parseInt(p, end, &p_energy_range_low);
+            p = parseInt(p, end, &p_energy_range_high);
+        }
+        else if (isKey(key, key_length, "Detector_distance")) p = parseFloat(p, end, &p_detector_distance);
+        else if (isKey(key, key_length, "Detector_Voffset")) p = parseFloat(p, end, &p_detector_voffset);
+        else if (isKey(key, key_length, "Beam_xy"))
+        {
+            // "(1231.50, 1263.50)"
+            p = parseFloat(p, end, &p_beam_center_x);
+            p = parseFloat(p, end, &p_beam_center_y);
+        }
+        else if (isKey(key, key_length, "Flux")) p = parseFloat(p, end, &p_flux);
+        else if (isKey(key, key_length, "Filter_transmission")) p = parseFloat(p, end, &p_filter_transmission);
+        else if (isKey(key, key_length, "Start_angle")) p = parseFloat(p, end, &p_start_angle);
+        else if (isKey(key, key_length, "Angle_increment")) p = parseFloat(p, end, &p_angle_increment);
+        else if (isKey(key, key_length, "Detector_2theta")) p = parseFloat(p, end, &p_detector_2theta);
+        else if (isKey(key, key_length, "Polarization")) p = parseFloat(p, end, &p_polarization);
+        // Alpha is skipped on purpose. p_alpha is the kappa axis tilt of the goniometer, not the header value
+        else if (isKey(key, key_length, "Kappa")) p = parseFloat(p, end, &p_kappa, is_kappa_defined);
+        else if (isKey(key, key_length, "Phi")) p = parseFloat(p, end, &p_phi, is_phi_defined);
+        else if (isKey(key, key_length, "Chi")) p = parseFloat(p, end, &p_chi);
+        else if (isKey(key, key_length, "Omega")) p = parseFloat(p, end, &p_omega, is_omega_defined);
+        else if (isKey(key, key_length, "N_oscillations")) p = parseInt(p, end, &p_n_oscillations);
+        else if (isKey(key, key_length, "Start_position")) p = parseFloat(p, end, &p_start_position);
+        else if (isKey(key, key_length, "Position_increment")) p = parseFloat(p, end, &p_position_increment);
+        else if (isKey(key, key_length, "Shutter_time")) p = parseFloat(p, end, &p_shutter_time);
+
+        while ((p < end) && (*p != '\n')) p++;
+        p++;
+    }
 }
 
 QString DetectorFile::regExp(QString &str, QString &source, size_t offset, size_t i)
@@ -538,6 +1017,7 @@ void DetectorFile::clearData()
 {
     p_data_buf.clear();
     p_is_data_read = false;
+    p_is_data_cropped = false;
 }
 
 QString DetectorFile::info()
@@ -594,25 +1074,151 @@ float DetectorFile::pixSizeY() const
 
 
 int DetectorFile::readBody()
+{
+    if (p_is_data_read && !p_is_data_cropped)
+    {
+        return p_is_data_read;
+    }
+
+    if (fetchFromCache())
+    {
+        return p_is_data_read;
+    }
+
+    int is_data_read = readFile(false);
+
+    if (is_data_read)
+    {
+        FrameCache::instance().insert(p_file_path, *this);
+    }
+
+    return is_data_read;
+}
+
+int DetectorFile::readSubImage()
 {
     if (p_is_data_read)
     {
+        if (!p_is_data_cropped) cropData();
+        return p_is_data_read;
+    }
+
+    // A full frame in the cache is cheaper to crop than decoding the window from file
+    if (fetchFromCache())
+    {
+        cropData();
         return p_is_data_read;
     }
 
+    return readFile(true);
+}
+
+int DetectorFile::readFile(bool is_cropped)
+{
+    if (FrameStack::isFramePath(p_file_path))
+    {
+        return readStack(false, is_cropped);
+    }
+
     QFile file(p_file_path);
 
-    if (!file.open(QIODevice::ReadOnly)) qDebug() << "Failed to open file" << p_file_path;
-    QByteArray blob = file.readAll();
-    file.close();
+    if (!openFile(file))
+    {
+        return 0;
+    }
+
+    // The header and the binary section are both read straight out of one mapping of the file
+    qint64 size = file.size();
+
+    uchar * map = file.map(0, size);
+
+    if (!map)
+    {
+        qDebug() << "Error mapping file: " << p_file_path;
+        return 0;
+    }
+
+#ifdef Q_OS_UNIX
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+#endif
+
+    const char * buf = reinterpret_cast<const char *>(map);
+
+    int is_data_read = 0;
+
+    if (p_is_header_read || parseHeader(buf, qMin(size, (qint64) HEADER_LENGTH_MAX)))
+    {
+        is_data_read = decodeBody(buf, size, is_cropped);
+    }
+
+    file.unmap(map);
+
+    return is_data_read;
+}
+
+int DetectorFile::readStack(bool is_header_only, bool is_cropped)
+{
+    QString stack_path;
+    int index;
+
+    FrameStack::isFramePath(p_file_path, &stack_path, &index);
+
+    QSharedPointer<FrameStack> stack = FrameStack::open(stack_path);
+
+    if (!stack || (index < 0) || (index >= stack->size()))
+    {
+        qDebug() << "Frame does not exist: " << p_file_path;
+        return 0;
+    }
+
+    const FrameStackEntry & entry = stack->entry(index);
+
+    if (!p_is_header_read)
+    {
+        FrameStack::fromEntry(entry, this);
+    }
+
+    if (is_header_only)
+    {
+        return p_is_header_read;
+    }
+
+    if (entry.compression == FrameStack::ByteOffset)
+    {
+        return decodeByteOffset(stack->payload(index), entry.bytes, is_cropped);
+    }
+
+    if (entry.bytes < p_fast_dimension * p_slow_dimension * sizeof(float))
+    {
+        qDebug() << "Unexpected end of frame: " << p_file_path;
+        return 0;
+    }
 
-    int offset = 0;
-    int header_length_max = 2000;
-    char * buf = blob.data();//new char[length];
-    this->p_data_buf.resize(p_fast_dimension * p_slow_dimension);
+    // Uncompressed payloads are aligned and can be copied straight out of the mapping
+    const float * frame = reinterpret_cast<const float *>(stack->payload(index));
+
+    if (is_cropped)
+    {
+        copyWindow(frame);
+    }
+    else
+    {
+        p_data_buf.resize(p_fast_dimension * p_slow_dimension);
+        memcpy(p_data_buf.data(), frame, p_data_buf.size() * sizeof(float));
+        p_max_counts = entry.max_counts;
+    }
+
+    p_is_data_cropped = is_cropped;
+    p_is_data_read = true;
+    return p_is_data_read;
+}
+
+int DetectorFile::decodeBody(const char * buf, size_t size, bool is_cropped)
+{
+    size_t offset = 0;
 
     // Find beginning of binary section
-    for (int i = 0; i < header_length_max; i++)
+    for (size_t i = 0; (i < BINARY_OFFSET_MAX) && (i < size); i++)
     {
         if ((int) buf[i] == -43)
         {
@@ -621,121 +1227,153 @@ int DetectorFile::readBody()
         }
     }
 
-    // Decompress data and neglect data outside given thresholds
-    int prev = 0;
-    int id = offset;
-    int counts;
-    int int16;
-    int int32;
+    return decodeByteOffset(buf + offset, size - offset, is_cropped);
+}
+
+int DetectorFile::decodeByteOffset(const char * buf, size_t size, bool is_cropped)
+{
+    // Decompress data
+    long n_bytes;
+    p_max_counts = 0;
 
-    int i, j;
+    if (is_cropped)
+    {
+        this->p_data_buf.resize(p_area_selection.width() * p_area_selection.height());
 
-    for (i = 0; i < (int) p_slow_dimension; i++)
+        n_bytes = byteOffsetDecodeWindow(buf, size, p_data_buf.data(), p_fast_dimension, p_area_selection.left(), p_area_selection.top(), p_area_selection.width(), p_area_selection.height(), &p_max_counts);
+    }
+    else
     {
-        for (j = 0; j < (int) p_fast_dimension; j++)
-        {
-            // Get value
-            if (buf[id] == (char) -128)
-            {
-                id++;
-                int16 =  ((buf[id + 1] << 8 ) | (buf[id] & 0xff));
-
-                if (int16 == -32768)
-                {
-                    id += 2;
-                    int32 = ((buf[id + 3] << 24) | ((buf[id + 2] & 0xff) << 16) | ((buf[id + 1] & 0xff) << 8) | (buf[id] & 0xff));
-                    counts = prev + int32;
-                    id += 4;
-                }
-                else
-                {
-                    counts = prev + int16;
-                    id += 2;
-                }
-            }
-            else
-            {
-                counts = prev + (int) (buf[id]);
-                id++;
-            }
-
-
-
-            prev = counts;
-
-
-            if (counts < 0)
-            {
-                counts = 0;
-            }
-
-
-//            qDebug() << i * fast_dimension + j << data_buf.size();
-            p_data_buf[i * p_fast_dimension + j] = (float) counts;
-
-            if (p_max_counts < counts)
-            {
-                p_max_counts = counts;
-            }
-        }
+        this->p_data_buf.resize(p_fast_dimension * p_slow_dimension);
+
+        int prev = 0;
+        n_bytes = byteOffsetDecode(buf, size, p_data_buf.data(), p_data_buf.size(), &prev, &p_max_counts);
     }
 
+    if (n_bytes < 0)
+    {
+        qDebug() << "Unexpected end of binary section: " << p_file_path;
+        return 0;
+    }
+
+    p_is_data_cropped = is_cropped;
     p_is_data_read = true;
     return p_is_data_read;
 }
 
-void DetectorFile::populateInterpolationTree()
+void DetectorFile::cropData()
 {
-    // Read header and body
-    readHeader();
-    readBody();
+    copyWindow(p_data_buf.constData());
+    p_is_data_cropped = true;
+}
 
-    // Load OpenCL dynamically
-    initializeOpenCLFunctions();
+void DetectorFile::copyWindow(const float * frame)
+{
+    QVector<float> window(p_area_selection.width() * p_area_selection.height());
 
-    cl_kernel cl_correct_data =  QOpenCLCreateKernel(p_context_cl->program(), "correctScatteringData", &err);
-    if ( err != CL_SUCCESS)
+    p_max_counts = 0;
+
+    for (int j = 0; j < p_area_selection.height(); j++)
     {
-        qFatal(cl_error_cstring(err));
+        for (int i = 0; i < p_area_selection.width(); i++)
+        {
+            float value = frame[(p_area_selection.top() + j) * p_fast_dimension + p_area_selection.left() + i];
+
+            window[j * p_area_selection.width() + i] = value;
+
+            if (p_max_counts < value) p_max_counts = value;
+        }
     }
 
-    cl_kernel cl_project_data = QOpenCLCreateKernel(p_context_cl->program(), "projectScatteringData", &err);
-    if ( err != CL_SUCCESS)
+    p_data_buf = window;
+}
+
+void DetectorFile::populateInterpolationTree(bool is_cpu_projection)
+{
+    // Read header and the part of the body that lies within the selection
+    if (!readSubImage())
     {
-        qFatal(cl_error_cstring(err));
+        return;
+    }
+
+    size_t window_width = p_area_selection.width();
+    size_t window_height = p_area_selection.height();
+
+    if (window_width * window_height == 0)
+    {
+        return;
     }
 
-    // Data correction from here on
-    cl_mem raw_data_cl =  QOpenCLCreateBuffer( p_context_cl->context(),
-                         CL_MEM_COPY_HOST_PTR,
-                         p_fast_dimension * p_slow_dimension * sizeof(cl_float),
-                         p_data_buf.data(),
-                         &err);
+    if (is_cpu_projection)
+    {
+        projectCpu();
+        return;
+    }
+
+    // Load OpenCL dynamically
+    initializeOpenCLFunctions();
+
+    // Kernels and buffers are owned by the calling thread and reused from frame to frame
+    ProjectionContext * projection_context = ProjectionContext::local(p_context_cl);
+
+    cl_kernel cl_project_data = projection_context->projectKernel();
+
+    size_t n_pixels = window_width * window_height;
+
+    // Upload the raw data
+    cl_mem raw_data_cl = projection_context->rawBuffer(n_pixels * sizeof(cl_float));
+
+    err =   QOpenCLEnqueueWriteBuffer(p_context_cl->queue(),
+                                      raw_data_cl,
+                                      CL_TRUE,
+                                      0,
+                                      n_pixels * sizeof(cl_float),
+                                      p_data_buf.constData(),
+                                      0, NULL, NULL);
     if ( err != CL_SUCCESS)
     {
         qFatal(cl_error_cstring(err));
     }
 
-    err =   QOpenCLFinish(p_context_cl->queue());
+    clearData();
+
+    Matrix<float> sample_rotation_matrix = sampleRotation();
+
+    cl_mem sample_rotation_matrix_cl = projection_context->rotationBuffer(sample_rotation_matrix.bytes());
 
+    err =   QOpenCLEnqueueWriteBuffer(p_context_cl->queue(),
+                                      sample_rotation_matrix_cl,
+                                      CL_TRUE,
+                                      0,
+                                      sample_rotation_matrix.bytes(),
+                                      sample_rotation_matrix.data(),
+                                      0, NULL, NULL);
     if ( err != CL_SUCCESS)
     {
         qFatal(cl_error_cstring(err));
     }
 
-    clearData();
+    // The kernel counts the samples it keeps
+    cl_mem projected_data_cl = projection_context->projectedBuffer(n_pixels * sizeof(cl_float4));
+    cl_mem n_samples_cl = projection_context->countBuffer();
+
+    cl_int n_samples = 0;
 
-    cl_mem corrected_data_cl =  QOpenCLCreateBuffer( p_context_cl->context(),
-                               CL_MEM_ALLOC_HOST_PTR,
-                               p_fast_dimension * p_slow_dimension * sizeof(cl_float),
-                               NULL,
-                               &err);
+    err =   QOpenCLEnqueueWriteBuffer(p_context_cl->queue(),
+                                      n_samples_cl,
+                                      CL_TRUE,
+                                      0,
+                                      sizeof(cl_int),
+                                      &n_samples,
+                                      0, NULL, NULL);
     if ( err != CL_SUCCESS)
     {
         qFatal(cl_error_cstring(err));
     }
 
-    // Prepare kernel parameters
+    // Prepare kernel parameters. The kernel runs over the selection only, but needs the frame size for the geometry
+    Matrix<int> selection = p_area_selection.lrtb();
+
     Matrix<int> image_size(1, 2);
     image_size[0] = p_fast_dimension;
     image_size[1] = p_slow_dimension;
@@ -745,75 +1383,81 @@ void DetectorFile::populateInterpolationTree()
     local_ws[1] = 1;
 
     Matrix<size_t> global_ws(1, 2);
-    global_ws[0] = p_fast_dimension + (local_ws[0] - p_fast_dimension % local_ws[0]);
-    global_ws[1] = p_slow_dimension + (local_ws[1] - p_slow_dimension % local_ws[1]);
+    global_ws[0] = window_width + (local_ws[0] - window_width % local_ws[0]);
+    global_ws[1] = window_height + (local_ws[1] - window_height % local_ws[1]);
 
-//    qDebug() << p_correction_args.lorentz_correction << p_correction_args.flat_background_correction << p_correction_args.planar_background_correction << p_correction_args.polarization_correction;
-//    qDebug() << p_correction_args.flux_correction << p_correction_args.exposure_time_correction << p_correction_args.pixel_projection_correction << p_beam_center_x << p_beam_center_y << p_correction_args.noise_low << p_correction_args.noise_high;
+//    qDebug() << p_pixel_size_x << p_pixel_size_y << p_wavelength << p_detector_distance << p_beam_center_x << p_beam_center_y << p_start_angle << p_angle_increment << p_kappa << p_phi << p_omega;
 
     // Set kernel parameters
-    err =   QOpenCLSetKernelArg(cl_correct_data,  0, sizeof(cl_mem), (void *) &raw_data_cl);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 1, sizeof(cl_mem), (void *) &corrected_data_cl);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 2, sizeof(cl_int2), image_size.data());
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 3, sizeof(cl_int), &p_correction_args.lorentz_correction);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 4, sizeof(cl_int), &p_correction_args.flat_background_correction);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 5, sizeof(cl_int), &p_correction_args.planar_background_correction);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 6, sizeof(cl_int), &p_correction_args.polarization_correction);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 7, sizeof(cl_int), &p_correction_args.flux_correction);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 8, sizeof(cl_int), &p_correction_args.exposure_time_correction);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 9, sizeof(cl_int), &p_correction_args.pixel_projection_correction);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 10, sizeof(cl_float), &p_detector_distance);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 11, sizeof(cl_float), &p_beam_center_x);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 12, sizeof(cl_float), &p_beam_center_y);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 13, sizeof(cl_float), &p_pixel_size_x);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 14, sizeof(cl_float), &p_pixel_size_y);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 15, sizeof(cl_float), &p_wavelength);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 16, sizeof(cl_float), &p_flux);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 17, sizeof(cl_float), &p_exposure_time);
-    err |=   QOpenCLSetKernelArg(cl_correct_data, 18, sizeof(cl_float), &p_correction_args.noise_low);
+    err =   QOpenCLSetKernelArg(cl_project_data,  0, sizeof(cl_mem), (void *) &raw_data_cl);
+    err |=   QOpenCLSetKernelArg(cl_project_data, 1, sizeof(cl_mem), (void *) &projected_data_cl);
+    err |=   QOpenCLSetKernelArg(cl_project_data, 2, sizeof(cl_mem), (void *) &n_samples_cl);
+    err |=   QOpenCLSetKernelArg(cl_project_data, 3, sizeof(cl_mem), (void *) &sample_rotation_matrix_cl);
+    err |=   QOpenCLSetKernelArg(cl_project_data, 4, sizeof(cl_int2), image_size.data());
+    err |=   QOpenCLSetKernelArg(cl_project_data, 5, sizeof(cl_int), &p_correction_args.lorentz_correction);
+    err |=   QOpenCLSetKernelArg(cl_project_data, 6, sizeof(cl_int), &p_correction_args.flat_background_correction);
+    err |=   QOpenCLSetKernelArg(cl_project_data, 7, sizeof(cl_int), &p_correction_args.pixel_projection_correction);
+    err |=   QOpenCLSetKernelArg(cl_project_data, 8, sizeof(cl_float), &p_detector_distance);
+    err |=   QOpenCLSetKernelArg(cl_project_data, 9, sizeof(cl_float), &p_beam_center_x);
+    err |=   QOpenCLSetKernelArg(cl_project_data, 10, sizeof(cl_float), &p_beam_center_y);
+    err |=   QOpenCLSetKernelArg(cl_project_data, 11, sizeof(cl_float), &p_pixel_size_x);
+    err |=   QOpenCLSetKernelArg(cl_project_data, 12, sizeof(cl_float), &p_pixel_size_y);
+    err |=   QOpenCLSetKernelArg(cl_project_data, 13, sizeof(cl_float), &p_wavelength);
+    err |=   QOpenCLSetKernelArg(cl_project_data, 14, sizeof(cl_float), &p_correction_args.noise_low);
+    err |=   QOpenCLSetKernelArg(cl_project_data, 15, sizeof(cl_int4), selection.data());
     if ( err != CL_SUCCESS)
     {
         qFatal(cl_error_cstring(err));
     }
 
     // Launch the kernel
-    err =   QOpenCLEnqueueNDRangeKernel(p_context_cl->queue(), cl_correct_data, 2, NULL, global_ws.data(), local_ws.data(), 0, NULL, NULL);
+    err =   QOpenCLEnqueueNDRangeKernel(p_context_cl->queue(), cl_project_data, 2, NULL, global_ws.data(), local_ws.data(), 0, NULL, NULL);
 
     if ( err != CL_SUCCESS)
     {
         qFatal(cl_error_cstring(err));
     }
 
-    err =   QOpenCLFinish(p_context_cl->queue());
+    // Retrieve the result. The blocking read of the count also waits for the kernel, and only the kept samples are read
+    err =   QOpenCLEnqueueReadBuffer ( p_context_cl->queue(),
+                                       n_samples_cl,
+                                       CL_TRUE,
+                                       0,
+                                       sizeof(cl_int),
+                                       &n_samples,
+                                       0, NULL, NULL);
 
     if ( err != CL_SUCCESS)
     {
         qFatal(cl_error_cstring(err));
     }
 
-    err = QOpenCLReleaseKernel(cl_correct_data);
-    if ( err != CL_SUCCESS)
+    if (n_samples <= 0)
     {
-        qFatal(cl_error_cstring(err));
+        return;
     }
 
-    err = QOpenCLReleaseMemObject(raw_data_cl);
-    if ( err != CL_SUCCESS)
-    {
-        qFatal(cl_error_cstring(err));
-    }
+    QVector<xyzw32> samples(n_samples);
+
+    err =   QOpenCLEnqueueReadBuffer ( p_context_cl->queue(),
+                                       projected_data_cl,
+                                       CL_TRUE,
+                                       0,
+                                       n_samples * sizeof(cl_float4),
+                                       samples.data(),
+                                       0, NULL, NULL);
 
-    // Ewald projection from here on
-    cl_mem projected_data_cl = QOpenCLCreateBuffer( p_context_cl->context(),
-                                                 CL_MEM_ALLOC_HOST_PTR,
-                                                 p_fast_dimension * p_slow_dimension * sizeof(cl_float4),
-                                                 NULL,
-                                                 &err);
     if ( err != CL_SUCCESS)
     {
         qFatal(cl_error_cstring(err));
     }
 
+    insertSamples(samples);
+}
+
+
+Matrix<float> DetectorFile::sampleRotation() const
+{
     // Sample rotation matrix to be applied to each projected pixel to account for rotations. First set the active angle. Ideally this would be given by the header file, but for some reason it is not stated in there. Maybe it is just so normal to rotate around the omega angle to keep the resolution function consistent
     RotationMatrix<double> PHI;
     RotationMatrix<double> KAPPA;
@@ -827,142 +1471,145 @@ void DetectorFile::populateInterpolationTree()
     RotationMatrix<double> sampleRotMat;
     sampleRotMat = PHI * KAPPA * OMEGA;
 
-    cl_mem sample_rotation_matrix_cl = QOpenCLCreateBuffer(p_context_cl->context(),
-                                       CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                       sampleRotMat.toFloat().bytes(),
-                                       sampleRotMat.toFloat().data(),
-                                       &err);
+    return sampleRotMat.toFloat();
+}
 
-    if ( err != CL_SUCCESS)
-    {
-        qFatal(cl_error_cstring(err));
-    }
+void DetectorFile::projectCpu()
+{
+    ProjectionParameters parameters;
+    parameters.fast_dimension = (int) p_fast_dimension;
+    parameters.slow_dimension = (int) p_slow_dimension;
+    parameters.lorentz_correction = p_correction_args.lorentz_correction;
+    parameters.flat_background_correction = p_correction_args.flat_background_correction;
+    parameters.pixel_projection_correction = p_correction_args.pixel_projection_correction;
+    parameters.detector_distance = p_detector_distance;
+    parameters.beam_center_x = p_beam_center_x;
+    parameters.beam_center_y = p_beam_center_y;
+    parameters.pixel_size_x = p_pixel_size_x;
+    parameters.pixel_size_y = p_pixel_size_y;
+    parameters.wavelength = p_wavelength;
+    parameters.noise_low = p_correction_args.noise_low;
+
+    Matrix<float> sample_rotation_matrix = sampleRotation();
+    memcpy(parameters.rotation, sample_rotation_matrix.data(), sizeof(parameters.rotation));
+
+    Matrix<int> selection = p_area_selection.lrtb();
+
+    QVector<xyzw32> samples;
+    cpuProjectWindow(p_data_buf.constData(), selection.data(), parameters, &samples);
 
-//    qDebug() << p_pixel_size_x << p_pixel_size_y << p_wavelength << p_detector_distance << p_beam_center_x << p_beam_center_y << p_start_angle << p_angle_increment << p_kappa << p_phi << p_omega;
+    clearData();
 
-    // Set kernel arguments
-    err  = QOpenCLSetKernelArg(cl_project_data, 0, sizeof(cl_mem), (void *) &projected_data_cl);
-    err |= QOpenCLSetKernelArg(cl_project_data, 1, sizeof(cl_mem), (void *) &corrected_data_cl);
-    err |= QOpenCLSetKernelArg(cl_project_data, 2, sizeof(cl_mem), (void *) &sample_rotation_matrix_cl);
-    err |= QOpenCLSetKernelArg(cl_project_data, 3, sizeof(cl_float), &p_pixel_size_x);
-    err |= QOpenCLSetKernelArg(cl_project_data, 4, sizeof(cl_float), &p_pixel_size_y);
-    err |= QOpenCLSetKernelArg(cl_project_data, 5, sizeof(cl_float), &p_wavelength);
-    err |= QOpenCLSetKernelArg(cl_project_data, 6, sizeof(cl_float), &p_detector_distance);
-    err |= QOpenCLSetKernelArg(cl_project_data, 7, sizeof(cl_float), &p_beam_center_x);
-    err |= QOpenCLSetKernelArg(cl_project_data, 8, sizeof(cl_float), &p_beam_center_y);
-    err |= QOpenCLSetKernelArg(cl_project_data, 9, sizeof(cl_float), &p_start_angle);
-    err |= QOpenCLSetKernelArg(cl_project_data, 10, sizeof(cl_float), &p_angle_increment);
-    err |= QOpenCLSetKernelArg(cl_project_data, 11, sizeof(cl_float), &p_kappa);
-    err |= QOpenCLSetKernelArg(cl_project_data, 12, sizeof(cl_float), &p_phi);
-    err |= QOpenCLSetKernelArg(cl_project_data, 13, sizeof(cl_float), &p_omega);
-    err |= QOpenCLSetKernelArg(cl_project_data, 14, sizeof(cl_int4), p_area_selection.lrtb().data());
-    err |= QOpenCLSetKernelArg(cl_project_data, 15, sizeof(cl_int2), image_size.data());
+    insertSamples(samples);
+}
 
-    if ( err != CL_SUCCESS)
+void DetectorFile::populateInterpolationTreeBatch(QList<DetectorFile> & frames, bool is_cpu_projection)
+{
+    if (frames.isEmpty())
     {
-        qFatal(cl_error_cstring(err));
+        return;
     }
 
-    // Launch kernel
-    err = QOpenCLEnqueueNDRangeKernel(p_context_cl->queue(), cl_project_data, 2, NULL, global_ws.data(), local_ws.data(), 0, NULL, NULL);
-
-    if ( err != CL_SUCCESS)
+    if (is_cpu_projection)
     {
-        qFatal(cl_error_cstring(err));
-    }
+        for (int i = 0; i < frames.size(); i++)
+        {
+            frames[i].populateInterpolationTree(true);
+        }
 
-    QOpenCLFinish(p_context_cl->queue());
-    if ( err != CL_SUCCESS)
-    {
-        qFatal(cl_error_cstring(err));
+        return;
     }
 
-    // Retrieve result
-    Matrix<size_t> host_origin(1, 3, 0);
-
-    Matrix<size_t> buffer_origin(1,3);
-    buffer_origin[0] = p_area_selection.left()*sizeof(cl_float4); // In bytes
-    buffer_origin[1] = p_area_selection.top(); // In elements
-    buffer_origin[2] = 0;
-
-    Matrix<size_t> region(1,3);
-    region[0] = p_area_selection.width()*sizeof(cl_float4);
-    region[1] = p_area_selection.height();
-    region[2] = 1;
-
-    Matrix<float> finalized_data(p_area_selection.height(), p_area_selection.width() * 4);
-//    buffer_origin.print();
-//    host_origin.print();
-//    region.print();
-
-//    qDebug() << p_fast_dimension << p_slow_dimension << p_area_selection.width() << p_area_selection.height();
-//    qDebug() << p_area_selection;
-
-    err =   QOpenCLEnqueueReadBufferRect ( p_context_cl->queue(), // Bytes vs elements
-                                           projected_data_cl,
-                                           CL_TRUE,
-                                           buffer_origin.data(),
-                                           host_origin.data(),
-                                           region.data(),
-                                           p_fast_dimension * sizeof(cl_float4),
-                                           p_fast_dimension * p_slow_dimension * sizeof(cl_float4),
-                                           p_area_selection.width() * sizeof(cl_float4),
-                                           p_area_selection.width() * p_area_selection.height() * sizeof(cl_float4),
-                                           finalized_data.data(),
-                                           0, NULL, NULL);
+    // The frames share the CL context, the interpolation tree and the corrections, so the first one does the launches
+    DetectorFile & first = frames.first();
+    first.initializeOpenCLFunctions();
 
-    if ( err != CL_SUCCESS)
+    ProjectionContext * projection_context = ProjectionContext::local(first.p_context_cl);
+
+    // Frames are decoded straight into pinned memory. Launching a batch hands back the samples of the one before it,
+    // so decoding and inserting on the host overlap with the device working on the batch in between.
+    QVector<xyzw32> samples;
+
+    for (int i = 0; i < frames.size(); i++)
     {
-        qFatal(cl_error_cstring(err));
-    }
+        DetectorFile & frame = frames[i];
 
-//    err =   QOpenCLFinish(p_context_cl->queue()); // Should only be needed for non blocking reads
+        // Read header and the part of the body that lies within the selection
+        if (!frame.readSubImage())
+        {
+            continue;
+        }
 
-//    if ( err != CL_SUCCESS)
-//    {
-//        qFatal(cl_error_cstring(err));
-//    }
+        size_t n_pixels = frame.p_area_selection.width() * frame.p_area_selection.height();
 
-    err = QOpenCLReleaseKernel(cl_project_data);
-    if ( err != CL_SUCCESS)
-    {
-        qFatal(cl_error_cstring(err));
-    }
+        if (n_pixels == 0)
+        {
+            continue;
+        }
 
-    err = QOpenCLReleaseMemObject(corrected_data_cl);
-    if ( err != CL_SUCCESS)
-    {
-        qFatal(cl_error_cstring(err));
-    }
+        Matrix<int> selection = frame.p_area_selection.lrtb();
 
-    err = QOpenCLReleaseMemObject(projected_data_cl);
-    if ( err != CL_SUCCESS)
-    {
-        qFatal(cl_error_cstring(err));
+        cl_int info[8] = {0, selection[0], selection[1], selection[2], selection[3], (cl_int) frame.p_fast_dimension, (cl_int) frame.p_slow_dimension, 0};
+
+        Matrix<float> sample_rotation_matrix = frame.sampleRotation();
+
+        float geometry[24] = {frame.p_detector_distance, frame.p_beam_center_x, frame.p_beam_center_y, frame.p_pixel_size_x, frame.p_pixel_size_y, frame.p_wavelength, frame.p_correction_args.noise_low, 0};
+
+        for (int j = 0; j < 16; j++)
+        {
+            geometry[8 + j] = sample_rotation_matrix[j];
+        }
+
+        float * staged = projection_context->stageFrame(n_pixels, info, geometry);
+
+        // Launch what has been gathered so far if this frame would not fit, or has another detector geometry
+        if (!staged)
+        {
+            first.launchBatch(projection_context, &samples);
+
+            staged = projection_context->stageFrame(n_pixels, info, geometry);
+        }
+
+        memcpy(staged, frame.p_data_buf.constData(), n_pixels * sizeof(float));
+
+        frame.clearData();
     }
 
-    err = QOpenCLReleaseMemObject(sample_rotation_matrix_cl);
-    if ( err != CL_SUCCESS)
+    if (projection_context->isStaged())
     {
-        qFatal(cl_error_cstring(err));
+        first.launchBatch(projection_context, &samples);
     }
 
-    // There are ways in which to make access to the interpolation octree concurrent and scalable.
-    // The current implementation employs one QMutex per SearchNode object (the interpolation octree
-    // consisits of many such nodes). Consequently only one thread can edit the same node at any time
+    projection_context->drain(&samples);
+
+    first.insertSamples(samples);
+}
+
+void DetectorFile::launchBatch(ProjectionContext * projection_context, QVector<xyzw32> * samples)
+{
+    projection_context->launch(p_correction_args.lorentz_correction, p_correction_args.flat_background_correction, p_correction_args.pixel_projection_correction, samples);
+
+    // The samples of the previous batch, if any
+    insertSamples(*samples);
+}
 
-    for (int i = 0; i < p_area_selection.width()*p_area_selection.height(); i++)
+void DetectorFile::insertSamples(QVector<xyzw32> & samples)
+{
+    // The linear octree takes the samples into a buffer of the calling thread, and sorts them all once projection is done
+    if (p_linear_octree)
     {
-        xyzw32 data_point = {finalized_data[i * 4 + 0], finalized_data[i * 4 + 1], finalized_data[i * 4 + 2], finalized_data[i * 4 + 3]};
+        p_linear_octree->append(samples);
+        return;
+    }
 
-        if (data_point.w > 0.0) // Above 0 check
-        {
-            p_interpolation_octree->insert(data_point);
-        }
+    // Insertion into the interpolation octree is lock-free, so threads only wait on each other while a
+    // leaf they both write to is being split
+    for (int i = 0; i < samples.size(); i++)
+    {
+        p_interpolation_octree->insert(samples[i]);
     }
 }
 
-
 void DetectorFile::setSearchRadiusHint()
 {
     /* A search radius can be found based on the projected size of a pixel in reciprocal space. The following calculations assume a detector that can be translated but not rotated. Could give a fair estimate even for a rotating detector */
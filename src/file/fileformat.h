@@ -5,12 +5,15 @@
 #include <QVector>
 #include <QString>
 #include <QMutex>
+#include <QAtomicInt>
+#include <QFile>
 #include <CL/opencl.h>
 
 #include "../math/matrix.h"
 #include "../opencl/contextcl.h"
 #include "../file/selection.h"
 #include "../svo/searchnode.h"
+#include "../svo/linearoctree.h"
 
 struct DataCorrectionArgs
 {
@@ -25,8 +28,12 @@ struct DataCorrectionArgs
     float noise_low;
 };
 
+class ProjectionContext;
+
 class DetectorFile: protected OpenCLFunctions
 {
+    friend class FrameStack;
+
 public:
     DetectorFile();
     DetectorFile(const DetectorFile &other);
@@ -43,19 +50,40 @@ public:
 
     void setPath(QString p_file_path);
     void setSubImage(Selection & area);
+    const Selection & subImage() const;
     void setCorrectionArgs(DataCorrectionArgs & args);
     void setCLContext(OpenCLContextQueueProgram * context);
     void setInterpolationTree(SearchNode *tree);
+
+    // Append the samples to this tree instead of inserting them into the interpolation tree, if not NULL
+    void setLinearOctree(LinearOctree * tree);
 //    void setMutex(QMutex * mutex);
 
     int readBody();
     int readHeader();
 
-    void populateInterpolationTree();
+    // Read the header from the file even if the frame is in the cache. The regular expressions instead of the tokenizer
+    // are meant for cross-checking the two.
+    int readHeaderFile(bool is_regexp = false);
+
+    // Decode only the pixels within the selection. data() then holds a selection sized window rather than the full frame.
+    int readSubImage();
+
+    // Correct and project frames on the CPU instead of the OpenCL device, for machines without one. The setting may change
+    // while frames are projected, so a run reads it once and passes it on.
+    static void setCpuProjection(bool value);
+    static bool isCpuProjection();
+
+    void populateInterpolationTree(bool is_cpu_projection);
+
+    // Project several frames with as few kernel launches as the device memory allows. The frames must share the CL
+    // context, the interpolation tree and the correction arguments.
+    static void populateInterpolationTreeBatch(QList<DetectorFile> & frames, bool is_cpu_projection);
 
     bool isValid();
-    bool isDataRead();
-    bool isHeaderRead();
+    bool isDataRead() const;
+    bool isDataCropped() const;
+    bool isHeaderRead() const;
 
     void setAlpha(float value);
     void setBeta(float value);
@@ -133,6 +161,7 @@ private:
     float p_offset_omega;
     bool p_is_header_read;
     bool p_is_data_read;
+    bool p_is_data_cropped;
     float p_srchrad_sugg_low, p_srchrad_sugg_high;
     QString p_file_path;
     QString p_file_name;
@@ -145,6 +174,30 @@ private:
     DataCorrectionArgs p_correction_args;
 //    QMutex * p_mutex;
     SearchNode * p_interpolation_octree;
+    LinearOctree * p_linear_octree;
+
+    static QAtomicInt p_is_cpu_projection;
+
+    // Reading
+    bool openFile(QFile & file);
+    bool fetchFromCache();
+    void copyDecoded(const DetectorFile & other);
+    void clampSelection();
+    int parseHeader(const char * buf, size_t size, bool is_regexp = false);
+    void parseHeaderTokens(const char * buf, size_t size, bool * is_omega_defined, bool * is_kappa_defined, bool * is_phi_defined);
+    void parseHeaderRegExp(const char * buf, size_t size, bool * is_omega_defined, bool * is_kappa_defined, bool * is_phi_defined);
+    int readFile(bool is_cropped);
+    int readStack(bool is_header_only, bool is_cropped);
+    int decodeBody(const char * buf, size_t size, bool is_cropped);
+    int decodeByteOffset(const char * buf, size_t size, bool is_cropped);
+    void cropData();
+    void copyWindow(const float * frame);
+
+    // Projection
+    Matrix<float> sampleRotation() const;
+    void projectCpu();
+    void launchBatch(ProjectionContext * projection_context, QVector<xyzw32> * samples);
+    void insertSamples(QVector<xyzw32> & samples);
 
     // Misc
     void swap(DetectorFile & other);
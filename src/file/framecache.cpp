@@ -0,0 +1,93 @@
+#include "framecache.h"
+#include "framestack.h"
+
+#include <QFileInfo>
+#include <QDateTime>
+#include <QMutexLocker>
+
+FrameCache & FrameCache::instance()
+{
+    static FrameCache cache;
+    return cache;
+}
+
+FrameCache::FrameCache()
+{
+    p_frames.setMaxCost(1024 * 1024); // 1 GB
+}
+
+QString FrameCache::key(const QString & path)
+{
+    // Frames in a stack are dated by the stack file
+    QString file_path = path;
+    QString frame_index;
+
+    if (FrameStack::isFramePath(path, &file_path)) frame_index = path.mid(file_path.size());
+
+    QFileInfo info(file_path);
+
+    return info.absoluteFilePath() + frame_index + "@" + QString::number(info.lastModified().toMSecsSinceEpoch());
+}
+
+bool FrameCache::find(const QString & path, DetectorFile * frame)
+{
+    QString k = key(path);
+
+    QMutexLocker locker(&p_mutex);
+
+    DetectorFile * cached = p_frames.object(k);
+
+    if (!cached)
+    {
+        return false;
+    }
+
+    // The pixel data is implicitly shared, so this does not copy the frame
+    *frame = *cached;
+
+    return true;
+}
+
+void FrameCache::insert(const QString & path, const DetectorFile & frame)
+{
+    // Only full frames are kept, cropped ones are cut from them on demand
+    if (!frame.isDataRead() || frame.isDataCropped())
+    {
+        return;
+    }
+
+    QString k = key(path);
+    int cost = frame.bytes() / 1024 + 1;
+
+    QMutexLocker locker(&p_mutex);
+
+    p_frames.insert(k, new DetectorFile(frame), cost);
+}
+
+void FrameCache::setMaxBytes(size_t value)
+{
+    QMutexLocker locker(&p_mutex);
+
+    p_frames.setMaxCost(value / 1024);
+}
+
+size_t FrameCache::maxBytes()
+{
+    QMutexLocker locker(&p_mutex);
+
+    return (size_t) p_frames.maxCost() * 1024;
+}
+
+size_t FrameCache::bytes()
+{
+    QMutexLocker locker(&p_mutex);
+
+    return (size_t) p_frames.totalCost() * 1024;
+}
+
+void FrameCache::clear()
+{
+    QMutexLocker locker(&p_mutex);
+
+    p_frames.clear();
+}
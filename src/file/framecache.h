@@ -0,0 +1,42 @@
+#ifndef FRAMECACHE_H
+#define FRAMECACHE_H
+
+/*
+ * Process-wide cache of decoded frames. Entries are keyed by path and modification time, so a file that is rewritten
+ * is decoded again. The least recently used frames are evicted when the RAM budget is exceeded.
+ * */
+
+#include <QCache>
+#include <QMutex>
+#include <QString>
+
+#include "fileformat.h"
+
+class FrameCache
+{
+public:
+    static FrameCache & instance();
+
+    // Copy a cached frame into *frame. Returns false on a miss.
+    bool find(const QString & path, DetectorFile * frame);
+    void insert(const QString & path, const DetectorFile & frame);
+
+    void setMaxBytes(size_t value);
+    size_t maxBytes();
+    size_t bytes();
+    void clear();
+
+private:
+    FrameCache();
+    FrameCache(const FrameCache &);
+    FrameCache & operator=(const FrameCache &);
+
+    static QString key(const QString & path);
+
+    QMutex p_mutex;
+
+    // Costs are counted in kilobytes to stay within the int range of QCache
+    QCache<QString, DetectorFile> p_frames;
+};
+
+#endif // FRAMECACHE_H
@@ -0,0 +1,99 @@
+#include "frameprefetcher.h"
+
+#include <QMutexLocker>
+#include <QtConcurrent>
+
+FramePrefetcher::FramePrefetcher()
+{
+    // Leave most cores to the GUI thread and any running reconstruction
+    p_thread_pool.setMaxThreadCount(2);
+}
+
+FramePrefetcher::~FramePrefetcher()
+{
+    clear();
+    p_thread_pool.waitForDone();
+}
+
+void FramePrefetcher::setPaths(const QStringList & paths)
+{
+    QMutexLocker locker(&p_mutex);
+
+    p_wanted_paths = paths.toSet();
+
+    // Drop frames that fell out of the window. Tasks that have not started yet will see this and return immediately.
+    QMap<QString, QFuture<DetectorFile>>::iterator i = p_frames.begin();
+
+    while (i != p_frames.end())
+    {
+        if (!p_wanted_paths.contains(i.key())) i = p_frames.erase(i);
+        else ++i;
+    }
+
+    foreach (const QString &path, paths)
+    {
+        if (!p_frames.contains(path))
+        {
+            p_frames[path] = QtConcurrent::run(&p_thread_pool, this, &FramePrefetcher::decode, path);
+        }
+    }
+}
+
+bool FramePrefetcher::take(const QString & path, DetectorFile * frame)
+{
+    QFuture<DetectorFile> future;
+
+    {
+        QMutexLocker locker(&p_mutex);
+
+        if (!p_frames.contains(path))
+        {
+            return false;
+        }
+
+        future = p_frames.take(path);
+    }
+
+    // The path stays wanted until the result is in, otherwise a task that has not started would skip it
+    DetectorFile result = future.result();
+
+    {
+        QMutexLocker locker(&p_mutex);
+        p_wanted_paths.remove(path);
+    }
+
+    if (!result.isDataRead())
+    {
+        return false;
+    }
+
+    *frame = result;
+
+    return true;
+}
+
+void FramePrefetcher::clear()
+{
+    QMutexLocker locker(&p_mutex);
+
+    p_wanted_paths.clear();
+    p_frames.clear();
+}
+
+DetectorFile FramePrefetcher::decode(QString path)
+{
+    {
+        QMutexLocker locker(&p_mutex);
+
+        if (!p_wanted_paths.contains(path))
+        {
+            return DetectorFile();
+        }
+    }
+
+    DetectorFile frame(path);
+
+    if (frame.isValid()) frame.readBody();
+
+    return frame;
+}
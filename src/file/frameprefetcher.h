@@ -0,0 +1,43 @@
+#ifndef FRAMEPREFETCHER_H
+#define FRAMEPREFETCHER_H
+
+/*
+ * Decodes frames ahead of time on a separate thread pool so that stepping through a series does not wait for disk
+ * access and decompression.
+ * */
+
+#include <QString>
+#include <QStringList>
+#include <QMap>
+#include <QSet>
+#include <QMutex>
+#include <QFuture>
+#include <QThreadPool>
+
+#include "fileformat.h"
+
+class FramePrefetcher
+{
+public:
+    FramePrefetcher();
+    ~FramePrefetcher();
+
+    // Frames that are likely to be needed next, in order of priority. Frames not in the list are dropped.
+    void setPaths(const QStringList & paths);
+
+    // Move a prefetched frame into *frame, waiting for it if it is still being decoded. Returns false if the frame was
+    // never requested or could not be read, in which case *frame is untouched.
+    bool take(const QString & path, DetectorFile * frame);
+
+    void clear();
+
+private:
+    DetectorFile decode(QString path);
+
+    QMutex p_mutex;
+    QSet<QString> p_wanted_paths;
+    QMap<QString, QFuture<DetectorFile>> p_frames;
+    QThreadPool p_thread_pool;
+};
+
+#endif // FRAMEPREFETCHER_H
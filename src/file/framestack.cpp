@@ -0,0 +1,372 @@
+#include "framestack.h"
+
+#include <QDebug>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QCache>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThread>
+#include <QtConcurrent>
+
+#include <cstring>
+
+#include "fileformat.h"
+#include "byteoffset.h"
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#endif
+
+static const char STACK_MAGIC[4] = {'N', 'F', 'S', '1'};
+static const quint32 STACK_VERSION = 1;
+static const quint64 PAYLOAD_ALIGNMENT = 4096;
+static const int MAX_OPEN_STACKS = 8;
+
+// The open stacks, least recently used first out
+static QMutex stacks_mutex;
+static QCache<QString, QSharedPointer<FrameStack>> stacks(MAX_OPEN_STACKS);
+
+static quint64 align(quint64 offset)
+{
+    return (offset + PAYLOAD_ALIGNMENT - 1) / PAYLOAD_ALIGNMENT * PAYLOAD_ALIGNMENT;
+}
+
+static void copyString(char * dst, size_t length, const QString & src)
+{
+    QByteArray latin = src.toLatin1();
+
+    memset(dst, 0, length);
+    memcpy(dst, latin.constData(), qMin((size_t) latin.size(), length - 1));
+}
+
+FrameStack::FrameStack() :
+    p_map(NULL),
+    p_header(NULL),
+    p_entries(NULL)
+{
+
+}
+
+FrameStack::~FrameStack()
+{
+    if (p_map) p_file.unmap(const_cast<uchar *>(p_map));
+}
+
+QSharedPointer<FrameStack> FrameStack::open(const QString & path)
+{
+    QFileInfo info(path);
+    QString key = info.absoluteFilePath();
+
+    QMutexLocker locker(&stacks_mutex);
+
+    QSharedPointer<FrameStack> * cached = stacks.object(key);
+
+    if (cached && ((*cached)->p_last_modified == info.lastModified()))
+    {
+        return *cached;
+    }
+
+    QSharedPointer<FrameStack> stack(new FrameStack);
+
+    stack->p_file.setFileName(path);
+    stack->p_last_modified = info.lastModified();
+
+    if (!stack->p_file.open(QIODevice::ReadOnly))
+    {
+        qDebug() << "Error reading file: " << path;
+        return QSharedPointer<FrameStack>();
+    }
+
+    qint64 size = stack->p_file.size();
+
+    if (size < (qint64) sizeof(FrameStackHeader))
+    {
+        qDebug() << "Not a frame stack: " << path;
+        return QSharedPointer<FrameStack>();
+    }
+
+    stack->p_map = stack->p_file.map(0, size);
+
+    if (!stack->p_map)
+    {
+        qDebug() << "Error mapping file: " << path;
+        return QSharedPointer<FrameStack>();
+    }
+
+#ifdef Q_OS_UNIX
+    posix_madvise(const_cast<uchar *>(stack->p_map), size, POSIX_MADV_SEQUENTIAL);
+#endif
+
+    stack->p_header = reinterpret_cast<const FrameStackHeader *>(stack->p_map);
+
+    const FrameStackHeader * header = stack->p_header;
+
+    if ((memcmp(header->magic, STACK_MAGIC, 4) != 0) || (header->version != STACK_VERSION) || (header->entry_size != sizeof(FrameStackEntry)))
+    {
+        qDebug() << "Not a frame stack or unsupported version: " << path;
+        return QSharedPointer<FrameStack>();
+    }
+
+    if (header->table_offset + (quint64) header->n_frames * sizeof(FrameStackEntry) > (quint64) size)
+    {
+        qDebug() << "Truncated frame stack: " << path;
+        return QSharedPointer<FrameStack>();
+    }
+
+    stack->p_entries = reinterpret_cast<const FrameStackEntry *>(stack->p_map + header->table_offset);
+
+    for (quint32 i = 0; i < header->n_frames; i++)
+    {
+        if (stack->p_entries[i].offset + stack->p_entries[i].bytes > (quint64) size)
+        {
+            qDebug() << "Truncated frame stack: " << path;
+            return QSharedPointer<FrameStack>();
+        }
+    }
+
+    stacks.insert(key, new QSharedPointer<FrameStack>(stack));
+
+    return stack;
+}
+
+void FrameStack::clear()
+{
+    QMutexLocker locker(&stacks_mutex);
+
+    stacks.clear();
+}
+
+bool FrameStack::isFramePath(const QString & path, QString * stack_path, int * index)
+{
+    int separator = path.lastIndexOf('#');
+
+    if ((separator < 0) || !path.left(separator).endsWith(".nfs", Qt::CaseInsensitive))
+    {
+        return false;
+    }
+
+    bool ok;
+    int i = path.mid(separator + 1).toInt(&ok);
+
+    if (!ok)
+    {
+        return false;
+    }
+
+    if (stack_path) *stack_path = path.left(separator);
+    if (index) *index = i;
+
+    return true;
+}
+
+QString FrameStack::framePath(const QString & stack_path, int index)
+{
+    // Zero padded so that sorting by path keeps the stack order
+    return stack_path + "#" + QString("%1").arg(index, 6, 10, QChar('0'));
+}
+
+QStringList FrameStack::framePaths(const QString & stack_path)
+{
+    QStringList paths;
+
+    QSharedPointer<FrameStack> stack = open(stack_path);
+
+    if (stack)
+    {
+        for (int i = 0; i < stack->size(); i++) paths << framePath(stack_path, i);
+    }
+
+    return paths;
+}
+
+int FrameStack::size() const
+{
+    return p_header->n_frames;
+}
+
+const FrameStackEntry & FrameStack::entry(int i) const
+{
+    return p_entries[i];
+}
+
+const char * FrameStack::payload(int i) const
+{
+    return reinterpret_cast<const char *>(p_map + p_entries[i].offset);
+}
+
+void FrameStack::toEntry(const DetectorFile & frame, FrameStackEntry * entry)
+{
+    copyString(entry->detector, sizeof(entry->detector), frame.p_detector);
+    copyString(entry->source, sizeof(entry->source), frame.p_file_name);
+
+    entry->fast_dimension = frame.p_fast_dimension;
+    entry->slow_dimension = frame.p_slow_dimension;
+    entry->pixel_size_x = frame.p_pixel_size_x;
+    entry->pixel_size_y = frame.p_pixel_size_y;
+    entry->exposure_time = frame.p_exposure_time;
+    entry->wavelength = frame.p_wavelength;
+    entry->detector_distance = frame.p_detector_distance;
+    entry->beam_center_x = frame.p_beam_center_x;
+    entry->beam_center_y = frame.p_beam_center_y;
+    entry->flux = frame.p_flux;
+    entry->start_angle = frame.p_start_angle;
+    entry->angle_increment = frame.p_angle_increment;
+    entry->omega = frame.p_omega;
+    entry->kappa = frame.p_kappa;
+    entry->phi = frame.p_phi;
+    entry->max_counts = frame.p_max_counts;
+}
+
+void FrameStack::fromEntry(const FrameStackEntry & entry, DetectorFile * frame)
+{
+    frame->p_detector = QString::fromLatin1(entry.detector, strnlen(entry.detector, sizeof(entry.detector)));
+    frame->p_fast_dimension = entry.fast_dimension;
+    frame->p_slow_dimension = entry.slow_dimension;
+    frame->p_pixel_size_x = entry.pixel_size_x;
+    frame->p_pixel_size_y = entry.pixel_size_y;
+    frame->p_exposure_time = entry.exposure_time;
+    frame->p_wavelength = entry.wavelength;
+    frame->p_detector_distance = entry.detector_distance;
+    frame->p_beam_center_x = entry.beam_center_x;
+    frame->p_beam_center_y = entry.beam_center_y;
+    frame->p_flux = entry.flux;
+    frame->p_start_angle = entry.start_angle;
+    frame->p_angle_increment = entry.angle_increment;
+    frame->p_omega = entry.omega;
+    frame->p_kappa = entry.kappa;
+    frame->p_phi = entry.phi;
+
+    frame->setSearchRadiusHint();
+    frame->clampSelection();
+
+    frame->p_is_header_read = true;
+}
+
+struct PackedFrame
+{
+    bool is_valid;
+    FrameStackEntry entry;
+    QByteArray payload;
+};
+
+struct PackFrame
+{
+    typedef PackedFrame result_type;
+
+    PackFrame(FrameStack::Compression compression) : compression(compression) {}
+
+    PackedFrame operator()(const QString & path)
+    {
+        PackedFrame packed;
+        packed.is_valid = false;
+        memset(&packed.entry, 0, sizeof(FrameStackEntry));
+
+        DetectorFile frame(path);
+
+        if (!frame.isValid() || !frame.readBody())
+        {
+            return packed;
+        }
+
+        FrameStack::toEntry(frame, &packed.entry);
+
+        if (compression == FrameStack::ByteOffset)
+        {
+            byteOffsetEncode(frame.data().constData(), frame.data().size(), &packed.payload);
+        }
+        else
+        {
+            packed.payload = QByteArray(reinterpret_cast<const char *>(frame.data().constData()), frame.bytes());
+        }
+
+        packed.entry.compression = compression;
+        packed.entry.bytes = packed.payload.size();
+        packed.is_valid = true;
+
+        return packed;
+    }
+
+    FrameStack::Compression compression;
+};
+
+int FrameStack::pack(const QStringList & paths, const QString & stack_path, Compression compression, QAtomicInt * n_done, QAtomicInt * is_canceled)
+{
+    // The stack is written to a temporary file that replaces the old one when done. A stack that is mapped by open() stays
+    // valid until it is remapped.
+    QSaveFile file(stack_path);
+
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        qDebug() << "Error writing file: " << stack_path;
+        return -1;
+    }
+
+    FrameStackHeader header;
+    memset(&header, 0, sizeof(FrameStackHeader));
+    memcpy(header.magic, STACK_MAGIC, 4);
+    header.version = STACK_VERSION;
+    header.entry_size = sizeof(FrameStackEntry);
+    header.table_offset = sizeof(FrameStackHeader);
+
+    // Room is left for an entry per path. Payloads follow the table.
+    QVector<FrameStackEntry> entries;
+    entries.reserve(paths.size());
+
+    quint64 offset = align(header.table_offset + (quint64) paths.size() * sizeof(FrameStackEntry));
+
+    // Frames are read in parallel a batch at a time, and written in order
+    int batch_size = QThread::idealThreadCount() * 4;
+
+    for (int i = 0; i < paths.size(); i += batch_size)
+    {
+        // The temporary file is discarded when the QSaveFile goes out of scope
+        if (is_canceled && is_canceled->load())
+        {
+            return -1;
+        }
+
+        QList<PackedFrame> batch = QtConcurrent::blockingMapped(paths.mid(i, batch_size), PackFrame(compression));
+
+        for (int j = 0; j < batch.size(); j++)
+        {
+            if (!batch[j].is_valid)
+            {
+                qDebug() << "Skipping unreadable frame: " << paths[i + j];
+                continue;
+            }
+
+            batch[j].entry.offset = offset;
+
+            if (!file.seek(offset) || (file.write(batch[j].payload) != batch[j].payload.size()))
+            {
+                qDebug() << "Error writing file: " << stack_path;
+                return -1;
+            }
+
+            entries << batch[j].entry;
+
+            offset = align(offset + batch[j].entry.bytes);
+        }
+
+        if (n_done) n_done->fetchAndAddRelaxed(batch.size());
+    }
+
+    header.n_frames = entries.size();
+
+    if (!file.seek(0) ||
+            (file.write(reinterpret_cast<const char *>(&header), sizeof(FrameStackHeader)) != sizeof(FrameStackHeader)) ||
+            (file.write(reinterpret_cast<const char *>(entries.constData()), entries.size() * sizeof(FrameStackEntry)) != (qint64) (entries.size() * sizeof(FrameStackEntry))))
+    {
+        qDebug() << "Error writing file: " << stack_path;
+        return -1;
+    }
+
+    if (!file.commit())
+    {
+        qDebug() << "Error writing file: " << stack_path;
+        return -1;
+    }
+
+    return entries.size();
+}
@@ -0,0 +1,105 @@
+#ifndef FRAMESTACK_H
+#define FRAMESTACK_H
+
+/*
+ * Frame stack (.nfs) container. Many detector frames are packed into one file so that a run can be read sequentially
+ * instead of opening thousands of small files. The layout is:
+ *
+ *   FrameStackHeader
+ *   FrameStackEntry[n_frames]   Parsed geometry of every frame, plus where its payload is. Doubles as the index.
+ *   Payloads                    One per frame, each starting on a PAYLOAD_ALIGNMENT boundary
+ *
+ * Payloads are either raw 32 bit floats or byte offset compressed. All values are stored in host byte order.
+ *
+ * A frame inside a stack is addressed as "<stack path>#<index>", and DetectorFile accepts such paths like any other.
+ * */
+
+#include <QString>
+#include <QStringList>
+#include <QFile>
+#include <QDateTime>
+#include <QSharedPointer>
+#include <QAtomicInt>
+
+class DetectorFile;
+
+struct FrameStackHeader
+{
+    char magic[4];
+    quint32 version;
+    quint32 n_frames;
+    quint32 entry_size;
+    quint64 table_offset;
+    quint64 reserved[5];
+};
+
+struct FrameStackEntry
+{
+    char detector[32];
+    char source[256];
+
+    quint64 offset;
+    quint64 bytes;
+    quint32 compression;
+    quint32 fast_dimension;
+    quint32 slow_dimension;
+
+    // Angles are in radians
+    float pixel_size_x, pixel_size_y;
+    float exposure_time;
+    float wavelength;
+    float detector_distance;
+    float beam_center_x, beam_center_y;
+    float flux;
+    float start_angle;
+    float angle_increment;
+    float omega, kappa, phi;
+    float max_counts;
+};
+
+class FrameStack
+{
+public:
+    enum Compression
+    {
+        None = 0,
+        ByteOffset = 1
+    };
+
+    ~FrameStack();
+
+    // Stacks are mapped once and shared by all readers. A stack that changed on disk is mapped again. Only the most
+    // recently opened stacks are kept open, and the others are unmapped when their last reader lets go of them.
+    static QSharedPointer<FrameStack> open(const QString & path);
+
+    // Let go of all open stacks, for when the frames they hold are no longer in use
+    static void clear();
+
+    static bool isFramePath(const QString & path, QString * stack_path = NULL, int * index = NULL);
+    static QString framePath(const QString & stack_path, int index);
+    static QStringList framePaths(const QString & stack_path);
+
+    // Read and pack the frames in parallel, then write them to the stack in the given order. Frames that cannot be read
+    // are skipped. If given, n_done counts the frames read so far, and packing stops without writing the stack once
+    // is_canceled is set. Returns the number of frames written, or -1 on error or cancellation.
+    static int pack(const QStringList & paths, const QString & stack_path, Compression compression, QAtomicInt * n_done = NULL, QAtomicInt * is_canceled = NULL);
+
+    int size() const;
+    const FrameStackEntry & entry(int i) const;
+    const char * payload(int i) const;
+
+    // Fill in the header keywords of a frame, or read them from it
+    static void toEntry(const DetectorFile & frame, FrameStackEntry * entry);
+    static void fromEntry(const FrameStackEntry & entry, DetectorFile * frame);
+
+private:
+    FrameStack();
+
+    QFile p_file;
+    QDateTime p_last_modified;
+    const uchar * p_map;
+    const FrameStackHeader * p_header;
+    const FrameStackEntry * p_entries;
+};
+
+#endif // FRAMESTACK_H
@@ -0,0 +1,152 @@
+#include "pixeltablecache.h"
+
+#include <QMutexLocker>
+
+#include "../math/matrix.h"
+
+// A table takes 16 bytes per pixel, some 100 MB for the larger detectors
+static const int MAX_TABLES = 4;
+
+bool PixelGeometry::operator == (const PixelGeometry & other) const
+{
+    return (context == other.context) &&
+           (fast_dimension == other.fast_dimension) &&
+           (slow_dimension == other.slow_dimension) &&
+           (lorentz_correction == other.lorentz_correction) &&
+           (pixel_projection_correction == other.pixel_projection_correction) &&
+           (detector_distance == other.detector_distance) &&
+           (beam_center_x == other.beam_center_x) &&
+           (beam_center_y == other.beam_center_y) &&
+           (pixel_size_x == other.pixel_size_x) &&
+           (pixel_size_y == other.pixel_size_y) &&
+           (wavelength == other.wavelength);
+}
+
+PixelTableCache::PixelTableCache()
+{
+    initializeOpenCLFunctions();
+}
+
+PixelTableCache * PixelTableCache::instance()
+{
+    // Never deleted, the tables are kept for as long as the process runs
+    static PixelTableCache * cache = new PixelTableCache;
+
+    return cache;
+}
+
+cl_mem PixelTableCache::acquire(const PixelGeometry & geometry, cl_kernel kernel, cl_command_queue queue)
+{
+    QMutexLocker locker(&p_mutex);
+
+    int i = 0;
+
+    while ((i < p_entries.size()) && !(p_entries[i].geometry == geometry))
+    {
+        i++;
+    }
+
+    if (i < p_entries.size())
+    {
+        p_entries.move(i, 0);
+    }
+    else
+    {
+        // Tables of another context will not be asked for again
+        for (int j = p_entries.size() - 1; j >= 0; j--)
+        {
+            if (p_entries[j].geometry.context != geometry.context)
+            {
+                err = QOpenCLReleaseMemObject(p_entries[j].table_cl);
+                if ( err != CL_SUCCESS)
+                {
+                    qFatal(cl_error_cstring(err));
+                }
+
+                p_entries.removeAt(j);
+            }
+        }
+
+        Entry entry;
+        entry.geometry = geometry;
+
+        build(&entry, kernel, queue);
+
+        p_entries.prepend(entry);
+
+        // Threads still using an evicted table hold references of their own
+        if (p_entries.size() > MAX_TABLES)
+        {
+            err = QOpenCLReleaseMemObject(p_entries.last().table_cl);
+            if ( err != CL_SUCCESS)
+            {
+                qFatal(cl_error_cstring(err));
+            }
+
+            p_entries.removeLast();
+        }
+    }
+
+    cl_mem table_cl = p_entries.first().table_cl;
+
+    err = QOpenCLRetainMemObject(table_cl);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    return table_cl;
+}
+
+void PixelTableCache::build(Entry * entry, cl_kernel kernel, cl_command_queue queue)
+{
+    const PixelGeometry & geometry = entry->geometry;
+
+    size_t n_pixels = (size_t) geometry.fast_dimension * geometry.slow_dimension;
+
+    entry->table_cl = QOpenCLCreateBuffer(geometry.context, CL_MEM_READ_WRITE, n_pixels * sizeof(cl_float4), NULL, &err);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    Matrix<int> image_size(1, 2);
+    image_size[0] = geometry.fast_dimension;
+    image_size[1] = geometry.slow_dimension;
+
+    Matrix<size_t> local_ws(1, 2);
+    local_ws[0] = 64;
+    local_ws[1] = 1;
+
+    Matrix<size_t> global_ws(1, 2);
+    global_ws[0] = image_size[0] + (local_ws[0] - image_size[0] % local_ws[0]);
+    global_ws[1] = image_size[1];
+
+    err =   QOpenCLSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &entry->table_cl);
+    err |=  QOpenCLSetKernelArg(kernel, 1, sizeof(cl_int2), image_size.data());
+    err |=  QOpenCLSetKernelArg(kernel, 2, sizeof(cl_int), &geometry.lorentz_correction);
+    err |=  QOpenCLSetKernelArg(kernel, 3, sizeof(cl_int), &geometry.pixel_projection_correction);
+    err |=  QOpenCLSetKernelArg(kernel, 4, sizeof(cl_float), &geometry.detector_distance);
+    err |=  QOpenCLSetKernelArg(kernel, 5, sizeof(cl_float), &geometry.beam_center_x);
+    err |=  QOpenCLSetKernelArg(kernel, 6, sizeof(cl_float), &geometry.beam_center_y);
+    err |=  QOpenCLSetKernelArg(kernel, 7, sizeof(cl_float), &geometry.pixel_size_x);
+    err |=  QOpenCLSetKernelArg(kernel, 8, sizeof(cl_float), &geometry.pixel_size_y);
+    err |=  QOpenCLSetKernelArg(kernel, 9, sizeof(cl_float), &geometry.wavelength);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    err =   QOpenCLEnqueueNDRangeKernel(queue, kernel, 2, NULL, global_ws.data(), local_ws.data(), 0, NULL, NULL);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    // Other threads use the table from queues of their own
+    err = QOpenCLFinish(queue);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef PIXELTABLECACHE_H
+#define PIXELTABLECACHE_H
+
+/*
+ * Device tables holding the scattering vector before sample rotation and the geometric correction factor of every
+ * pixel of a detector, as computed by the pixelTable kernel. These only depend on the detector geometry, which rarely
+ * changes during a run, so a table is built once and shared by all the threads that project frames. A few tables are
+ * kept, and the one used least recently goes first.
+ * */
+
+#include <QMutex>
+#include <QList>
+#include <CL/opencl.h>
+
+#include "../opencl/contextcl.h"
+
+struct PixelGeometry
+{
+    cl_context context;
+
+    int fast_dimension;
+    int slow_dimension;
+
+    int lorentz_correction;
+    int pixel_projection_correction;
+
+    float detector_distance;
+    float beam_center_x;
+    float beam_center_y;
+    float pixel_size_x;
+    float pixel_size_y;
+    float wavelength;
+
+    bool operator == (const PixelGeometry & other) const;
+};
+
+class PixelTableCache : protected OpenCLFunctions
+{
+public:
+    static PixelTableCache * instance();
+
+    // The table for the given geometry. If it is not cached it is built with the given pixelTable kernel on the given
+    // queue, and is complete on return. The caller gets a reference of its own, which it must release.
+    cl_mem acquire(const PixelGeometry & geometry, cl_kernel kernel, cl_command_queue queue);
+
+private:
+    struct Entry
+    {
+        PixelGeometry geometry;
+        cl_mem table_cl;
+    };
+
+    PixelTableCache();
+
+    void build(Entry * entry, cl_kernel kernel, cl_command_queue queue);
+
+    QMutex p_mutex;
+
+    // The most recently used first
+    QList<Entry> p_entries;
+
+    cl_int err;
+};
+
+#endif // PIXELTABLECACHE_H
@@ -0,0 +1,581 @@
+#include "projectioncontext.h"
+#include "pixeltablecache.h"
+
+#include <QThreadStorage>
+#include <QThread>
+#include <QVector>
+
+#include <algorithm>
+
+// Upper bound on the pinned staging memory of a slot, in pixels. Pinned memory is a scarce resource, and batches of
+// this size are more than enough to keep the device busy.
+static const size_t MAX_STAGED_PIXELS = 1 << 22;
+
+// Source of the upload that resets the sample count. It must outlive the non-blocking write.
+static const cl_int ZERO = 0;
+
+ProjectionContext::ProjectionContext() :
+    p_context(NULL),
+    p_program(NULL),
+    p_project_kernel(NULL),
+    p_batch_kernel(NULL),
+    p_table_kernel(NULL),
+    p_max_batch_pixels(0),
+    p_raw_cl(NULL),
+    p_projected_cl(NULL),
+    p_rotation_cl(NULL),
+    p_count_cl(NULL),
+    p_raw_bytes(0),
+    p_projected_bytes(0),
+    p_rotation_bytes(0),
+    p_count_bytes(0),
+    p_upload_queue(NULL),
+    p_compute_queue(NULL),
+    p_readback_queue(NULL),
+    p_current_slot(0)
+{
+    initializeOpenCLFunctions();
+
+    for (int i = 0; i < 2; i++)
+    {
+        Slot & slot = p_slots[i];
+
+        slot.pinned_cl = NULL;
+        slot.pinned = NULL;
+        slot.pinned_pixels = 0;
+
+        slot.raw_cl = NULL;
+        slot.projected_cl = NULL;
+        slot.count_cl = NULL;
+        slot.info_cl = NULL;
+        slot.geometry_cl = NULL;
+        slot.table_cl = NULL;
+
+        slot.raw_bytes = 0;
+        slot.projected_bytes = 0;
+        slot.count_bytes = 0;
+        slot.info_bytes = 0;
+        slot.geometry_bytes = 0;
+
+        slot.n_pixels = 0;
+        slot.n_samples = 0;
+        slot.count_event = NULL;
+        slot.is_launched = false;
+    }
+}
+
+ProjectionContext::~ProjectionContext()
+{
+    release();
+}
+
+ProjectionContext * ProjectionContext::local(OpenCLContextQueueProgram * context_cl)
+{
+    // Deletes the object when the thread exits
+    static QThreadStorage<ProjectionContext *> storage;
+
+    if (!storage.hasLocalData())
+    {
+        storage.setLocalData(new ProjectionContext);
+    }
+
+    ProjectionContext * projection_context = storage.localData();
+    projection_context->bind(context_cl);
+
+    return projection_context;
+}
+
+void ProjectionContext::bind(OpenCLContextQueueProgram * context_cl)
+{
+    if ((p_context == context_cl->context()) && (p_program == context_cl->program()))
+    {
+        return;
+    }
+
+    release();
+
+    p_context = context_cl->context();
+    p_program = context_cl->program();
+
+    p_project_kernel = QOpenCLCreateKernel(p_program, "correctProjectScatteringData", &err);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    p_batch_kernel = QOpenCLCreateKernel(p_program, "correctProjectScatteringDataBatch", &err);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    p_table_kernel = QOpenCLCreateKernel(p_program, "pixelTable", &err);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    // Batches go to the (first) device of the context
+    size_t devices_bytes;
+    err = QOpenCLGetContextInfo(p_context, CL_CONTEXT_DEVICES, 0, NULL, &devices_bytes);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    QVector<cl_device_id> devices(devices_bytes / sizeof(cl_device_id));
+    err = QOpenCLGetContextInfo(p_context, CL_CONTEXT_DEVICES, devices_bytes, devices.data(), NULL);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    cl_device_id device = devices[0];
+
+    cl_ulong max_alloc_bytes, global_mem_bytes;
+
+    err = QOpenCLGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc_bytes, NULL);
+    err |= QOpenCLGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &global_mem_bytes, NULL);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    // A pixel takes a float going in and a float4 coming out. Every thread may hold two batches, and half of the memory
+    // is left for everything else.
+    size_t bytes_per_thread = global_mem_bytes / (4 * std::max(QThread::idealThreadCount(), 1));
+
+    p_max_batch_pixels = std::min(max_alloc_bytes / sizeof(cl_float4), (cl_ulong) bytes_per_thread / (sizeof(cl_float) + sizeof(cl_float4)));
+
+    // In-order queues, one per stage, so that the stages of different batches can overlap
+    cl_command_queue * queues[] = {&p_upload_queue, &p_compute_queue, &p_readback_queue};
+
+    for (int i = 0; i < 3; i++)
+    {
+        *queues[i] = QOpenCLCreateCommandQueue(p_context, device, 0, &err);
+        if ( err != CL_SUCCESS)
+        {
+            qFatal(cl_error_cstring(err));
+        }
+    }
+
+    p_current_slot = 0;
+}
+
+void ProjectionContext::release()
+{
+    for (int i = 0; i < 2; i++)
+    {
+        releaseSlot(&p_slots[i]);
+    }
+
+    cl_command_queue * queues[] = {&p_upload_queue, &p_compute_queue, &p_readback_queue};
+
+    for (int i = 0; i < 3; i++)
+    {
+        if (*queues[i])
+        {
+            err = QOpenCLReleaseCommandQueue(*queues[i]);
+            if ( err != CL_SUCCESS)
+            {
+                qFatal(cl_error_cstring(err));
+            }
+
+            *queues[i] = NULL;
+        }
+    }
+
+    cl_kernel * kernels[] = {&p_project_kernel, &p_batch_kernel, &p_table_kernel};
+
+    for (int i = 0; i < 3; i++)
+    {
+        if (*kernels[i])
+        {
+            err = QOpenCLReleaseKernel(*kernels[i]);
+            if ( err != CL_SUCCESS)
+            {
+                qFatal(cl_error_cstring(err));
+            }
+
+            *kernels[i] = NULL;
+        }
+    }
+
+    releaseBuffer(&p_raw_cl, &p_raw_bytes);
+    releaseBuffer(&p_projected_cl, &p_projected_bytes);
+    releaseBuffer(&p_rotation_cl, &p_rotation_bytes);
+    releaseBuffer(&p_count_cl, &p_count_bytes);
+
+    p_context = NULL;
+    p_program = NULL;
+}
+
+void ProjectionContext::releaseSlot(Slot * slot)
+{
+    // Nothing may still be reading from or writing to the slot
+    if (slot->is_launched)
+    {
+        err = QOpenCLWaitForEvents(1, &slot->count_event);
+        err |= QOpenCLReleaseEvent(slot->count_event);
+        err |= QOpenCLReleaseMemObject(slot->table_cl);
+        if ( err != CL_SUCCESS)
+        {
+            qFatal(cl_error_cstring(err));
+        }
+
+        slot->count_event = NULL;
+        slot->table_cl = NULL;
+        slot->is_launched = false;
+    }
+
+    if (slot->pinned_cl)
+    {
+        err = QOpenCLEnqueueUnmapMemObject(p_upload_queue, slot->pinned_cl, slot->pinned, 0, NULL, NULL);
+        err |= QOpenCLFinish(p_upload_queue);
+        if ( err != CL_SUCCESS)
+        {
+            qFatal(cl_error_cstring(err));
+        }
+
+        slot->pinned = NULL;
+    }
+
+    releaseBuffer(&slot->pinned_cl, &slot->pinned_pixels);
+    releaseBuffer(&slot->raw_cl, &slot->raw_bytes);
+    releaseBuffer(&slot->projected_cl, &slot->projected_bytes);
+    releaseBuffer(&slot->count_cl, &slot->count_bytes);
+    releaseBuffer(&slot->info_cl, &slot->info_bytes);
+    releaseBuffer(&slot->geometry_cl, &slot->geometry_bytes);
+
+    slot->info.clear();
+    slot->geometry.clear();
+    slot->n_pixels = 0;
+}
+
+void ProjectionContext::releaseBuffer(cl_mem * buffer, size_t * capacity)
+{
+    if (*buffer)
+    {
+        err = QOpenCLReleaseMemObject(*buffer);
+        if ( err != CL_SUCCESS)
+        {
+            qFatal(cl_error_cstring(err));
+        }
+
+        *buffer = NULL;
+    }
+
+    *capacity = 0;
+}
+
+cl_mem ProjectionContext::reserve(cl_mem * buffer, size_t * capacity, size_t bytes, cl_mem_flags flags)
+{
+    if (*buffer && (*capacity >= bytes))
+    {
+        return *buffer;
+    }
+
+    releaseBuffer(buffer, capacity);
+
+    *buffer = QOpenCLCreateBuffer(p_context, flags, bytes, NULL, &err);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    *capacity = bytes;
+
+    return *buffer;
+}
+
+void ProjectionContext::reservePinned(Slot * slot, size_t n_pixels)
+{
+    if (slot->pinned_cl && (slot->pinned_pixels >= n_pixels))
+    {
+        return;
+    }
+
+    if (slot->pinned_cl)
+    {
+        err = QOpenCLEnqueueUnmapMemObject(p_upload_queue, slot->pinned_cl, slot->pinned, 0, NULL, NULL);
+        if ( err != CL_SUCCESS)
+        {
+            qFatal(cl_error_cstring(err));
+        }
+
+        releaseBuffer(&slot->pinned_cl, &slot->pinned_pixels);
+    }
+
+    // Host memory the driver can transfer from directly, mapped once and kept that way
+    slot->pinned_cl = QOpenCLCreateBuffer(p_context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, n_pixels * sizeof(cl_float), NULL, &err);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    slot->pinned = (float *) QOpenCLEnqueueMapBuffer(p_upload_queue, slot->pinned_cl, CL_TRUE, CL_MAP_WRITE, 0, n_pixels * sizeof(cl_float), 0, NULL, NULL, &err);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    slot->pinned_pixels = n_pixels;
+}
+
+cl_kernel ProjectionContext::projectKernel() const
+{
+    return p_project_kernel;
+}
+
+size_t ProjectionContext::maxBatchPixels() const
+{
+    return p_max_batch_pixels;
+}
+
+size_t ProjectionContext::maxStagedPixels()
+{
+    return MAX_STAGED_PIXELS;
+}
+
+cl_mem ProjectionContext::rawBuffer(size_t bytes)
+{
+    return reserve(&p_raw_cl, &p_raw_bytes, bytes, CL_MEM_READ_ONLY);
+}
+
+cl_mem ProjectionContext::projectedBuffer(size_t bytes)
+{
+    return reserve(&p_projected_cl, &p_projected_bytes, bytes, CL_MEM_ALLOC_HOST_PTR);
+}
+
+cl_mem ProjectionContext::rotationBuffer(size_t bytes)
+{
+    return reserve(&p_rotation_cl, &p_rotation_bytes, bytes, CL_MEM_READ_ONLY);
+}
+
+cl_mem ProjectionContext::countBuffer()
+{
+    return reserve(&p_count_cl, &p_count_bytes, sizeof(cl_int), CL_MEM_READ_WRITE);
+}
+
+bool ProjectionContext::isStaged() const
+{
+    return p_slots[p_current_slot].n_pixels > 0;
+}
+
+float * ProjectionContext::stageFrame(size_t n_pixels, const cl_int * info, const float * geometry)
+{
+    Slot & slot = p_slots[p_current_slot];
+
+    size_t max_pixels = std::max(std::min(p_max_batch_pixels, MAX_STAGED_PIXELS), (size_t) 1);
+
+    if ((slot.n_pixels > 0) && (slot.n_pixels + n_pixels > max_pixels))
+    {
+        return NULL;
+    }
+
+    // The frames of a batch share one pixel table
+    if (slot.n_pixels > 0)
+    {
+        if ((slot.info[5] != info[5]) || (slot.info[6] != info[6]))
+        {
+            return NULL;
+        }
+
+        for (int i = 0; i < 6; i++)
+        {
+            if (slot.geometry[i] != geometry[i])
+            {
+                return NULL;
+            }
+        }
+    }
+
+    // Only an empty slot can grow, so a frame larger than a batch ends up alone in one
+    if (slot.n_pixels == 0)
+    {
+        reservePinned(&slot, std::max(max_pixels, n_pixels));
+    }
+
+    slot.info << (cl_int) slot.n_pixels;
+
+    for (int i = 1; i < 8; i++)
+    {
+        slot.info << info[i];
+    }
+
+    for (int i = 0; i < 24; i++)
+    {
+        slot.geometry << geometry[i];
+    }
+
+    float * staged = slot.pinned + slot.n_pixels;
+
+    slot.n_pixels += n_pixels;
+
+    return staged;
+}
+
+void ProjectionContext::launch(cl_int lorentz_correction, cl_int flat_background_correction, cl_int pixel_projection_correction, QVector<xyzw32> * samples)
+{
+    Slot & slot = p_slots[p_current_slot];
+
+    cl_int n_frames = slot.info.size() / 8;
+    cl_int n_pixels = slot.n_pixels;
+
+    cl_mem raw_data_cl = reserve(&slot.raw_cl, &slot.raw_bytes, n_pixels * sizeof(cl_float), CL_MEM_READ_ONLY);
+    cl_mem projected_data_cl = reserve(&slot.projected_cl, &slot.projected_bytes, n_pixels * sizeof(cl_float4), CL_MEM_WRITE_ONLY);
+    cl_mem n_samples_cl = reserve(&slot.count_cl, &slot.count_bytes, sizeof(cl_int), CL_MEM_READ_WRITE);
+    cl_mem info_cl = reserve(&slot.info_cl, &slot.info_bytes, slot.info.size() * sizeof(cl_int), CL_MEM_READ_ONLY);
+    cl_mem geometry_cl = reserve(&slot.geometry_cl, &slot.geometry_bytes, slot.geometry.size() * sizeof(cl_float), CL_MEM_READ_ONLY);
+
+    PixelGeometry pixel_geometry;
+    pixel_geometry.context = p_context;
+    pixel_geometry.fast_dimension = slot.info[5];
+    pixel_geometry.slow_dimension = slot.info[6];
+    pixel_geometry.lorentz_correction = lorentz_correction;
+    pixel_geometry.pixel_projection_correction = pixel_projection_correction;
+    pixel_geometry.detector_distance = slot.geometry[0];
+    pixel_geometry.beam_center_x = slot.geometry[1];
+    pixel_geometry.beam_center_y = slot.geometry[2];
+    pixel_geometry.pixel_size_x = slot.geometry[3];
+    pixel_geometry.pixel_size_y = slot.geometry[4];
+    pixel_geometry.wavelength = slot.geometry[5];
+
+    // Built on the compute queue if it is new, and complete before the projection is enqueued
+    slot.table_cl = PixelTableCache::instance()->acquire(pixel_geometry, p_table_kernel, p_compute_queue);
+
+    // Upload stage. The host side of the slot is left alone until the batch has been read back.
+    cl_event upload_events[3];
+
+    err =   QOpenCLEnqueueWriteBuffer(p_upload_queue, raw_data_cl, CL_FALSE, 0, n_pixels * sizeof(cl_float), slot.pinned, 0, NULL, &upload_events[0]);
+    err |=  QOpenCLEnqueueWriteBuffer(p_upload_queue, info_cl, CL_FALSE, 0, slot.info.size() * sizeof(cl_int), slot.info.constData(), 0, NULL, &upload_events[1]);
+    err |=  QOpenCLEnqueueWriteBuffer(p_upload_queue, geometry_cl, CL_FALSE, 0, slot.geometry.size() * sizeof(cl_float), slot.geometry.constData(), 0, NULL, &upload_events[2]);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    err = QOpenCLFlush(p_upload_queue);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    // Compute stage, once the uploads are done. The kernel counts the samples it keeps.
+    err =   QOpenCLEnqueueWriteBuffer(p_compute_queue, n_samples_cl, CL_FALSE, 0, sizeof(cl_int), &ZERO, 0, NULL, NULL);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    size_t local_ws = 64;
+    size_t global_ws = n_pixels + (local_ws - n_pixels % local_ws);
+
+    err =   QOpenCLSetKernelArg(p_batch_kernel, 0, sizeof(cl_mem), (void *) &raw_data_cl);
+    err |=  QOpenCLSetKernelArg(p_batch_kernel, 1, sizeof(cl_mem), (void *) &projected_data_cl);
+    err |=  QOpenCLSetKernelArg(p_batch_kernel, 2, sizeof(cl_mem), (void *) &n_samples_cl);
+    err |=  QOpenCLSetKernelArg(p_batch_kernel, 3, sizeof(cl_mem), (void *) &info_cl);
+    err |=  QOpenCLSetKernelArg(p_batch_kernel, 4, sizeof(cl_mem), (void *) &geometry_cl);
+    err |=  QOpenCLSetKernelArg(p_batch_kernel, 5, sizeof(cl_mem), (void *) &slot.table_cl);
+    err |=  QOpenCLSetKernelArg(p_batch_kernel, 6, sizeof(cl_int), &n_frames);
+    err |=  QOpenCLSetKernelArg(p_batch_kernel, 7, sizeof(cl_int), &n_pixels);
+    err |=  QOpenCLSetKernelArg(p_batch_kernel, 8, sizeof(cl_int), &flat_background_correction);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    cl_event kernel_event;
+
+    err =   QOpenCLEnqueueNDRangeKernel(p_compute_queue, p_batch_kernel, 1, NULL, &global_ws, &local_ws, 3, upload_events, &kernel_event);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    err = QOpenCLFlush(p_compute_queue);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        err = QOpenCLReleaseEvent(upload_events[i]);
+        if ( err != CL_SUCCESS)
+        {
+            qFatal(cl_error_cstring(err));
+        }
+    }
+
+    // Readback stage. The batch before this one is finished while the device works on this one.
+    collect(&p_slots[1 - p_current_slot], samples);
+
+    err =   QOpenCLEnqueueReadBuffer(p_readback_queue, n_samples_cl, CL_FALSE, 0, sizeof(cl_int), &slot.n_samples, 1, &kernel_event, &slot.count_event);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    err = QOpenCLFlush(p_readback_queue);
+    err |= QOpenCLReleaseEvent(kernel_event);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    slot.is_launched = true;
+
+    // Frames are now staged into the slot that was just collected
+    p_current_slot = 1 - p_current_slot;
+}
+
+void ProjectionContext::drain(QVector<xyzw32> * samples)
+{
+    collect(&p_slots[1 - p_current_slot], samples);
+}
+
+void ProjectionContext::collect(Slot * slot, QVector<xyzw32> * samples)
+{
+    samples->clear();
+
+    if (!slot->is_launched)
+    {
+        return;
+    }
+
+    err = QOpenCLWaitForEvents(1, &slot->count_event);
+    err |= QOpenCLReleaseEvent(slot->count_event);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    slot->count_event = NULL;
+
+    err = QOpenCLReleaseMemObject(slot->table_cl);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    slot->table_cl = NULL;
+
+    // Only the kept samples are read
+    if (slot->n_samples > 0)
+    {
+        samples->resize(slot->n_samples);
+
+        err =   QOpenCLEnqueueReadBuffer(p_readback_queue, slot->projected_cl, CL_TRUE, 0, slot->n_samples * sizeof(cl_float4), samples->data(), 0, NULL, NULL);
+        if ( err != CL_SUCCESS)
+        {
+            qFatal(cl_error_cstring(err));
+        }
+    }
+
+    // The count depends on the kernel, which depends on the uploads, so the host side of the slot is free again
+    slot->is_launched = false;
+    slot->n_pixels = 0;
+    slot->info.clear();
+    slot->geometry.clear();
+}
@@ -0,0 +1,115 @@
+#ifndef PROJECTIONCONTEXT_H
+#define PROJECTIONCONTEXT_H
+
+/*
+ * Kernel handles and device buffers used when projecting frames into the interpolation tree. Each thread gets its own
+ * set, created on first use and reused for every frame the thread treats, since clSetKernelArg is not thread safe on a
+ * shared kernel object. Buffers only grow, and everything is released when the thread exits.
+ *
+ * Batches of frames go through a pipeline with separate upload, compute and readback queues and two batch slots, each
+ * with pinned staging memory. While the device projects the batch in one slot, the samples of the batch before it are
+ * read back and the frames of the next batch are decoded into the other slot. The stages are tied together with
+ * events, so the host only waits when it needs a result.
+ * */
+
+#include <QVector>
+#include <CL/opencl.h>
+
+#include "../opencl/contextcl.h"
+#include "../misc/smallstuff.h"
+
+class ProjectionContext : protected OpenCLFunctions
+{
+public:
+    ~ProjectionContext();
+
+    // The set belonging to the calling thread, bound to the given program. A new program means new kernels.
+    static ProjectionContext * local(OpenCLContextQueueProgram * context_cl);
+
+    // correctProjectScatteringData, for one frame at a time on the queue of the shared context
+    cl_kernel projectKernel() const;
+
+    // Buffers of at least the given size. Their contents do not survive a resize.
+    cl_mem rawBuffer(size_t bytes);
+    cl_mem projectedBuffer(size_t bytes);
+    cl_mem rotationBuffer(size_t bytes);
+
+    // Holds the number of projected samples
+    cl_mem countBuffer();
+
+    // The number of pixels a batch of frames may hold. Bounded by the largest allocation the device allows, and by its
+    // global memory shared among the threads that project at the same time.
+    size_t maxBatchPixels() const;
+
+    // The most pixels a batch holds on any device
+    static size_t maxStagedPixels();
+
+    // Room for the pixels of a frame in the current batch. The 8 ints of info and 24 floats of geometry are laid out as
+    // in correctProjectScatteringDataBatch, with the offset filled in here. Returns NULL if the batch is full or holds
+    // frames of another detector geometry, in which case it must be launched first. An empty batch accepts any frame.
+    float * stageFrame(size_t n_pixels, const cl_int * info, const float * geometry);
+    bool isStaged() const;
+
+    // Launch the current batch and move on to the other slot. The pixel table of its geometry comes from the
+    // PixelTableCache. *samples is set to the samples of the batch launched before this one, and is left empty if there
+    // is none.
+    void launch(cl_int lorentz_correction, cl_int flat_background_correction, cl_int pixel_projection_correction, QVector<xyzw32> * samples);
+
+    // Wait for the batch launched last and set *samples to its samples
+    void drain(QVector<xyzw32> * samples);
+
+private:
+    struct Slot
+    {
+        // Pinned host memory, mapped for as long as it lives
+        cl_mem pinned_cl;
+        float * pinned;
+        size_t pinned_pixels;
+
+        cl_mem raw_cl, projected_cl, count_cl, info_cl, geometry_cl;
+        size_t raw_bytes, projected_bytes, count_bytes, info_bytes, geometry_bytes;
+
+        // A reference to the pixel table, held until the batch has been read back
+        cl_mem table_cl;
+
+        // Kept until the slot is reused, as the upload reads from them
+        QVector<cl_int> info;
+        QVector<float> geometry;
+        size_t n_pixels;
+
+        // Written by the readback queue once count_event completes
+        cl_int n_samples;
+        cl_event count_event;
+        bool is_launched;
+    };
+
+    ProjectionContext();
+
+    void bind(OpenCLContextQueueProgram * context_cl);
+    void release();
+    cl_mem reserve(cl_mem * buffer, size_t * capacity, size_t bytes, cl_mem_flags flags);
+    void reservePinned(Slot * slot, size_t n_pixels);
+    void releaseSlot(Slot * slot);
+    void collect(Slot * slot, QVector<xyzw32> * samples);
+    void releaseBuffer(cl_mem * buffer, size_t * capacity);
+
+    cl_context p_context;
+    cl_program p_program;
+
+    cl_kernel p_project_kernel;
+    cl_kernel p_batch_kernel;
+    cl_kernel p_table_kernel;
+
+    size_t p_max_batch_pixels;
+
+    cl_mem p_raw_cl, p_projected_cl, p_rotation_cl, p_count_cl;
+    size_t p_raw_bytes, p_projected_bytes, p_rotation_bytes, p_count_bytes;
+
+    cl_command_queue p_upload_queue, p_compute_queue, p_readback_queue;
+    Slot p_slots[2];
+    int p_current_slot;
+
+    cl_int err;
+};
+
+#endif // PROJECTIONCONTEXT_H
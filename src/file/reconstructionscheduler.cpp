@@ -0,0 +1,235 @@
+#include "reconstructionscheduler.h"
+
+#include <QVector>
+#include <QMutexLocker>
+
+#include <algorithm>
+
+#include "file/projectioncontext.h"
+#include "misc/smallstuff.h"
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
+
+// The share of each memory that in-flight tasks may use. The rest is left to the interpolation tree and everything else.
+static const double HOST_MEMORY_FRACTION = 0.5;
+static const double DEVICE_MEMORY_FRACTION = 0.5;
+
+ReconstructionScheduler::ReconstructionScheduler() :
+    p_host_budget(0),
+    p_device_budget(0),
+    p_host_in_flight(0),
+    p_device_in_flight(0),
+    p_host_peak(0),
+    p_device_peak(0),
+    p_tasks_in_flight(0),
+    p_is_cpu_projection(false),
+    p_n_frames(0)
+{
+}
+
+size_t ReconstructionScheduler::physicalMemory()
+{
+#ifdef Q_OS_UNIX
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+
+    if ((pages > 0) && (page_size > 0))
+    {
+        return (size_t) pages * (size_t) page_size;
+    }
+#endif
+
+    return 0;
+}
+
+size_t ReconstructionScheduler::availableMemory()
+{
+#if defined(Q_OS_UNIX) && defined(_SC_AVPHYS_PAGES)
+    long pages = sysconf(_SC_AVPHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+
+    if ((pages > 0) && (page_size > 0))
+    {
+        return (size_t) pages * (size_t) page_size;
+    }
+#endif
+
+    return 0;
+}
+
+size_t ReconstructionScheduler::deviceMemory(OpenCLContextQueueProgram * context_cl)
+{
+    cl_int err;
+    size_t devices_bytes;
+
+    err = QOpenCLGetContextInfo(context_cl->context(), CL_CONTEXT_DEVICES, 0, NULL, &devices_bytes);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    QVector<cl_device_id> devices(devices_bytes / sizeof(cl_device_id));
+    err = QOpenCLGetContextInfo(context_cl->context(), CL_CONTEXT_DEVICES, devices_bytes, devices.data(), NULL);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    cl_ulong global_mem_bytes;
+
+    err = QOpenCLGetDeviceInfo(devices[0], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &global_mem_bytes, NULL);
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    return global_mem_bytes;
+}
+
+void ReconstructionScheduler::start(OpenCLContextQueueProgram * context_cl, int n_frames)
+{
+    bool is_cpu_projection = DetectorFile::isCpuProjection();
+
+    size_t host_budget = availableMemory() * HOST_MEMORY_FRACTION;
+    size_t device_budget = 0;
+
+    if (!is_cpu_projection)
+    {
+        initializeOpenCLFunctions();
+
+        device_budget = deviceMemory(context_cl) * DEVICE_MEMORY_FRACTION;
+    }
+
+    QMutexLocker locker(&p_mutex);
+
+    p_host_budget = host_budget;
+    p_device_budget = device_budget;
+    p_host_in_flight = 0;
+    p_device_in_flight = 0;
+    p_host_peak = 0;
+    p_device_peak = 0;
+    p_tasks_in_flight = 0;
+
+    p_is_cpu_projection = is_cpu_projection;
+
+    p_n_frames = n_frames;
+    p_n_frames_done = 0;
+    p_timer.start();
+}
+
+void ReconstructionScheduler::estimate(ReconstructionTask * task, size_t frame_pixels) const
+{
+    size_t selected_pixels = 0;
+    size_t largest_selection = 0;
+
+    for (int i = 0; i < task->frames.size(); i++)
+    {
+        const Selection & selection = task->frames[i].subImage();
+        size_t n = (size_t) selection.width() * (size_t) selection.height();
+
+        selected_pixels += n;
+        largest_selection = std::max(largest_selection, n);
+    }
+
+    frame_pixels = std::max(frame_pixels, largest_selection);
+
+    // Frames are read and decoded one at a time. The file takes at most as many bytes as the decoded frame.
+    task->host_bytes = frame_pixels * 2 * sizeof(float);
+
+    if (p_is_cpu_projection)
+    {
+        // The samples of one frame
+        task->host_bytes += largest_selection * sizeof(xyzw32);
+        task->device_bytes = 0;
+        return;
+    }
+
+    // Two batches in flight, each with pinned staging memory and, on the way back, its samples. On the device, each
+    // batch has its pixels going in and its samples coming out, and the pixel table covers a full frame.
+    size_t batch_pixels = std::min(selected_pixels, ProjectionContext::maxStagedPixels());
+
+    task->host_bytes += 2 * batch_pixels * (sizeof(float) + sizeof(xyzw32));
+    task->device_bytes = 2 * batch_pixels * (sizeof(cl_float) + sizeof(cl_float4)) + frame_pixels * sizeof(cl_float4);
+}
+
+void ReconstructionScheduler::acquire(const ReconstructionTask & task)
+{
+    QMutexLocker locker(&p_mutex);
+
+    while (p_tasks_in_flight > 0)
+    {
+        bool is_host_room = (p_host_budget == 0) || (p_host_in_flight + task.host_bytes <= p_host_budget);
+        bool is_device_room = (p_device_budget == 0) || (p_device_in_flight + task.device_bytes <= p_device_budget);
+
+        if (is_host_room && is_device_room) break;
+
+        p_room.wait(&p_mutex);
+    }
+
+    p_tasks_in_flight++;
+    p_host_in_flight += task.host_bytes;
+    p_device_in_flight += task.device_bytes;
+
+    p_host_peak = std::max(p_host_peak, p_host_in_flight);
+    p_device_peak = std::max(p_device_peak, p_device_in_flight);
+}
+
+void ReconstructionScheduler::release(const ReconstructionTask & task)
+{
+    QMutexLocker locker(&p_mutex);
+
+    p_tasks_in_flight--;
+    p_host_in_flight -= task.host_bytes;
+    p_device_in_flight -= task.device_bytes;
+
+    p_room.wakeAll();
+}
+
+void ReconstructionScheduler::run(ReconstructionTask & task)
+{
+    acquire(task);
+
+    DetectorFile::populateInterpolationTreeBatch(task.frames, p_is_cpu_projection);
+
+    release(task);
+
+    p_n_frames_done.fetchAndAddRelaxed(task.frames.size());
+}
+
+QString ReconstructionScheduler::report()
+{
+    QMutexLocker locker(&p_mutex);
+
+    int n_frames_done = p_n_frames_done.load();
+    double seconds = p_timer.isValid() ? p_timer.elapsed() * 0.001 : 0.0;
+
+    QString str = "Projected " + QString::number(n_frames_done) + " of " + QString::number(p_n_frames) + " frames";
+
+    if (seconds > 0.0)
+    {
+        str += ", " + QString::number(n_frames_done / seconds, 'f', 1) + " frames/s";
+    }
+
+    str += ". In flight: " + QString::number(p_tasks_in_flight) + " task(s), " + QString::number(p_host_in_flight / 1e6, 'f', 0) + " MB host";
+
+    if (p_host_budget > 0)
+    {
+        str += " of " + QString::number(p_host_budget / 1e6, 'f', 0);
+    }
+
+    if (!p_is_cpu_projection)
+    {
+        str += ", " + QString::number(p_device_in_flight / 1e6, 'f', 0) + " MB device";
+
+        if (p_device_budget > 0)
+        {
+            str += " of " + QString::number(p_device_budget / 1e6, 'f', 0);
+        }
+    }
+
+    str += " (peak " + QString::number(p_host_peak / 1e6, 'f', 0) + " / " + QString::number(p_device_peak / 1e6, 'f', 0) + " MB)";
+
+    return str;
+}
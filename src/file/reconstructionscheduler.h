@@ -0,0 +1,88 @@
+#ifndef RECONSTRUCTIONSCHEDULER_H
+#define RECONSTRUCTIONSCHEDULER_H
+
+/*
+ * Admission control for the threads that project frames into the interpolation tree. Each task, a batch of frames, is
+ * given an estimate of the host and device memory it holds while it runs. Before it starts, it waits until the tasks
+ * already running leave room for it within both budgets. A task is always let through when no other task runs, so one
+ * that alone exceeds a budget still completes.
+ * */
+
+#include <QList>
+#include <QString>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInt>
+#include <QElapsedTimer>
+
+#include "../opencl/contextcl.h"
+#include "../file/fileformat.h"
+
+struct ReconstructionTask
+{
+    QList<DetectorFile> frames;
+
+    size_t host_bytes;
+    size_t device_bytes;
+};
+
+class ReconstructionScheduler : protected OpenCLFunctions
+{
+public:
+    ReconstructionScheduler();
+
+    // Set the budgets and reset the counters. In-flight tasks may use half of the host memory that is free at this
+    // point, and half of the global memory of the device unless frames are projected on the CPU. Whether they are is
+    // read here and holds for the whole run.
+    void start(OpenCLContextQueueProgram * context_cl, int n_frames);
+
+    // Fill in the memory estimates of a task from the selections of its frames and the pixels of a full frame. The
+    // header of a frame is not read yet when it is scheduled, so the full frame size is a hint shared by all frames.
+    // Call after start().
+    void estimate(ReconstructionTask * task, size_t frame_pixels) const;
+
+    // Wait for room, then project the frames of the task
+    void run(ReconstructionTask & task);
+
+    // Frames done, frames per second and memory in flight, for the status bar
+    QString report();
+
+    // Physical and currently free host memory in bytes, or 0 if unknown
+    static size_t physicalMemory();
+    static size_t availableMemory();
+
+private:
+    void acquire(const ReconstructionTask & task);
+    void release(const ReconstructionTask & task);
+    size_t deviceMemory(OpenCLContextQueueProgram * context_cl);
+
+    QMutex p_mutex;
+    QWaitCondition p_room;
+
+    // Budgets of 0 mean no limit
+    size_t p_host_budget, p_device_budget;
+    size_t p_host_in_flight, p_device_in_flight;
+    size_t p_host_peak, p_device_peak;
+    int p_tasks_in_flight;
+
+    bool p_is_cpu_projection;
+
+    int p_n_frames;
+    QAtomicInt p_n_frames_done;
+    QElapsedTimer p_timer;
+};
+
+// Calls ReconstructionScheduler::run, for QtConcurrent::map
+struct RunReconstructionTask
+{
+    RunReconstructionTask(ReconstructionScheduler * scheduler) : scheduler(scheduler) {}
+
+    void operator()(ReconstructionTask & task)
+    {
+        scheduler->run(task);
+    }
+
+    ReconstructionScheduler * scheduler;
+};
+
+#endif // RECONSTRUCTIONSCHEDULER_H
@@ -13,9 +13,12 @@
 #include <QFuture>
 
 #include "sql/sqlqol.h"
+#include "file/cpuprojection.h"
 
 
 static const size_t REDUCED_PIXELS_MAX_BYTES = 1000e6;
+static const int FRAMES_PER_BATCH = 32; // At most this many frames per task when populating the interpolation tree
+static const double INTERPOLATION_TREE_MEMORY_FRACTION = 0.5; // Of the physical memory. The rest of the tree goes to a scratch file.
 
 ImageWorker::ImageWorker()
 {
@@ -87,7 +90,6 @@ void ImageWorker::traceSeries(SeriesSet set)
     // For each image in the series
     for (int j = 0; j < set.current()->size(); j++)
     {
-        frame.readHeader();
         frame.readBody();
 
         // Read data and send to a VRAM buffer.
@@ -196,10 +198,12 @@ ImageOpenGLWidget::ImageOpenGLWidget(QObject * parent) :
     isCorrectionPixelProjectionActive(0),
     isEwaldCircleActive(false),
     isImageTooltipActive(true),
-    is_populateInterpolationTree_canceled(false)
+    is_populateInterpolationTree_canceled(false),
+    is_linear_octree_active(false),
+    is_interpolation_tree_compact(false)
 {
     progressPollTimer = new QTimer;
-    progressPollTimer->setInterval(100);
+    progressPollTimer->setInterval(500);
     connect(progressPollTimer, SIGNAL(timeout()), this, SLOT(pollProgress()));
 
     // Worker
@@ -240,6 +244,8 @@ ImageOpenGLWidget::ImageOpenGLWidget(QObject * parent) :
 
     connect(p_future_watcher, SIGNAL(finished()), this, SLOT(on_populateInterpolationTree_finished()));
     connect(p_future_watcher, SIGNAL(canceled()), this, SLOT(on_populateInterpolationTree_canceled()));
+
+    resetInterpolationTree();
 }
 
 ImageWorker * ImageOpenGLWidget::worker()
@@ -253,6 +259,11 @@ QFutureWatcher<void> *ImageOpenGLWidget::watcher()
     return p_future_watcher;
 }
 
+void ImageOpenGLWidget::projectionBenchmark()
+{
+    cpuProjectionBenchmark(&context_cl);
+}
+
 void ImageOpenGLWidget::paintGL()
 {
     QOpenGLPaintDevice paint_device_gl(this->size());
@@ -1137,20 +1148,15 @@ void ImageOpenGLWidget::processScatteringDataProxy()
 
 
 
-void ImageOpenGLWidget::populateInterpolationTreeMap()
+void ImageOpenGLWidget::resetInterpolationTree()
 {
-    // Note: If the spawned threads consume more than the available memory, either on the host or the gpu, the behaviour is undefined
-    QSqlQuery query(QSqlDatabase::database());
-    query.prepare("SELECT FilePath FROM cbf_table WHERE Active = :Active ORDER BY FilePath ASC");
-    query.bindValue(":Active", 1);
-    if (!query.exec()) qDebug() << sqlQueryError(query);
-
-    p_future_list.clear();
     p_interpolation_octree.clear();
     p_interpolation_octree.setParent(NULL);
     p_interpolation_octree.setBinsPerSide(4);
     p_interpolation_octree.setMaxPoints(512);
     p_interpolation_octree.setMinDataInterdistance(0.001);
+    p_interpolation_octree.setCompact(is_interpolation_tree_compact);
+    p_interpolation_octree.setMemoryBudget(ReconstructionScheduler::physicalMemory() * INTERPOLATION_TREE_MEMORY_FRACTION);
 
     double Q = 1.0; // This value should be more related to the actual wavelength
     Matrix<double> extent(1,6);
@@ -1162,46 +1168,155 @@ void ImageOpenGLWidget::populateInterpolationTreeMap()
     extent[5] = Q;
     p_interpolation_octree.setExtent(extent);
 
+    p_linear_octree.clear();
+    p_linear_octree.setMaxPoints(64);
+    p_linear_octree.setExtent(extent);
+}
+
+DetectorFile ImageOpenGLWidget::interpolationTreeFile(QString file_path)
+{
+    // Prepare detector file.
+    DetectorFile file(file_path);
+
+    // Set the appropriate selection.
+    if (!p_working_data.contains(file_path)) p_working_data[file_path] = ImageInfo(file_path);
+    file.setSubImage(p_working_data[file_path].selection());
+
+    //  Pass an object containing variable parameters (typically given by the UI).
+    DataCorrectionArgs args;
+    args.lorentz_correction = isCorrectionLorentzActive;
+    args.flat_background_correction = isCorrectionNoiseActive;
+    args.planar_background_correction = isCorrectionPlaneActive;
+    args.polarization_correction = isCorrectionPolarizationActive;
+    args.flux_correction = isCorrectionFluxActive;
+    args.exposure_time_correction = isCorrectionExposureActive;
+    args.pixel_projection_correction = isCorrectionPixelProjectionActive;
+    args.noise_low = parameter[0];
+    file.setCorrectionArgs(args);
+
+    // Give it a CL context, queue, BUT NOT kernel handles. clSetKernelArg is NOT thread safe when used across multiple threads on the same kernel object.
+    file.setCLContext(&context_cl);
+
+    // Pass a pointer to an interpolation octree in which to put treated data points.
+    file.setInterpolationTree(&p_interpolation_octree);
+    file.setLinearOctree(is_linear_octree_active ? &p_linear_octree : NULL);
+
+    return file;
+}
+
+void ImageOpenGLWidget::populateInterpolationTreeMap()
+{
+    // Note: The interpolation tree spills to a scratch file beyond its memory budget, and the scheduler holds back
+    // frames while those in flight would exceed the free host or device memory. Both go by estimates.
+    QSqlQuery query(QSqlDatabase::database());
+    query.prepare("SELECT FilePath FROM cbf_table WHERE Active = :Active ORDER BY FilePath ASC");
+    query.bindValue(":Active", 1);
+    if (!query.exec()) qDebug() << sqlQueryError(query);
+
+    p_future_list.clear();
+    p_pending_tree_paths.clear();
+    resetInterpolationTree();
+
     while (query.next())
     {
-        // Prepare detector file.
-        QString file_path = query.value(0).toString();
-        DetectorFile file(file_path);
+        p_future_list << interpolationTreeFile(query.value(0).toString());
+    }
+
+    // Perform the operation
+    mapInterpolationTree();
+}
+
+void ImageOpenGLWidget::appendToInterpolationTree(QStringList paths)
+{
+    // Frames that arrive while the tree is being populated are added when it is done
+    if (p_future_watcher->isRunning())
+    {
+        p_pending_tree_paths << paths;
+        return;
+    }
+
+    p_future_list.clear();
+
+    foreach (const QString &path, paths)
+    {
+        p_future_list << interpolationTreeFile(path);
+    }
 
-        // Set the appropriate selection.
-        if (!p_working_data.contains(file_path)) p_working_data[file_path] = ImageInfo(file_path);
-        file.setSubImage(p_working_data[file_path].selection());
+    mapInterpolationTree();
+}
+
+void ImageOpenGLWidget::mapInterpolationTree()
+{
+    // Frames are projected a batch at a time, and each batch is launched in as few pieces as the device memory allows
+    // Smaller batches for short runs, to keep every thread busy decoding
+    int batch_size = qBound(1, (p_future_list.size() + QThread::idealThreadCount() - 1) / QThread::idealThreadCount(), FRAMES_PER_BATCH);
 
-        //  Pass an object containing variable parameters (typically given by the UI).
-        DataCorrectionArgs args;
-        args.lorentz_correction = isCorrectionLorentzActive;
-        args.flat_background_correction = isCorrectionNoiseActive;
-        args.planar_background_correction = isCorrectionPlaneActive;
-        args.polarization_correction = isCorrectionPolarizationActive;
-        args.flux_correction = isCorrectionFluxActive;
-        args.exposure_time_correction = isCorrectionExposureActive;
-        args.pixel_projection_correction = isCorrectionPixelProjectionActive;
-        args.noise_low = parameter[0];
-        file.setCorrectionArgs(args);
+    p_future_tasks.clear();
 
-        // Give it a CL context, queue, BUT NOT kernel handles. clSetKernelArg is NOT thread safe when used across multiple threads on the same kernel object.
-        file.setCLContext(&context_cl);
+    // Tasks wait for memory to be available before they start
+    p_scheduler.start(&context_cl, p_future_list.size());
 
-        // Pass a pointer to an interpolation octree in which to put treated data points.
-        file.setInterpolationTree(&p_interpolation_octree);
+    // The frames of a data set share their size, so the frame on display stands in for the others
+    size_t frame_pixels = (size_t) image.width() * (size_t) image.height();
 
-        p_future_list << file;
+    for (int i = 0; i < p_future_list.size(); i += batch_size)
+    {
+        ReconstructionTask task;
+        task.frames = p_future_list.mid(i, batch_size);
+        p_scheduler.estimate(&task, frame_pixels);
+
+        p_future_tasks << task;
     }
 
-    // Perform the operation
-    p_future_watcher->setFuture(QtConcurrent::map(p_future_list, &DetectorFile::populateInterpolationTree));
+    p_future_list.clear();
+
+    progressPollTimer->start();
+
+    p_future_watcher->setFuture(QtConcurrent::map(p_future_tasks, RunReconstructionTask(&p_scheduler)));
 }
 
 void ImageOpenGLWidget::on_populateInterpolationTree_finished()
 {
-    if (is_populateInterpolationTree_canceled) p_interpolation_octree.clear();
-    p_future_list.clear();
+    progressPollTimer->stop();
+
+    if (!is_populateInterpolationTree_canceled) emit message(p_scheduler.report());
+
+    if (is_populateInterpolationTree_canceled)
+    {
+        p_interpolation_octree.clear();
+        p_linear_octree.clear();
+        p_pending_tree_paths.clear();
+    }
+    else if (p_linear_octree.pending() > 0)
+    {
+        QElapsedTimer timer;
+        timer.start();
+
+        p_linear_octree.build();
+
+        emit message("Sorted the linear octree (" + QString::number(p_linear_octree.size()) + " points) in " + QString::number(timer.elapsed()) + " ms");
+    }
+
+    p_future_tasks.clear();
     is_populateInterpolationTree_canceled = false;
+
+    if (!p_pending_tree_paths.isEmpty())
+    {
+        QStringList paths = p_pending_tree_paths;
+        p_pending_tree_paths.clear();
+
+        appendToInterpolationTree(paths);
+    }
+}
+
+void ImageOpenGLWidget::setLinearOctree(bool value)
+{
+    is_linear_octree_active = value;
+}
+
+void ImageOpenGLWidget::setCompactInterpolationTree(bool value)
+{
+    is_interpolation_tree_compact = value;
 }
 
 void ImageOpenGLWidget::on_populateInterpolationTree_canceled()
@@ -1213,20 +1328,20 @@ void ImageOpenGLWidget::on_populateInterpolationTree_canceled()
 
 void ImageOpenGLWidget::pollProgress()
 {
-    emit progressChanged(p_n_returned_tasks);
+    // The progress bar follows the future watcher. Throughput and memory go to the status bar.
+    emit message(p_scheduler.report());
 }
 
 void ImageOpenGLWidget::setFrame()
 {
-    // Set the frame
-    image.setPath(p_working_data[p_current_filepath].filePath());
+    // Set the frame. Use the prefetched copy if there is one
+    QString path = p_working_data[p_current_filepath].filePath();
 
-    if (!isCLInitialized || !isGLInitialized)
-    {
-        return;
-    }
+    if (image.filePath() != path) p_frame_prefetcher.take(path, &image);
 
-    if (!image.readHeader())
+    image.setPath(path);
+
+    if (!isCLInitialized || !isGLInitialized)
     {
         return;
     }
@@ -2151,6 +2266,11 @@ void ImageOpenGLWidget::setFilePath(QString str)
     update();
 }
 
+void ImageOpenGLWidget::setPrefetchPaths(QStringList paths)
+{
+    p_frame_prefetcher.setPaths(paths);
+}
+
 void ImageOpenGLWidget::setSeriesTrace()
 {
     /*if (!isCLInitialized || !isGLInitialized)
@@ -29,6 +29,8 @@
 #include "../misc/imagemarker.h"
 #include "../file/framecontainer.h"
 #include "../file/fileformat.h"
+#include "../file/frameprefetcher.h"
+#include "../file/reconstructionscheduler.h"
 #include "../opencl/contextcl.h"
 #include "../math/matrix.h"
 #include "../math/colormatrix.h"
@@ -78,6 +80,9 @@ class ImageOpenGLWidget : public QOpenGLWidget, protected QOpenGLFunctions, prot
 
         QFutureWatcher<void> *watcher();
 
+        // Compare the CPU and the OpenCL projection of frames. Results are written to the debug stream.
+        void projectionBenchmark();
+
     signals:
         void runTraceWorker(SeriesSet set);
 
@@ -104,11 +109,20 @@ class ImageOpenGLWidget : public QOpenGLWidget, protected QOpenGLFunctions, prot
     public slots:
         void pollProgress();
         void populateInterpolationTreeMap();
+        void appendToInterpolationTree(QStringList paths);
         void on_populateInterpolationTree_finished();
         void on_populateInterpolationTree_canceled();
 
+        // Gather projected samples in per-thread buffers and sort them into a linear octree when projection is done,
+        // instead of inserting them into the interpolation tree one by one
+        void setLinearOctree(bool value);
+
+        // Store the points of the interpolation tree in compact form. Takes effect when the tree is next rebuilt.
+        void setCompactInterpolationTree(bool value);
+
         void setApplicationMode(QString str);
         void setFilePath(QString str);
+        void setPrefetchPaths(QStringList paths);
 
         void setSeriesTrace();
         void traceSeriesSlot();
@@ -288,6 +302,7 @@ class ImageOpenGLWidget : public QOpenGLWidget, protected QOpenGLFunctions, prot
 
         // Eventually merge the following two objects into a single class, or at least name them appropriately
         DetectorFile image;
+        FramePrefetcher p_frame_prefetcher;
 
         void initializeCL();
         void setParameter(Matrix<float> &data);
@@ -319,6 +334,8 @@ class ImageOpenGLWidget : public QOpenGLWidget, protected QOpenGLFunctions, prot
         bool isEwaldCircleActive;
         bool isImageTooltipActive;
         bool is_populateInterpolationTree_canceled;
+        bool is_linear_octree_active;
+        bool is_interpolation_tree_compact;
 
         int texture_number;
 
@@ -359,11 +376,19 @@ class ImageOpenGLWidget : public QOpenGLWidget, protected QOpenGLFunctions, prot
         QTimer * progressPollTimer;
 
         QList<DetectorFile> p_future_list;
+        QList<ReconstructionTask> p_future_tasks;
+        ReconstructionScheduler p_scheduler;
         QFutureWatcher<void> * p_future_watcher;
         QMutex p_mutex;
 
+        QStringList p_pending_tree_paths;
+
+        void resetInterpolationTree();
+        DetectorFile interpolationTreeFile(QString file_path);
+        void mapInterpolationTree();
 
         SearchNode p_interpolation_octree;
+        LinearOctree p_linear_octree;
 };
 
 #endif // IMAGEPREVIEW_H
@@ -81,7 +81,8 @@ kernel void correctScatteringData(
     float wavelength,
     float flux,
     float exposure_time,
-    float noise_low
+    float noise_low,
+    int4 selection
 )
 {
     // The frame has its axes like this, looking from the source to
@@ -97,13 +98,15 @@ kernel void correctScatteringData(
     //         |
     //       (slow)
 
-    // Thresholds and other parameters essential to the file
-    int2 id_glb = (int2)(get_global_id(0), get_global_id(1));
+    // The buffers only hold the selection (left, right, top, bottom). Work items are numbered within it.
+    int2 id_win = (int2)(get_global_id(0), get_global_id(1));
+    int2 window_size = (int2)(selection.y - selection.x, selection.w - selection.z);
+    int2 id_glb = id_win + (int2)(selection.x, selection.z);
 
-    if ((id_glb.x < image_size.x) && (id_glb.y < image_size.y))
+    if ((id_win.x < window_size.x) && (id_win.y < window_size.y))
     {
         float4 Q = (float4)(0.0f);
-        Q.w = in_buf[id_glb.y * image_size.x + id_glb.x];
+        Q.w = in_buf[id_win.y * window_size.x + id_win.x];
 
         // Flat background subtraction
         if (isCorrectionNoiseActive)
@@ -194,7 +197,7 @@ kernel void correctScatteringData(
             // Polarization correction begs implementation
         }
 
-        out_buf[id_glb.y * image_size.x + id_glb.x] = Q.w;
+        out_buf[id_win.y * window_size.x + id_win.x] = Q.w;
     }
 }
 
@@ -406,56 +409,335 @@ kernel void projectScatteringData(
     //         |
     //         |
     //       (slow)
-    int2 id_glb = (int2)(get_global_id(0), get_global_id(1));
 
-    if ((id_glb.x < image_size.x) && (id_glb.y < image_size.y))
+    // The buffers only hold the selection (left, right, top, bottom). Work items are numbered within it.
+    int2 id_win = (int2)(get_global_id(0), get_global_id(1));
+    int2 window_size = (int2)(selection.y - selection.x, selection.w - selection.z);
+    int2 id_glb = id_win + (int2)(selection.x, selection.z);
+
+    if ((id_win.x < window_size.x) && (id_win.y < window_size.y))
     {
         float4 Q = (float4)(0.0f);
 
-        // If the pixel is within the selection
-        if ((id_glb.x >= selection.x) && // Left
-                (id_glb.x < selection.y) && // Right
-                (id_glb.y >= selection.z) && // Top
-                (id_glb.y < selection.w)) // Bottom
+        Q.w = in_buf[id_win.y * window_size.x + id_win.x];
+
+//        if (Q.w > 0.0f)
+//        {
+        /*
+         * Projecting the pixel onto the Ewald sphere
+         * */
+
+        // The real space vector OP going from the origo (O) to the pixel (P)
+        float3 OP = (float3)(
+                                        -detector_distance,
+                                        pixel_size_x * ((float) (image_size.y - 0.5f - id_glb.y) - beam_x), /* DANGER */
+                                        //pixel_size_y * ((float) (image_size.x - 0.5f - id_glb.x) - beam_y)
+                                        pixel_size_y * ((float) -((id_glb.x + 0.5) - beam_y))); /* DANGER */
+
+        float k = 1.0f / wavelength; // Multiply with 2pi if desired
+
+        float3 k_i = (float3)(-k, 0, 0);
+        float3 k_f = k * normalize(OP);
+
+        Q.xyz = k_f - k_i;
+
+        // Sample rotation
+        float3 temp = Q.xyz;
+
+        Q.x = temp.x * sample_rotation_matrix[0] + temp.y * sample_rotation_matrix[1] + temp.z * sample_rotation_matrix[2];
+        Q.y = temp.x * sample_rotation_matrix[4] + temp.y * sample_rotation_matrix[5] + temp.z * sample_rotation_matrix[6];
+        Q.z = temp.x * sample_rotation_matrix[8] + temp.y * sample_rotation_matrix[9] + temp.z * sample_rotation_matrix[10];
+//        }
+
+        // Write to the Q target (CL texture)
+        out_buf[id_win.y * window_size.x + id_win.x] = Q;
+    }
+}
+
+float4 pixelQ(
+    int2 id_glb,
+    int2 image_size,
+    int isCorrectionLorentzActive,
+    int isCorrectionPixelProjectionActive,
+    float detector_distance,
+    float beam_center_x,
+    float beam_center_y,
+    float pixel_size_x,
+    float pixel_size_y,
+    float wavelength
+)
+{
+    // The scattering vector of a pixel before the sample rotation in xyz, and the product of the corrections that only
+    // depend on the detector geometry in w. Frames that share the geometry share the result.
+    float4 Q = (float4)(0.0f, 0.0f, 0.0f, 1.0f);
+
+    // The real space vector OP going from the origo (O) to the pixel (P)
+    float3 OP = (float3)(
+                                    -detector_distance,
+                                    pixel_size_x * ((float) (image_size.y - id_glb.y - 0.5) - beam_center_x), /* DANGER */
+                                    pixel_size_y * ((float) -((id_glb.x + 0.5) - beam_center_y))); /* DANGER */
+
+    float k = 1.0f / wavelength; // Multiply with 2pi if desired
+
+    /* Corrections */
+    // Correct for the area of the projection of the pixel onto the Ewald sphere
+    if (isCorrectionPixelProjectionActive)
+    {
+        float forward_projected_area;
         {
-            Q.w = in_buf[id_glb.y * image_size.x + id_glb.x];
+            // The four vectors that define projected pixel on the Ewald sphere
+            float3 a_vec = k * normalize((float3)(-detector_distance, (float) pixel_size_x * 0.5, -(float) pixel_size_y * 0.5));
+            float3 b_vec = k * normalize((float3)(-detector_distance, -(float) pixel_size_x * 0.5, -(float) pixel_size_y * 0.5));
+            float3 c_vec = k * normalize((float3)(-detector_distance, -(float) pixel_size_x * 0.5, (float) pixel_size_y * 0.5));
+            float3 d_vec = k * normalize((float3)(-detector_distance, (float) pixel_size_x * 0.5, (float) pixel_size_y * 0.5));
+
+            // The area of the two spherical triangles spanned by the projected pixel is approximated by their corresponding planar triangles since they are small
+            float3 ab_vec = b_vec - a_vec;
+            float3 ac_vec = c_vec - a_vec;
+            float3 ad_vec = d_vec - a_vec;
+
+            forward_projected_area = 0.5*fabs(length(cross(ab_vec,ac_vec))) + 0.5*fabs(length(cross(ac_vec,ad_vec)));
+        }
 
-//            if (Q.w > 0.0f)
-//            {
-                /*
-                 * Projecting the pixel onto the Ewald sphere
-                 * */
+        float projected_area;
+        {
+            // The four vectors that define projected pixel on the Ewald sphere
+            float3 a_vec = k * normalize(OP + (float3)(0, (float) pixel_size_x * 0.5, -(float) pixel_size_y * 0.5));
+            float3 b_vec = k * normalize(OP + (float3)(0, -(float) pixel_size_x * 0.5, -(float) pixel_size_y * 0.5));
+            float3 c_vec = k * normalize(OP + (float3)(0, -(float) pixel_size_x * 0.5, (float) pixel_size_y * 0.5));
+            float3 d_vec = k * normalize(OP + (float3)(0, (float) pixel_size_x * 0.5, (float) pixel_size_y * 0.5));
+
+            // The area of the two spherical triangles spanned by the projected pixel is approximated by their corresponding planar triangles since they are small
+            float3 ab_vec = b_vec - a_vec;
+            float3 ac_vec = c_vec - a_vec;
+            float3 ad_vec = d_vec - a_vec;
+
+            projected_area = 0.5*fabs(length(cross(ab_vec,ac_vec))) + 0.5*fabs(length(cross(ac_vec,ad_vec)));
+        }
 
-                // The real space vector OP going from the origo (O) to the pixel (P)
-                float3 OP = (float3)(
-                                                -detector_distance,
-                                                pixel_size_x * ((float) (image_size.y - 0.5f - id_glb.y) - beam_x), /* DANGER */
-                                                //pixel_size_y * ((float) (image_size.x - 0.5f - id_glb.x) - beam_y)
-                                                pixel_size_y * ((float) -((id_glb.x + 0.5) - beam_y))); /* DANGER */
+        // Correction
+        Q.w *= forward_projected_area / projected_area;
+    }
 
-                float k = 1.0f / wavelength; // Multiply with 2pi if desired
+    float3 k_i = (float3)(-k, 0, 0);
+    float3 k_f = k * normalize(OP);
 
-                float3 k_i = (float3)(-k, 0, 0);
-                float3 k_f = k * normalize(OP);
+    Q.xyz = k_f - k_i;
 
-                Q.xyz = k_f - k_i;
+    // Lorentz correction assuming rotation around a given axis (corresponding to the rotation of a single motor in most cases)
+    if (isCorrectionLorentzActive)
+    {
+        float3 axis_rot = (float3)(0.0f,0.0f,1.0f); // Omega rotation
+        Q.w *= wavelength*fabs((dot(cross(normalize(axis_rot), Q.xyz),normalize(k_f))));
+    }
 
-                // Sample rotation
-                float3 temp = Q.xyz;
+    return Q;
+}
 
-                Q.x = temp.x * sample_rotation_matrix[0] + temp.y * sample_rotation_matrix[1] + temp.z * sample_rotation_matrix[2];
-                Q.y = temp.x * sample_rotation_matrix[4] + temp.y * sample_rotation_matrix[5] + temp.z * sample_rotation_matrix[6];
-                Q.z = temp.x * sample_rotation_matrix[8] + temp.y * sample_rotation_matrix[9] + temp.z * sample_rotation_matrix[10];
-//            }
+float4 rotateSample(float4 Q, float16 sample_rotation_matrix)
+{
+    float3 temp = Q.xyz;
+
+    Q.x = dot(temp, sample_rotation_matrix.s012);
+    Q.y = dot(temp, sample_rotation_matrix.s456);
+    Q.z = dot(temp, sample_rotation_matrix.s89a);
+
+    return Q;
+}
+
+float4 correctProjectPixel(
+    float value,
+    int2 id_glb,
+    int2 image_size,
+    int isCorrectionLorentzActive,
+    int isCorrectionNoiseActive,
+    int isCorrectionPixelProjectionActive,
+    float detector_distance,
+    float beam_center_x,
+    float beam_center_y,
+    float pixel_size_x,
+    float pixel_size_y,
+    float wavelength,
+    float noise_low,
+    float16 sample_rotation_matrix
+)
+{
+    // The corrections of correctScatteringData followed by the projection of projectScatteringData, for one pixel
+
+    // Flat background subtraction
+    if (isCorrectionNoiseActive)
+    {
+        value = clamp(value, noise_low, value); // All readings within thresholds
+        value -= noise_low; // Subtract
+    }
+
+    float4 Q = pixelQ(id_glb, image_size, isCorrectionLorentzActive, isCorrectionPixelProjectionActive,
+                      detector_distance, beam_center_x, beam_center_y, pixel_size_x, pixel_size_y, wavelength);
+
+    Q.w *= value;
+
+    // Sample rotation
+    return rotateSample(Q, sample_rotation_matrix);
+}
+
+kernel void pixelTable(
+    global float4 * out_buf,
+    int2 image_size,
+    int isCorrectionLorentzActive,
+    int isCorrectionPixelProjectionActive,
+    float detector_distance,
+    float beam_center_x,
+    float beam_center_y,
+    float pixel_size_x,
+    float pixel_size_y,
+    float wavelength
+)
+{
+    // pixelQ for every pixel of a frame, row by row along the fast dimension
+    int2 id_glb = (int2)(get_global_id(0), get_global_id(1));
+
+    if ((id_glb.x < image_size.x) && (id_glb.y < image_size.y))
+    {
+        out_buf[id_glb.y * image_size.x + id_glb.x] = pixelQ(id_glb, image_size, isCorrectionLorentzActive, isCorrectionPixelProjectionActive,
+                                                             detector_distance, beam_center_x, beam_center_y, pixel_size_x, pixel_size_y, wavelength);
+    }
+}
+
+kernel void correctProjectScatteringData(
+    global float * in_buf,
+    global float4 * out_buf,
+    global int * out_count,
+    constant float * sample_rotation_matrix,
+    int2 image_size,
+    int isCorrectionLorentzActive,
+    int isCorrectionNoiseActive,
+    int isCorrectionPixelProjectionActive,
+    float detector_distance,
+    float beam_center_x,
+    float beam_center_y,
+    float pixel_size_x,
+    float pixel_size_y,
+    float wavelength,
+    float noise_low,
+    int4 selection
+)
+{
+    // correctScatteringData and projectScatteringData in one pass. Samples with an intensity above zero after the
+    // corrections are packed at the front of out_buf in no particular order, and out_count is set to the number of them.
+    // It must be zero on entry. Each work group reserves room for all its samples with a single global atomic.
+
+    // The buffers only hold the selection (left, right, top, bottom). Work items are numbered within it.
+    int2 id_win = (int2)(get_global_id(0), get_global_id(1));
+    int2 window_size = (int2)(selection.y - selection.x, selection.w - selection.z);
+    int2 id_glb = id_win + (int2)(selection.x, selection.z);
+
+    local int group_count;
+    local int group_offset;
+
+    if ((get_local_id(0) == 0) && (get_local_id(1) == 0)) group_count = 0;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    float4 Q = (float4)(0.0f);
+    int slot = -1;
+
+    if ((id_win.x < window_size.x) && (id_win.y < window_size.y))
+    {
+        Q = correctProjectPixel(in_buf[id_win.y * window_size.x + id_win.x], id_glb, image_size,
+                                isCorrectionLorentzActive, isCorrectionNoiseActive, isCorrectionPixelProjectionActive,
+                                detector_distance, beam_center_x, beam_center_y, pixel_size_x, pixel_size_y, wavelength, noise_low,
+                                vload16(0, sample_rotation_matrix));
+
+        if (Q.w > 0.0f) slot = atomic_inc(&group_count);
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if ((get_local_id(0) == 0) && (get_local_id(1) == 0)) group_offset = atomic_add(out_count, group_count);
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (slot >= 0) out_buf[group_offset + slot] = Q;
+}
+
+kernel void correctProjectScatteringDataBatch(
+    global float * in_buf,
+    global float4 * out_buf,
+    global int * out_count,
+    global int * frame_info,
+    global float * frame_geometry,
+    global float4 * pixel_table,
+    int n_frames,
+    int n_pixels,
+    int isCorrectionNoiseActive
+)
+{
+    // As correctProjectScatteringData, but for the selections of several frames stored back to back in in_buf. Work
+    // items are numbered across all of them. The frames share the detector geometry, and pixel_table holds pixelQ for
+    // every pixel of it, so a pixel only needs the background subtraction and the sample rotation. Per frame there are
+    // 8 ints in frame_info:
+    //   pixel offset in in_buf, selection (left, right, top, bottom), fast dimension, slow dimension, unused
+    // and 24 floats in frame_geometry:
+    //   detector distance, beam x, beam y, pixel size x, pixel size y, wavelength, noise low, unused, rotation matrix (4x4)
+    // of which only the noise level and the rotation are read here.
+    int id = get_global_id(0);
+
+    local int group_count;
+    local int group_offset;
+
+    if (get_local_id(0) == 0) group_count = 0;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    float4 Q = (float4)(0.0f);
+    int slot = -1;
+
+    if (id < n_pixels)
+    {
+        // Find the frame by its offset
+        int low = 0, high = n_frames - 1;
+
+        while (low < high)
+        {
+            int mid = (low + high + 1) / 2;
+
+            if (frame_info[mid * 8] <= id) low = mid;
+            else high = mid - 1;
         }
-        else
+
+        global int * info = frame_info + low * 8;
+        global float * geometry = frame_geometry + low * 24;
+
+        int4 selection = vload4(0, info + 1);
+        int window_width = selection.y - selection.x;
+        int pixel = id - info[0];
+
+        int2 id_glb = (int2)(pixel % window_width, pixel / window_width) + (int2)(selection.x, selection.z);
+
+        float value = in_buf[id];
+
+        // Flat background subtraction
+        if (isCorrectionNoiseActive)
         {
-            Q.w = 0.0f;
+            value = clamp(value, geometry[6], value); // All readings within thresholds
+            value -= geometry[6]; // Subtract
         }
 
-        // Write to the Q target (CL texture)
-        out_buf[id_glb.y * image_size.x + id_glb.x] = Q;
+        Q = pixel_table[id_glb.y * info[5] + id_glb.x];
+        Q.w *= value;
+
+        Q = rotateSample(Q, vload16(0, geometry + 8));
+
+        if (Q.w > 0.0f) slot = atomic_inc(&group_count);
     }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (get_local_id(0) == 0) group_offset = atomic_add(out_count, group_count);
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (slot >= 0) out_buf[group_offset + slot] = Q;
 }
 
 kernel void bufferMax(
@@ -1,3 +1,95 @@
+void brick_statistics(
+    local float * addition_array,
+    float value,
+    int id_output,
+    int id_wg,
+    uint brick_outer_dimension,
+    global float * min_check,
+    global float * sum_check,
+    global float * variance_check
+)
+{
+    // Reductions over the values of one brick, shared by the voxelize kernels
+
+    // Parallel reduction that instead of summing finds the minimum value
+    addition_array[id_output] = value;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (unsigned int i = 256; i > 0; i >>= 1)
+    {
+        if (id_output < i)
+        {
+            if (addition_array[id_output] < addition_array[i + id_output])
+            {
+                addition_array[id_output] = addition_array[i + id_output];
+            }
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (id_output == 0)
+    {
+        min_check[id_wg] = addition_array[0];
+    }
+
+    // Parallel reduction to find the sum
+    addition_array[id_output] = value;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (unsigned int i = 256; i > 0; i >>= 1)
+    {
+        if (id_output < i)
+        {
+            if (addition_array[id_output] < addition_array[i + id_output])
+            {
+                addition_array[id_output] = addition_array[i + id_output];
+            }
+
+            addition_array[id_output] += addition_array[i + id_output];
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (id_output == 0)
+    {
+        sum_check[id_wg] = addition_array[0];
+    }
+
+
+
+    // Parallel reduction to find the variance
+    float average = addition_array[0] / (float)(brick_outer_dimension * brick_outer_dimension * brick_outer_dimension);
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+    addition_array[id_output] = (value - average) * (value - average);
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (unsigned int i = 256; i > 0; i >>= 1)
+    {
+        if (id_output < i)
+        {
+            addition_array[id_output] += addition_array[i + id_output];
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (id_output == 0)
+    {
+        variance_check[id_wg] = addition_array[0] / (float)(brick_outer_dimension * brick_outer_dimension * brick_outer_dimension);
+    }
+}
+
+// The number of points that the voxelize kernels hold in local memory at a time. The host sets it for the device.
+#ifndef POINT_TILE_SIZE
+#define POINT_TILE_SIZE 256
+#endif
+
 kernel void voxelize(
     global float4 * point_data,
     global int * point_data_offset,
@@ -19,7 +111,8 @@ kernel void voxelize(
 
     int id_output = id_loc.x + id_loc.y * brick_outer_dimension + id_loc.z * brick_outer_dimension * brick_outer_dimension;
 
-    int id_wg = get_global_id(2) / brick_outer_dimension;
+    // All bricks of a cluster are treated in one launch, stacked along the third dimension
+    int id_wg = get_group_id(2);
 
     // Position of point
     float4 xyzw;
@@ -29,23 +122,42 @@ kernel void voxelize(
     xyzw.z = brick_extent[id_wg * 6 + 4] + (float)id_loc.z * sample_interdistance;
     xyzw.w = 0.0f;
 
-    // Interpolate around positions using invrese distance weighting
+    // Interpolate around positions using invrese distance weighting. The work group loads the points of the brick in
+    // tiles of POINT_TILE_SIZE into local memory, and every voxel then reads them from there. All work items go through
+    // all tiles to reach the barriers, so an exact hit is remembered rather than breaking the loop.
+    local float4 point_tile[POINT_TILE_SIZE];
+
     float4 point;
     float sum_intensity = 0.0f;
     float sum_distance = 0.0f;
     float dst;
+    bool is_exact = false;
 
-    if (1) // Inverse distance weighting (IDW) interpolation
+    int n_items = get_local_size(0) * get_local_size(1) * get_local_size(2);
+    int offset = point_data_offset[id_wg];
+    int count = point_data_count[id_wg];
+
+    for (int base = 0; base < count; base += POINT_TILE_SIZE)
     {
-        for (int i = 0; i < point_data_count[id_wg]; i++)
+        int n_tile = min(POINT_TILE_SIZE, count - base);
+
+        for (int k = id_output; k < n_tile; k += n_items)
+        {
+            point_tile[k] = point_data[offset + base + k];
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int i = 0; (i < n_tile) && !is_exact; i++)
         {
-            point = point_data[point_data_offset[id_wg] + i];
+            point = point_tile[i];
             dst = fast_distance(xyzw.xyz, point.xyz);
 
             if (dst <= 0.0f)
             {
                 sum_intensity = point.w;
                 sum_distance = 1.0f;
+                is_exact = true;
                 break;
             }
 
@@ -56,6 +168,11 @@ kernel void voxelize(
             }
         }
 
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (1) // Inverse distance weighting (IDW) interpolation
+    {
         if (sum_distance > 0)
         {
             xyzw.w = sum_intensity / sum_distance;
@@ -63,27 +180,7 @@ kernel void voxelize(
     }
     if (0) // IDW interpolation combined with approximate volume fill ratio linear scaling
     {
-        float fill_ratio = min(1.0f, (float) point_data_count[id_wg] *  (4.0f*M_PI_F/3.0f) * pow(0.5f*data_point_radius,3.0f) / pow(sample_interdistance*7,3.0f));
-
-
-        for (int i = 0; i < point_data_count[id_wg]; i++)
-        {
-            point = point_data[point_data_offset[id_wg] + i];
-            dst = fast_distance(xyzw.xyz, point.xyz);
-
-            if (dst <= 0.0f)
-            {
-                sum_intensity = point.w;
-                sum_distance = 1.0f;
-                break;
-            }
-
-            if (dst <= search_radius)
-            {
-                sum_intensity += native_divide(point.w, dst);
-                sum_distance += native_divide(1.0f, dst);
-            }
-        }
+        float fill_ratio = min(1.0f, (float) count *  (4.0f*M_PI_F/3.0f) * pow(0.5f*data_point_radius,3.0f) / pow(sample_interdistance*7,3.0f));
 
         if (sum_distance > 0)
         {
@@ -94,78 +191,183 @@ kernel void voxelize(
     // Pass result to output array
     pool_cluster[id_wg * brick_outer_dimension * brick_outer_dimension * brick_outer_dimension + id_output] = xyzw.w;
 
-    // Parallel reduction that instead of summing finds the minimum value
-    addition_array[id_output] = xyzw.w;
+    brick_statistics(addition_array, xyzw.w, id_output, id_wg, brick_outer_dimension, min_check, sum_check, variance_check);
+}
 
-    barrier(CLK_LOCAL_MEM_FENCE);
+// The largest number of bin cells along each side of a brick in voxelize_binned
+#define BIN_DIM_MAX 12
 
-    for (unsigned int i = 256; i > 0; i >>= 1)
-    {
-        if (id_output < i)
-        {
-            if (addition_array[id_output] < addition_array[i + id_output])
-            {
-                addition_array[id_output] = addition_array[i + id_output];
-            }
-        }
+int4 bin_cell(float4 point, float4 grid_min, float cell_size, int bin_dim)
+{
+    int4 cell = convert_int4_rtn((point - grid_min) / cell_size);
 
-        barrier(CLK_LOCAL_MEM_FENCE);
-    }
+    return clamp(cell, (int4)(0), (int4)(bin_dim - 1));
+}
 
-    if (id_output == 0)
+kernel void voxelize_binned(
+    global float4 * point_data,
+    global int * point_data_offset,
+    global int * point_data_count,
+    global float * brick_extent,
+    global float * pool_cluster,
+    global float * min_check,
+    global float * sum_check,
+    global float * variance_check,
+    local float * addition_array,
+    uint brick_outer_dimension,
+    float search_radius,
+    float data_point_radius,
+    global float4 * point_data_binned
+)
+{
+    // Same as voxelize, but the work group first sorts the points of its brick into a grid of cells that are at least
+    // search_radius wide. The sorted points go to the same range of point_data_binned. Each voxel then only visits the
+    // cell it is in and the cells next to it, so its cost follows the local point density instead of the point count of
+    // the brick.
+    local int cell_start[BIN_DIM_MAX * BIN_DIM_MAX * BIN_DIM_MAX + 1];
+    local int cell_cursor[BIN_DIM_MAX * BIN_DIM_MAX * BIN_DIM_MAX];
+    local float4 point_tile[POINT_TILE_SIZE];
+
+    int4 id_loc = (int4)(get_local_id(0), get_local_id(1), get_local_id(2), 0);
+
+    int id_output = id_loc.x + id_loc.y * brick_outer_dimension + id_loc.z * brick_outer_dimension * brick_outer_dimension;
+
+    int id_wg = get_group_id(2);
+
+    int n_items = get_local_size(0) * get_local_size(1) * get_local_size(2);
+
+    // Position of point
+    float4 xyzw;
+    float sample_interdistance = (brick_extent[id_wg * 6 + 1] - brick_extent[id_wg * 6 + 0]) / ((float)brick_outer_dimension - 1.0f);
+    xyzw.x = brick_extent[id_wg * 6 + 0] + (float)id_loc.x * sample_interdistance;
+    xyzw.y = brick_extent[id_wg * 6 + 2] + (float)id_loc.y * sample_interdistance;
+    xyzw.z = brick_extent[id_wg * 6 + 4] + (float)id_loc.z * sample_interdistance;
+    xyzw.w = 0.0f;
+
+    // The grid covers the brick and the search radius around it, which is where the points of the brick were taken from
+    float4 grid_min = (float4)(brick_extent[id_wg * 6 + 0], brick_extent[id_wg * 6 + 2], brick_extent[id_wg * 6 + 4], 0.0f) - (float4)(search_radius, search_radius, search_radius, 0.0f);
+    float grid_span = brick_extent[id_wg * 6 + 1] - brick_extent[id_wg * 6 + 0] + 2.0f * search_radius;
+    int bin_dim = clamp((int)(grid_span / search_radius), 1, BIN_DIM_MAX);
+    float cell_size = grid_span / (float) bin_dim;
+    int n_cells = bin_dim * bin_dim * bin_dim;
+
+    int offset = point_data_offset[id_wg];
+    int count = point_data_count[id_wg];
+
+    // Count the points in each cell
+    for (int c = id_output; c < n_cells; c += n_items)
     {
-        min_check[id_wg] = addition_array[0];
+        cell_cursor[c] = 0;
     }
 
-    // Parallel reduction to find the sum
-    addition_array[id_output] = xyzw.w;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = id_output; i < count; i += n_items)
+    {
+        int4 cell = bin_cell(point_data[offset + i], grid_min, cell_size, bin_dim);
+
+        atomic_inc(&cell_cursor[cell.x + cell.y * bin_dim + cell.z * bin_dim * bin_dim]);
+    }
 
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    for (unsigned int i = 256; i > 0; i >>= 1)
+    // Exclusive prefix sum of the counts. There are at most a couple of thousand cells.
+    if (id_output == 0)
     {
-        if (id_output < i)
-        {
-            if (addition_array[id_output] < addition_array[i + id_output])
-            {
-                addition_array[id_output] = addition_array[i + id_output];
-            }
+        int sum = 0;
 
-            addition_array[id_output] += addition_array[i + id_output];
+        for (int c = 0; c < n_cells; c++)
+        {
+            cell_start[c] = sum;
+            sum += cell_cursor[c];
+            cell_cursor[c] = cell_start[c];
         }
 
-        barrier(CLK_LOCAL_MEM_FENCE);
+        cell_start[n_cells] = sum;
     }
 
-    if (id_output == 0)
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Sort the points into their cells
+    for (int i = id_output; i < count; i += n_items)
     {
-        sum_check[id_wg] = addition_array[0];
-    }
+        float4 point = point_data[offset + i];
+        int4 cell = bin_cell(point, grid_min, cell_size, bin_dim);
 
+        int k = atomic_inc(&cell_cursor[cell.x + cell.y * bin_dim + cell.z * bin_dim * bin_dim]);
 
+        point_data_binned[offset + k] = point;
+    }
 
-    // Parallel reduction to find the variance
-    float average = addition_array[0] / (float)(brick_outer_dimension * brick_outer_dimension * brick_outer_dimension);
+    barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
 
-    barrier(CLK_LOCAL_MEM_FENCE);
-    addition_array[id_output] = (xyzw.w - average) * (xyzw.w - average);
+    // Interpolate around positions using inverse distance weighting (IDW), with the points in the neighbouring cells.
+    // The sorted points are loaded in tiles of POINT_TILE_SIZE into local memory as in voxelize. The cells are ordered
+    // with x running fastest, so the neighbours in each of the (up to) nine rows along x form one range of points, and
+    // each voxel reads the part of its ranges that lies in the tile.
 
-    barrier(CLK_LOCAL_MEM_FENCE);
+    float sum_intensity = 0.0f;
+    float sum_distance = 0.0f;
+    bool is_exact = false;
 
-    for (unsigned int i = 256; i > 0; i >>= 1)
+    int4 cell = bin_cell(xyzw, grid_min, cell_size, bin_dim);
+    int x_first = max(cell.x - 1, 0);
+    int x_last = min(cell.x + 1, bin_dim - 1);
+
+    for (int base = 0; base < count; base += POINT_TILE_SIZE)
     {
-        if (id_output < i)
+        int n_tile = min(POINT_TILE_SIZE, count - base);
+
+        for (int k = id_output; k < n_tile; k += n_items)
         {
-            addition_array[id_output] += addition_array[i + id_output];
+            point_tile[k] = point_data_binned[offset + base + k];
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int z = max(cell.z - 1, 0); (z <= min(cell.z + 1, bin_dim - 1)) && !is_exact; z++)
+        {
+            for (int y = max(cell.y - 1, 0); (y <= min(cell.y + 1, bin_dim - 1)) && !is_exact; y++)
+            {
+                int row = y * bin_dim + z * bin_dim * bin_dim;
+
+                int first = max(cell_start[row + x_first], base);
+                int last = min(cell_start[row + x_last + 1], base + n_tile);
+
+                for (int i = first; i < last; i++)
+                {
+                    float4 point = point_tile[i - base];
+                    float dst = fast_distance(xyzw.xyz, point.xyz);
+
+                    if (dst <= 0.0f)
+                    {
+                        sum_intensity = point.w;
+                        sum_distance = 1.0f;
+                        is_exact = true;
+                        break;
+                    }
+
+                    if (dst <= search_radius)
+                    {
+                        sum_intensity += native_divide(point.w, dst);
+                        sum_distance += native_divide(1.0f, dst);
+                    }
+                }
+            }
         }
 
         barrier(CLK_LOCAL_MEM_FENCE);
     }
 
-    if (id_output == 0)
+    if (sum_distance > 0)
     {
-        variance_check[id_wg] = addition_array[0] / (float)(brick_outer_dimension * brick_outer_dimension * brick_outer_dimension);
+        xyzw.w = sum_intensity / sum_distance;
     }
+
+    // Pass result to output array
+    pool_cluster[id_wg * brick_outer_dimension * brick_outer_dimension * brick_outer_dimension + id_output] = xyzw.w;
+
+    brick_statistics(addition_array, xyzw.w, id_output, id_wg, brick_outer_dimension, min_check, sum_check, variance_check);
 }
 
 uint target_index(int4 target_dimension, int4 id_loc , uint brick_outer_dimension, uint brick_count)
@@ -182,19 +384,133 @@ uint target_index(int4 target_dimension, int4 id_loc , uint brick_outer_dimensio
     return index3d.x + index3d.y * target_dimension.x + index3d.z * target_dimension.x * target_dimension.y;
 }
 
+kernel void compact(
+    global float * min_check,
+    global float * sum_check,
+    global float * variance_check,
+    global int * brick_slot,
+    global int * brick_list,
+    local int * scan_array,
+    local float * max_array,
+    uint n_bricks,
+    uint first_brick,
+    uint max_bricks,
+    uint n_points_brick,
+    int is_max_level,
+    int is_near_max_level
+)
+{
+    // Run as a single work group with a power of two size. The non-empty bricks of the cluster get consecutive pool
+    // bricks from first_brick on, in the order of the cluster. brick_slot holds the pool brick of each cluster brick, or
+    // -1 if it is empty or does not fit below max_bricks. brick_list holds the number of non-empty bricks, the largest
+    // brick sum among those that fit, and then the cluster index and max subdivision flag of each non-empty brick.
+
+    int id = get_local_id(0);
+    int size = get_local_size(0);
+
+    uint offset = 0;
+    float max_sum = 0.0f;
+
+    for (uint base = 0; base < n_bricks; base += size)
+    {
+        uint j = base + id;
+        int flag = (j < n_bricks) && (sum_check[j] > 0.0f);
+
+        // Inclusive prefix sum of the flags
+        scan_array[id] = flag;
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int stride = 1; stride < size; stride <<= 1)
+        {
+            int value = (id >= stride) ? scan_array[id - stride] : 0;
+
+            barrier(CLK_LOCAL_MEM_FENCE);
+
+            scan_array[id] += value;
+
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        uint rank = offset + scan_array[id] - flag;
+
+        if (j < n_bricks)
+        {
+            int slot = -1;
+
+            if (flag)
+            {
+                // Set maximum subdivision if the max level is reached or if the variance of the brick data is small compared to the average
+                float average = sum_check[j] / (float) n_points_brick;
+                float std_dev = sqrt(variance_check[j]);
+
+                int msd = is_max_level ||
+                          (is_near_max_level && (std_dev <= 0.5f * average) && (min_check[j] > 0.0f)) || // Voxel data is self-similar and all voxels are non-zero
+                          (is_near_max_level && (std_dev <= 0.2f * average)); // Voxel data is self-similar
+
+                brick_list[2 + 2 * rank + 0] = j;
+                brick_list[2 + 2 * rank + 1] = msd;
+
+                if (first_brick + rank < max_bricks)
+                {
+                    slot = first_brick + rank;
+                    max_sum = max(max_sum, sum_check[j]);
+                }
+            }
+
+            brick_slot[j] = slot;
+        }
+
+        offset += scan_array[size - 1];
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // Parallel reduction to find the largest sum
+    max_array[id] = max_sum;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = size / 2; i > 0; i >>= 1)
+    {
+        if (id < i)
+        {
+            max_array[id] = max(max_array[id], max_array[i + id]);
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (id == 0)
+    {
+        brick_list[0] = offset;
+        brick_list[1] = as_int(max_array[0]);
+    }
+}
+
 kernel void fill(
     global float * pool_cluster,
     global float * pool,
     int4 pool_dimension,
     uint brick_outer_dimension,
-    uint brick_count
+    global int * brick_slot,
+    uint first_brick,
+    uint n_bricks
 )
 {
-    // Move relevant (nonzero) data from temporary storage to permanent storage
+    // Move relevant (nonzero) data from temporary storage to permanent storage. The pool buffer is the slab that holds the
+    // pool bricks from first_brick to first_brick + n_bricks. Work group n copies the cluster brick n to the pool brick
+    // brick_slot[n], or does nothing if it has none or the brick is in another slab.
 
     int4 id_loc = (int4)(get_local_id(0), get_local_id(1), get_local_id(2), 0);
 
-    int id_wg = get_global_id(2) / brick_outer_dimension;
+    int id_wg = get_group_id(2);
+
+    int slot = brick_slot[id_wg];
+
+    if ((slot < 0) || ((uint) slot < first_brick) || ((uint) slot >= first_brick + n_bricks)) return;
+
+    uint brick_count = slot - first_brick;
 
     int id_output = id_loc.x + id_loc.y * brick_outer_dimension + id_loc.z * brick_outer_dimension * brick_outer_dimension;
 
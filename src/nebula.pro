@@ -51,6 +51,15 @@ OTHER_FILES += \
 
 HEADERS += \
     file/fileformat.h \
+    file/byteoffset.h \
+    file/frameprefetcher.h \
+    file/framecache.h \
+    file/framestack.h \
+    file/directorywatcher.h \
+    file/projectioncontext.h \
+    file/pixeltablecache.h \
+    file/cpuprojection.h \
+    file/reconstructionscheduler.h \
     file/filetreeview.h \
     image/imagepreview.h \
     math/ccmatrix.h \
@@ -63,6 +72,7 @@ HEADERS += \
     misc/transferfunction.h \
     svo/bricknode.h \
     svo/searchnode.h \
+    svo/linearoctree.h \
     svo/sparsevoxeloctree.h \
     misc/texthighlighter.h \
     volume/volumerender.h \
@@ -85,12 +95,22 @@ HEADERS += \
 SOURCES += \
     main.cpp \
     file/fileformat.cpp \
+    file/byteoffset.cpp \
+    file/frameprefetcher.cpp \
+    file/framecache.cpp \
+    file/framestack.cpp \
+    file/directorywatcher.cpp \
+    file/projectioncontext.cpp \
+    file/pixeltablecache.cpp \
+    file/cpuprojection.cpp \
+    file/reconstructionscheduler.cpp \
     file/filetreeview.cpp \
     image/imagepreview.cpp \
     opencl/contextcl.cpp \
     misc/transferfunction.cpp \
     svo/bricknode.cpp \
     svo/searchnode.cpp \
+    svo/linearoctree.cpp \
     svo/sparsevoxeloctree.cpp \
     misc/texthighlighter.cpp \
     volume/volumerender.cpp \
@@ -325,6 +325,55 @@ void OpenCLFunctions::initializeOpenCLFunctions()
     {
         qFatal(QString("Failed to resolve function:" + myLib.errorString()).toStdString().c_str());
     }
+
+    QOpenCLReleaseCommandQueue = (PROTOTYPE_QOpenCLReleaseCommandQueue) myLib.resolve("clReleaseCommandQueue");
+
+    if (!QOpenCLReleaseCommandQueue)
+    {
+        qFatal(QString("Failed to resolve function:" + myLib.errorString()).toStdString().c_str());
+    }
+
+    QOpenCLFlush = (PROTOTYPE_QOpenCLFlush) myLib.resolve("clFlush");
+
+    if (!QOpenCLFlush)
+    {
+        qFatal(QString("Failed to resolve function:" + myLib.errorString()).toStdString().c_str());
+    }
+
+    QOpenCLWaitForEvents = (PROTOTYPE_QOpenCLWaitForEvents) myLib.resolve("clWaitForEvents");
+
+    if (!QOpenCLWaitForEvents)
+    {
+        qFatal(QString("Failed to resolve function:" + myLib.errorString()).toStdString().c_str());
+    }
+
+    QOpenCLReleaseEvent = (PROTOTYPE_QOpenCLReleaseEvent) myLib.resolve("clReleaseEvent");
+
+    if (!QOpenCLReleaseEvent)
+    {
+        qFatal(QString("Failed to resolve function:" + myLib.errorString()).toStdString().c_str());
+    }
+
+    QOpenCLEnqueueMapBuffer = (PROTOTYPE_QOpenCLEnqueueMapBuffer) myLib.resolve("clEnqueueMapBuffer");
+
+    if (!QOpenCLEnqueueMapBuffer)
+    {
+        qFatal(QString("Failed to resolve function:" + myLib.errorString()).toStdString().c_str());
+    }
+
+    QOpenCLEnqueueUnmapMemObject = (PROTOTYPE_QOpenCLEnqueueUnmapMemObject) myLib.resolve("clEnqueueUnmapMemObject");
+
+    if (!QOpenCLEnqueueUnmapMemObject)
+    {
+        qFatal(QString("Failed to resolve function:" + myLib.errorString()).toStdString().c_str());
+    }
+
+    QOpenCLRetainMemObject = (PROTOTYPE_QOpenCLRetainMemObject) myLib.resolve("clRetainMemObject");
+
+    if (!QOpenCLRetainMemObject)
+    {
+        qFatal(QString("Failed to resolve function:" + myLib.errorString()).toStdString().c_str());
+    }
 }
 
 OpenCLContextQueueProgram::OpenCLContextQueueProgram() :
@@ -248,6 +248,35 @@ class OpenCLFunctions
 
         typedef cl_int (*PROTOTYPE_QOpenCLReleaseProgram) ( cl_program program);
 
+        typedef cl_int (*PROTOTYPE_QOpenCLReleaseCommandQueue) ( cl_command_queue command_queue);
+
+        typedef cl_int (*PROTOTYPE_QOpenCLFlush) ( cl_command_queue command_queue);
+
+        typedef cl_int (*PROTOTYPE_QOpenCLWaitForEvents) ( cl_uint num_events,
+                const cl_event * event_list);
+
+        typedef cl_int (*PROTOTYPE_QOpenCLReleaseEvent) ( cl_event event);
+
+        typedef void * (*PROTOTYPE_QOpenCLEnqueueMapBuffer) ( cl_command_queue command_queue,
+                cl_mem buffer,
+                cl_bool blocking_map,
+                cl_map_flags map_flags,
+                size_t offset,
+                size_t cb,
+                cl_uint num_events_in_wait_list,
+                const cl_event * event_wait_list,
+                cl_event * event,
+                cl_int * errcode_ret);
+
+        typedef cl_int (*PROTOTYPE_QOpenCLEnqueueUnmapMemObject) ( cl_command_queue command_queue,
+                cl_mem memobj,
+                void * mapped_ptr,
+                cl_uint num_events_in_wait_list,
+                const cl_event * event_wait_list,
+                cl_event * event);
+
+        typedef cl_int (*PROTOTYPE_QOpenCLRetainMemObject) ( cl_mem memobj);
+
         PROTOTYPE_QOpenCLReleaseContext QOpenCLReleaseContext;
         PROTOTYPE_QOpenCLReleaseProgram QOpenCLReleaseProgram;
         PROTOTYPE_QOpenCLGetProgramBuildInfo QOpenCLGetProgramBuildInfo;
@@ -280,6 +309,13 @@ class OpenCLFunctions
         PROTOTYPE_QOpenCLEnqueueWriteBuffer QOpenCLEnqueueWriteBuffer;
         PROTOTYPE_QOpenCLEnqueueReadBufferRect QOpenCLEnqueueReadBufferRect;
         PROTOTYPE_QOpenCLEnqueueCopyBufferRect QOpenCLEnqueueCopyBufferRect;
+        PROTOTYPE_QOpenCLReleaseCommandQueue QOpenCLReleaseCommandQueue;
+        PROTOTYPE_QOpenCLFlush QOpenCLFlush;
+        PROTOTYPE_QOpenCLWaitForEvents QOpenCLWaitForEvents;
+        PROTOTYPE_QOpenCLReleaseEvent QOpenCLReleaseEvent;
+        PROTOTYPE_QOpenCLEnqueueMapBuffer QOpenCLEnqueueMapBuffer;
+        PROTOTYPE_QOpenCLEnqueueUnmapMemObject QOpenCLEnqueueUnmapMemObject;
+        PROTOTYPE_QOpenCLRetainMemObject QOpenCLRetainMemObject;
 };
 
 class OpenCLContextQueueProgram : protected OpenCLFunctions
@@ -7,12 +7,16 @@
 #include <QDebug>
 #include <QMap>
 #include <QTimer>
+#include <QFutureWatcher>
+#include <QElapsedTimer>
+#include <QAtomicInt>
 
 #include "file/filetreeview.h"
 #include "image/imagepreview.h"
 #include "sql/customsqlquerymodel.h"
 #include "worker/worker.h"
 #include "sql/sqlqol.h"
+#include "file/directorywatcher.h"
 
 namespace Ui {
 class ReconstructionWidget;
@@ -35,6 +39,8 @@ signals:
     void saveImage(QString);
     void takeImageScreenshot(QString);
     void fileChanged(QString);
+    void prefetchPathsChanged(QStringList);
+    void liveFilesAdded(QStringList);
 
     void populateInterpolationTreeProxySignal();
 
@@ -47,6 +53,10 @@ public slots:
     void displayPopup(QString title, QString text);
     void saveProject();
     void loadProject();
+    void packFrames();
+    void watchDirectory(bool value);
+    void setCpuProjection(bool value);
+    void addLiveFiles(QStringList paths);
     void sortItems(int column, Qt::SortOrder order);
     void refreshSelectionModel();
     void itemSelected(const QModelIndex & current, const QModelIndex & previous);
@@ -62,6 +72,9 @@ public slots:
 private slots:
     void populateInterpolationTree_start();
     void populateInterpolationTree_finished();
+    void packFrames_finished();
+    void pollPackProgress();
+    void cancelPackFrames();
 
     void on_sanityButton_clicked();
     void on_deactivateFileButton_clicked();
@@ -79,6 +92,7 @@ private:
     void loadSettings();
     void writeSettings();
     void initSql();
+    void upsertFiles(QList<DetectorFile> & files);
 
     FileSelectionModel * fileTreeModel;
 
@@ -94,6 +108,19 @@ private:
     QString p_working_dir;
     QString p_screenshot_dir;
     int p_current_row;
+    int p_prefetch_depth;
+
+    DirectoryWatcher * p_directory_watcher;
+    QString p_watch_dir;
+
+    // Packing of frame stacks, which runs in the background
+    QFutureWatcher<int> * p_pack_watcher;
+    QTimer * p_pack_poll_timer;
+    QAtomicInt p_pack_n_done;
+    QAtomicInt p_pack_is_canceled;
+    QElapsedTimer p_pack_timer;
+    QString p_pack_path;
+    int p_pack_n_frames;
 
 //    QList<DetectorFile> p_future_list;
 //    QFutureWatcher<void> * p_future_watcher;
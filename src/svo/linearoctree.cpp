@@ -0,0 +1,547 @@
+#include "linearoctree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <QtConcurrent>
+#include <QMutexLocker>
+
+// Bits per axis in a Morton code, which is also the depth of the tree
+static const unsigned int MORTON_LEVELS = 21;
+
+// Points outside the extent get this code, which sorts after all the others
+static const quint64 INVALID_CODE = std::numeric_limits<quint64>::max();
+
+// The radix sort takes 8 bits per pass. Passes where all codes share the digit are skipped.
+static const int RADIX_BITS = 8;
+static const int RADIX_BUCKETS = 1 << RADIX_BITS;
+static const int RADIX_PASSES = 64 / RADIX_BITS;
+
+// Fewer points than this per thread are not worth a thread
+static const int MIN_POINTS_PER_BLOCK = 1 << 16;
+
+struct SortBlock
+{
+    int begin;
+    int end;
+
+    // The number of codes with each digit, and then where the block writes the next one
+    int offset[RADIX_BUCKETS];
+};
+
+static QVector<SortBlock> sortBlocks(int n)
+{
+    int n_blocks = qBound(1, n / MIN_POINTS_PER_BLOCK, QThread::idealThreadCount());
+
+    QVector<SortBlock> blocks(n_blocks);
+
+    for (int i = 0; i < n_blocks; i++)
+    {
+        blocks[i].begin = (int) ((qint64) n * i / n_blocks);
+        blocks[i].end = (int) ((qint64) n * (i + 1) / n_blocks);
+    }
+
+    return blocks;
+}
+
+static quint64 spreadBits(quint64 value)
+{
+    // Move bit i of a 21 bit value to bit 3i
+    value &= 0x1fffff;
+    value = (value | value << 32) & 0x1f00000000ffff;
+    value = (value | value << 16) & 0x1f0000ff0000ff;
+    value = (value | value << 8) & 0x100f00f00f00f00f;
+    value = (value | value << 4) & 0x10c30c30c30c30c3;
+    value = (value | value << 2) & 0x1249249249249249;
+
+    return value;
+}
+
+static bool isIntersected(const double * a, const double * b)
+{
+    // Box box intersection, as in SearchNode
+    for (int i = 0; i < 3; i++)
+    {
+        if (std::max(a[i * 2], b[i * 2]) >= std::min(a[i * 2 + 1], b[i * 2 + 1]))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+struct CodeBlock
+{
+    CodeBlock(const LinearOctree * tree, const xyzw32 * points, quint64 * codes) : tree(tree), points(points), codes(codes) {}
+
+    void operator()(SortBlock & block)
+    {
+        for (int i = block.begin; i < block.end; i++)
+        {
+            if (!tree->mortonCode(points[i], &codes[i]))
+            {
+                codes[i] = INVALID_CODE;
+            }
+        }
+    }
+
+    const LinearOctree * tree;
+    const xyzw32 * points;
+    quint64 * codes;
+};
+
+struct CountDigits
+{
+    CountDigits(const quint64 * codes, int shift) : codes(codes), shift(shift) {}
+
+    void operator()(SortBlock & block)
+    {
+        std::fill(block.offset, block.offset + RADIX_BUCKETS, 0);
+
+        for (int i = block.begin; i < block.end; i++)
+        {
+            block.offset[(codes[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+        }
+    }
+
+    const quint64 * codes;
+    int shift;
+};
+
+struct ScatterDigits
+{
+    ScatterDigits(const quint64 * codes, const xyzw32 * points, quint64 * sorted_codes, xyzw32 * sorted_points, int shift) :
+        codes(codes), points(points), sorted_codes(sorted_codes), sorted_points(sorted_points), shift(shift) {}
+
+    void operator()(SortBlock & block)
+    {
+        // In order within the block, which keeps the sort stable
+        for (int i = block.begin; i < block.end; i++)
+        {
+            int & position = block.offset[(codes[i] >> shift) & (RADIX_BUCKETS - 1)];
+
+            sorted_codes[position] = codes[i];
+            sorted_points[position] = points[i];
+            position++;
+        }
+    }
+
+    const quint64 * codes;
+    const xyzw32 * points;
+    quint64 * sorted_codes;
+    xyzw32 * sorted_points;
+    int shift;
+};
+
+static void radixSort(QVector<quint64> & codes, QVector<xyzw32> & points)
+{
+    // Least significant digit first. Each pass counts the digits of a block of codes per thread, works out where each
+    // block puts its codes of each digit, and then lets the threads scatter their blocks.
+    int n = codes.size();
+
+    QVector<quint64> sorted_codes(n);
+    QVector<xyzw32> sorted_points(n);
+    QVector<SortBlock> blocks = sortBlocks(n);
+
+    for (int pass = 0; pass < RADIX_PASSES; pass++)
+    {
+        int shift = pass * RADIX_BITS;
+
+        QtConcurrent::blockingMap(blocks, CountDigits(codes.constData(), shift));
+
+        bool is_uniform = false;
+        int offset = 0;
+
+        for (int digit = 0; digit < RADIX_BUCKETS; digit++)
+        {
+            int start = offset;
+
+            for (int i = 0; i < blocks.size(); i++)
+            {
+                int count = blocks[i].offset[digit];
+                blocks[i].offset[digit] = offset;
+                offset += count;
+            }
+
+            if (offset - start == n)
+            {
+                is_uniform = true;
+            }
+        }
+
+        if (is_uniform)
+        {
+            continue;
+        }
+
+        QtConcurrent::blockingMap(blocks, ScatterDigits(codes.constData(), points.constData(), sorted_codes.data(), sorted_points.data(), shift));
+
+        codes.swap(sorted_codes);
+        points.swap(sorted_points);
+    }
+}
+
+LinearOctree::LinearOctree()
+{
+    p_max_points = 64;
+    p_extent.reserve(1, 6);
+}
+
+LinearOctree::~LinearOctree()
+{
+    clear();
+}
+
+void LinearOctree::clear()
+{
+    QMutexLocker locker(&p_mutex);
+
+    qDeleteAll(p_buffers);
+    p_buffers.clear();
+
+    p_codes.clear();
+    p_points.clear();
+}
+
+void LinearOctree::setExtent(Matrix<double> extent)
+{
+    p_extent = extent;
+}
+
+Matrix<double> LinearOctree::extent() const
+{
+    return p_extent;
+}
+
+void LinearOctree::setMaxPoints(int value)
+{
+    p_max_points = value;
+}
+
+QVector<xyzw32> * LinearOctree::localBuffer()
+{
+    QMutexLocker locker(&p_mutex);
+
+    QVector<xyzw32> *& buffer = p_buffers[QThread::currentThread()];
+
+    if (!buffer)
+    {
+        buffer = new QVector<xyzw32>;
+    }
+
+    return buffer;
+}
+
+void LinearOctree::append(const QVector<xyzw32> & points)
+{
+    // Only the lookup of the buffer is locked, and it is done once per call
+    *localBuffer() += points;
+}
+
+int LinearOctree::size() const
+{
+    return p_points.size();
+}
+
+int LinearOctree::pending()
+{
+    QMutexLocker locker(&p_mutex);
+
+    int n = 0;
+
+    foreach (QVector<xyzw32> * buffer, p_buffers)
+    {
+        n += buffer->size();
+    }
+
+    return n;
+}
+
+bool LinearOctree::mortonCode(const xyzw32 & point, quint64 * code) const
+{
+    const float coordinates[3] = {point.x, point.y, point.z};
+
+    *code = 0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        double t = (coordinates[i] - p_extent[i * 2]) / (p_extent[i * 2 + 1] - p_extent[i * 2]);
+
+        if ((t < 0.0) || (t >= 1.0))
+        {
+            return false;
+        }
+
+        quint64 cell = std::min((quint64) (t * (1 << MORTON_LEVELS)), (quint64) (1 << MORTON_LEVELS) - 1);
+
+        *code |= spreadBits(cell) << i;
+    }
+
+    return true;
+}
+
+void LinearOctree::build()
+{
+    QVector<xyzw32> points;
+
+    {
+        QMutexLocker locker(&p_mutex);
+
+        int n = 0;
+
+        foreach (QVector<xyzw32> * buffer, p_buffers)
+        {
+            n += buffer->size();
+        }
+
+        points.reserve(n);
+
+        foreach (QVector<xyzw32> * buffer, p_buffers)
+        {
+            points += *buffer;
+        }
+
+        qDeleteAll(p_buffers);
+        p_buffers.clear();
+    }
+
+    if (points.isEmpty())
+    {
+        return;
+    }
+
+    QVector<quint64> codes(points.size());
+
+    QVector<SortBlock> blocks = sortBlocks(points.size());
+    QtConcurrent::blockingMap(blocks, CodeBlock(this, points.constData(), codes.data()));
+
+    radixSort(codes, points);
+
+    // Points outside the extent have been sorted to the end
+    int n_valid = std::lower_bound(codes.constBegin(), codes.constEnd(), INVALID_CODE) - codes.constBegin();
+
+    codes.resize(n_valid);
+    points.resize(n_valid);
+
+    if (p_codes.isEmpty())
+    {
+        p_codes.swap(codes);
+        p_points.swap(points);
+        return;
+    }
+
+    // Merge with the points of earlier builds
+    QVector<quint64> merged_codes(p_codes.size() + codes.size());
+    QVector<xyzw32> merged_points(merged_codes.size());
+
+    int i = 0, j = 0, k = 0;
+
+    while ((i < p_codes.size()) && (j < codes.size()))
+    {
+        if (codes[j] < p_codes[i])
+        {
+            merged_codes[k] = codes[j];
+            merged_points[k++] = points[j++];
+        }
+        else
+        {
+            merged_codes[k] = p_codes[i];
+            merged_points[k++] = p_points[i++];
+        }
+    }
+
+    for (; i < p_codes.size(); i++, k++)
+    {
+        merged_codes[k] = p_codes[i];
+        merged_points[k] = p_points[i];
+    }
+
+    for (; j < codes.size(); j++, k++)
+    {
+        merged_codes[k] = codes[j];
+        merged_points[k] = points[j];
+    }
+
+    p_codes.swap(merged_codes);
+    p_points.swap(merged_points);
+}
+
+void LinearOctree::childExtent(const double * extent, unsigned int octant, double * child) const
+{
+    for (int i = 0; i < 3; i++)
+    {
+        double center = 0.5 * (extent[i * 2] + extent[i * 2 + 1]);
+
+        if ((octant >> i) & 1)
+        {
+            child[i * 2] = center;
+            child[i * 2 + 1] = extent[i * 2 + 1];
+        }
+        else
+        {
+            child[i * 2] = extent[i * 2];
+            child[i * 2 + 1] = center;
+        }
+    }
+}
+
+int LinearOctree::lowerBound(quint64 code, int begin, int end) const
+{
+    return std::lower_bound(p_codes.constData() + begin, p_codes.constData() + end, code) - p_codes.constData();
+}
+
+bool LinearOctree::intersectedItems(const double * effective_extent, const double * node_extent, unsigned int level, quint64 first_code, int begin, int end, size_t * accumulated_points, size_t max_points, QList<xyzw32> * point_data)
+{
+    if (begin >= end)
+    {
+        return false;
+    }
+
+    if ((end - begin <= p_max_points) || (level >= MORTON_LEVELS))
+    {
+        for (int i = begin; i < end; i++)
+        {
+            const xyzw32 & point = p_points[i];
+
+            if (
+                ((point.x >= effective_extent[0]) && (point.x <= effective_extent[1])) &&
+                ((point.y >= effective_extent[2]) && (point.y <= effective_extent[3])) &&
+                ((point.z >= effective_extent[4]) && (point.z <= effective_extent[5])))
+            {
+                *point_data << point;
+                (*accumulated_points)++;
+
+                if (max_points <= *accumulated_points)
+                {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    // The codes of a child share the octant at this level and span the bits below it
+    unsigned int shift = 3 * (MORTON_LEVELS - level - 1);
+
+    for (unsigned int i = 0; i < 8; i++)
+    {
+        double child_extent[6];
+        childExtent(node_extent, i, child_extent);
+
+        if (!isIntersected(child_extent, effective_extent))
+        {
+            continue;
+        }
+
+        quint64 child_code = first_code + ((quint64) i << shift);
+        int child_begin = lowerBound(child_code, begin, end);
+        int child_end = lowerBound(child_code + ((quint64) 1 << shift), child_begin, end);
+
+        if (intersectedItems(effective_extent, child_extent, level + 1, child_code, child_begin, child_end, accumulated_points, max_points, point_data))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool LinearOctree::getData(
+    size_t max_points,
+    double * brick_extent,
+    QList<xyzw32> * point_data,
+    size_t * accumulated_points,
+    float search_radius)
+{
+    // First check if max bytes is reached
+    if (max_points <= *accumulated_points)
+    {
+        return true;
+    }
+
+    double effective_extent[6];
+    effective_extent[0] = brick_extent[0] - search_radius;
+    effective_extent[1] = brick_extent[1] + search_radius;
+    effective_extent[2] = brick_extent[2] - search_radius;
+    effective_extent[3] = brick_extent[3] + search_radius;
+    effective_extent[4] = brick_extent[4] - search_radius;
+    effective_extent[5] = brick_extent[5] + search_radius;
+
+    return intersectedItems(effective_extent, p_extent.data(), 0, 0, 0, p_codes.size(), accumulated_points, max_points, point_data);
+}
+
+void LinearOctree::weighSamples(xyzw32 & sample, const double * sample_extent, const double * node_extent, unsigned int level, quint64 first_code, int begin, int end, float * sum_w, float * sum_wu, float search_radius)
+{
+    if (begin >= end)
+    {
+        return;
+    }
+
+    if ((end - begin <= p_max_points) || (level >= MORTON_LEVELS))
+    {
+        for (int i = begin; i < end; i++)
+        {
+            const xyzw32 & point = p_points[i];
+
+            float d = std::sqrt((point.x - sample.x) * (point.x - sample.x) + (point.y - sample.y) * (point.y - sample.y) + (point.z - sample.z) * (point.z - sample.z));
+
+            if (d <= search_radius)
+            {
+                float w = 1.0 / d;
+                *sum_w += w;
+                *sum_wu += w * point.w;
+            }
+        }
+
+        return;
+    }
+
+    unsigned int shift = 3 * (MORTON_LEVELS - level - 1);
+
+    for (unsigned int i = 0; i < 8; i++)
+    {
+        double child_extent[6];
+        childExtent(node_extent, i, child_extent);
+
+        if (!isIntersected(child_extent, sample_extent))
+        {
+            continue;
+        }
+
+        quint64 child_code = first_code + ((quint64) i << shift);
+        int child_begin = lowerBound(child_code, begin, end);
+        int child_end = lowerBound(child_code + ((quint64) 1 << shift), child_begin, end);
+
+        weighSamples(sample, sample_extent, child_extent, level + 1, child_code, child_begin, child_end, sum_w, sum_wu, search_radius);
+    }
+}
+
+float LinearOctree::getIDW(xyzw32 & sample, float p, float search_radius)
+{
+    Q_UNUSED(p);
+
+    float sum_w = 0;
+    float sum_wu = 0;
+
+    double sample_extent[6];
+    sample_extent[0] = sample.x - search_radius;
+    sample_extent[1] = sample.x + search_radius;
+    sample_extent[2] = sample.y - search_radius;
+    sample_extent[3] = sample.y + search_radius;
+    sample_extent[4] = sample.z - search_radius;
+    sample_extent[5] = sample.z + search_radius;
+
+    weighSamples(sample, sample_extent, p_extent.data(), 0, 0, 0, p_codes.size(), &sum_w, &sum_wu, search_radius);
+
+    if (sum_w > 0.0)
+    {
+        return sum_wu / sum_w;
+    }
+    else
+    {
+        return 0;
+    }
+}
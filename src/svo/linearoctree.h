@@ -0,0 +1,75 @@
+#ifndef LINEAROCTREE_H
+#define LINEAROCTREE_H
+
+#include <QList>
+#include <QVector>
+#include <QHash>
+#include <QMutex>
+#include <QThread>
+
+#include "../math/matrix.h"
+#include "../misc/smallstuff.h"
+
+class LinearOctree
+{
+        /* An alternative to the SearchNode tree for the interpolation data. Instead of inserting points one by one into a
+         * shared tree, each thread appends them to a buffer of its own. build() then gives every point a 63 bit Morton code,
+         * 21 bits per axis over the extent, and sorts the points by their codes with a parallel radix sort. The result is an
+         * octree that is never stored: the points of any node lie in one contiguous range of the sorted array, and the
+         * range is found with two binary searches on the codes. The octants are numbered as in SearchNode.
+         *
+         * Points can be appended from many threads at once. Queries only see points that have gone through build(), and
+         * neither build() nor the queries may run while points are being appended. */
+
+    public:
+        LinearOctree();
+        ~LinearOctree();
+
+        void clear();
+        void setExtent(Matrix<double> extent);
+        Matrix<double> extent() const;
+
+        // Queries scan a node once it holds at most this many points
+        void setMaxPoints(int value);
+
+        void append(const QVector<xyzw32> & points);
+        void build();
+
+        // Points in the sorted array, and points appended since the last build
+        int size() const;
+        int pending();
+
+        bool getData(size_t max_points,
+                     double * brick_extent,
+                     QList<xyzw32> * point_data,
+                     size_t * accumulated_points,
+                     float search_radius);
+
+        float getIDW(xyzw32 &sample, float p, float search_radius);
+
+        // The Morton code of a point, or false if it lies outside the extent
+        bool mortonCode(const xyzw32 & point, quint64 * code) const;
+
+    private:
+        Q_DISABLE_COPY(LinearOctree)
+
+        QVector<xyzw32> * localBuffer();
+        void childExtent(const double * extent, unsigned int octant, double * child) const;
+        int lowerBound(quint64 code, int begin, int end) const;
+
+        bool intersectedItems(const double * effective_extent, const double * node_extent, unsigned int level, quint64 first_code, int begin, int end, size_t * accumulated_points, size_t max_points, QList<xyzw32> * point_data);
+        void weighSamples(xyzw32 & sample, const double * sample_extent, const double * node_extent, unsigned int level, quint64 first_code, int begin, int end, float * sum_w, float * sum_wu, float search_radius);
+
+        Matrix<double> p_extent;
+        int p_max_points;
+
+        // Buffers of the appending threads
+        QMutex p_mutex;
+        QHash<QThread *, QVector<xyzw32> *> p_buffers;
+
+        // The sorted codes and points
+        QVector<quint64> p_codes;
+        QVector<xyzw32> p_points;
+};
+
+#endif // LINEAROCTREE_H
@@ -3,27 +3,319 @@
 #include <iostream>
 #include <iomanip>
 #include <cmath>
+#include <limits>
+#include <new>
 
 #include <QString>
 #include <QDebug>
 #include <QElapsedTimer>
+#include <QThread>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QTemporaryFile>
+#include <QDir>
+#include <QVector>
 
 static const unsigned int MAX_LEVELS = 16;
 
+// Points are stored in linked chunks of this size, so that a leaf only takes the memory it needs. In compact mode a
+// chunk of the same size holds more points, with 16 bit coordinates relative to the extent of the leaf.
+static const int POINTS_PER_CHUNK = 64;
+static const int COMPACT_POINTS_PER_CHUNK = 102;
+
+// Nodes and chunks are taken from slabs of this size
+static const size_t SLAB_BYTES = 4 << 20;
+static const size_t ARENA_ALIGNMENT = 16;
+
+struct SearchNodeChunk
+{
+    union
+    {
+        xyzw32 points[POINTS_PER_CHUNK];
+
+        // 10 bytes per point instead of 16
+        struct
+        {
+            quint16 x[COMPACT_POINTS_PER_CHUNK];
+            quint16 y[COMPACT_POINTS_PER_CHUNK];
+            quint16 z[COMPACT_POINTS_PER_CHUNK];
+            float w[COMPACT_POINTS_PER_CHUNK];
+        } compact;
+    };
+
+    QAtomicPointer<SearchNodeChunk> next;
+};
+
+// Points of a leaf that have been moved to the scratch file
+struct SearchNodeSpill
+{
+    qint64 offset;
+    int n_points;
+    SearchNodeSpill * next;
+};
+
+static quint16 quantize(float value, double low, double high)
+{
+    return (quint16) qBound(0.0, (value - low) / (high - low) * 65535.0 + 0.5, 65535.0);
+}
+
+static float dequantize(quint16 value, double low, double high)
+{
+    return low + value * (high - low) / 65535.0;
+}
+
+class SearchNodeArena
+{
+    /* Memory for the nodes and chunks of one tree. Allocation bumps an atomic offset into the current slab, and only
+     * the thread that finds the slab full takes a lock to add the next one. Nothing is freed on its own: the chunks of a
+     * split leaf go onto a free list and are handed out again, and everything else is released with the slabs. */
+
+    public:
+        SearchNodeArena();
+        ~SearchNodeArena();
+
+        void * allocate(size_t bytes);
+        SearchNodeChunk * allocateChunk();
+
+        // Put a list of chunks, linked by next, back for reuse
+        void recycle(SearchNodeChunk * first);
+
+        // Release all slabs and the scratch file. No node or chunk of the tree may be used afterwards.
+        void reset();
+
+        // Leaves spill their points to the scratch file rather than grow the tree once the slabs exceed the budget.
+        // A budget of 0 means no limit.
+        void setBudget(size_t bytes);
+        bool hasBudget() const;
+        bool isOverBudget() const;
+
+        // Append points to the scratch file and return where they start
+        qint64 spill(const xyzw32 * points, int n);
+
+        // Points written by spill(), read through a mapping of the scratch file
+        const xyzw32 * spilled(qint64 offset, int n);
+
+    private:
+        struct Slab
+        {
+            Slab * previous;
+            QAtomicInt used;
+            char * data;
+        };
+
+        QAtomicPointer<Slab> p_slab;
+        QAtomicInt p_n_slabs;
+        QMutex p_slab_mutex;
+        size_t p_budget;
+
+        // Created on the first spill. Each mapping covers the file as it was when it was made, and is kept until reset.
+        QMutex p_scratch_mutex;
+        QTemporaryFile * p_scratch;
+        qint64 p_scratch_size;
+        const uchar * p_scratch_map;
+        qint64 p_scratch_map_size;
+
+        // Chunks are pushed by any thread without locking. Only one thread at a time pops, which rules out the ABA problem.
+        QAtomicPointer<SearchNodeChunk> p_free_chunks;
+        QMutex p_pop_mutex;
+};
+
+SearchNodeArena::SearchNodeArena()
+{
+    p_budget = 0;
+    p_scratch = NULL;
+    p_scratch_size = 0;
+    p_scratch_map = NULL;
+    p_scratch_map_size = 0;
+}
+
+SearchNodeArena::~SearchNodeArena()
+{
+    reset();
+}
+
+void * SearchNodeArena::allocate(size_t bytes)
+{
+    bytes = (bytes + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    while (true)
+    {
+        Slab * slab = p_slab.loadAcquire();
+
+        if (slab)
+        {
+            size_t offset = slab->used.fetchAndAddOrdered((int) bytes);
+
+            if (offset + bytes <= SLAB_BYTES)
+            {
+                return slab->data + offset;
+            }
+        }
+
+        // The slab is full. Whoever gets the lock first adds a new one, the others find it in place.
+        QMutexLocker locker(&p_slab_mutex);
+
+        if (p_slab.loadAcquire() == slab)
+        {
+            Slab * fresh = new Slab;
+            fresh->previous = slab;
+            fresh->used = 0;
+            fresh->data = static_cast<char *>(::operator new(SLAB_BYTES));
+
+            p_n_slabs.fetchAndAddRelaxed(1);
+            p_slab.storeRelease(fresh);
+        }
+    }
+}
+
+SearchNodeChunk * SearchNodeArena::allocateChunk()
+{
+    // Reuse a chunk if no other thread is doing so at the moment
+    if (p_free_chunks.loadAcquire() && p_pop_mutex.tryLock())
+    {
+        SearchNodeChunk * chunk = p_free_chunks.loadAcquire();
+
+        while (chunk && !p_free_chunks.testAndSetOrdered(chunk, chunk->next.loadAcquire()))
+        {
+            chunk = p_free_chunks.loadAcquire();
+        }
+
+        p_pop_mutex.unlock();
+
+        if (chunk)
+        {
+            chunk->next.store(NULL);
+            return chunk;
+        }
+    }
+
+    return new (allocate(sizeof(SearchNodeChunk))) SearchNodeChunk;
+}
+
+void SearchNodeArena::recycle(SearchNodeChunk * first)
+{
+    if (!first) return;
+
+    SearchNodeChunk * last = first;
+
+    while (last->next.load())
+    {
+        last = last->next.load();
+    }
+
+    SearchNodeChunk * head;
+
+    do
+    {
+        head = p_free_chunks.loadAcquire();
+        last->next.store(head);
+    }
+    while (!p_free_chunks.testAndSetOrdered(head, first));
+}
+
+void SearchNodeArena::reset()
+{
+    Slab * slab = p_slab.fetchAndStoreOrdered(NULL);
+
+    while (slab)
+    {
+        Slab * previous = slab->previous;
+        ::operator delete(slab->data);
+        delete slab;
+        slab = previous;
+    }
+
+    p_n_slabs = 0;
+    p_free_chunks.store(NULL);
+
+    // Closing the file removes it and its mappings
+    QMutexLocker locker(&p_scratch_mutex);
+
+    delete p_scratch;
+    p_scratch = NULL;
+    p_scratch_size = 0;
+    p_scratch_map = NULL;
+    p_scratch_map_size = 0;
+}
+
+void SearchNodeArena::setBudget(size_t bytes)
+{
+    p_budget = bytes;
+}
+
+bool SearchNodeArena::hasBudget() const
+{
+    return p_budget > 0;
+}
+
+bool SearchNodeArena::isOverBudget() const
+{
+    return (p_budget > 0) && ((size_t) p_n_slabs.load() * SLAB_BYTES >= p_budget);
+}
+
+qint64 SearchNodeArena::spill(const xyzw32 * points, int n)
+{
+    QMutexLocker locker(&p_scratch_mutex);
+
+    if (!p_scratch)
+    {
+        p_scratch = new QTemporaryFile(QDir::tempPath() + "/nebula_tree_XXXXXX");
+
+        if (!p_scratch->open())
+        {
+            qFatal("Could not open a scratch file for the interpolation tree");
+        }
+    }
+
+    qint64 offset = p_scratch_size;
+    qint64 bytes = (qint64) n * sizeof(xyzw32);
+
+    if (p_scratch->write(reinterpret_cast<const char *>(points), bytes) != bytes)
+    {
+        qFatal("Could not write to the scratch file of the interpolation tree");
+    }
+
+    p_scratch_size += bytes;
+
+    return offset;
+}
+
+const xyzw32 * SearchNodeArena::spilled(qint64 offset, int n)
+{
+    QMutexLocker locker(&p_scratch_mutex);
+
+    // Map the file again if it has grown past the current mapping. Older mappings stay valid for whoever reads them.
+    if (offset + (qint64) n * (qint64) sizeof(xyzw32) > p_scratch_map_size)
+    {
+        p_scratch->flush();
+
+        p_scratch_map = p_scratch->map(0, p_scratch_size);
+
+        if (!p_scratch_map)
+        {
+            qFatal("Could not map the scratch file of the interpolation tree");
+        }
+
+        p_scratch_map_size = p_scratch_size;
+    }
+
+    return reinterpret_cast<const xyzw32 *>(p_scratch_map + offset);
+}
+
 SearchNode::SearchNode()
 {
-    p_is_msd = true;
-    p_is_empty = true;
-    p_extent.reserve(1, 6);
-    p_mutex = new QMutex;
+    p_parent = NULL;
+    p_arena = new SearchNodeArena;
+    p_tree_level = 0;
+    p_is_compact = false;
+    p_spills = NULL;
 }
 
 SearchNode::SearchNode(SearchNode * parent, double * extent)
 {
-    p_is_msd = true;
-    p_is_empty = true;
+    p_is_compact = false;
+    p_spills = NULL;
     p_parent = parent;
-    p_extent.reserve(1, 6);
 
     for (int i = 0; i < 6; i++)
     {
@@ -32,28 +324,48 @@ SearchNode::SearchNode(SearchNode * parent, double * extent)
 
     if (p_parent == NULL)
     {
+        p_arena = new SearchNodeArena;
         p_tree_level = 0;
     }
     else
     {
+        p_arena = parent->p_arena;
         p_tree_level = parent->level() + 1;
     }
-
-    p_mutex = new QMutex;
 }
 
 SearchNode::~SearchNode()
 {
-    clear();
+    // Only the root is ever destroyed. The other nodes live in its arena.
+    if (p_parent == NULL)
+    {
+        clear();
+        delete p_arena;
+    }
 }
 
 void SearchNode::clear()
 {
 //    p_linked_points.clear();
-    p_children.clear();
-    p_data_points.clear();
-    p_is_msd = true;
-    p_is_empty = true;
+    // The memory of the subtree is returned when the root is cleared, all of it at once
+    p_children.store(NULL);
+    p_chunks.store(NULL);
+    p_spills = NULL;
+
+    p_n_points = 0;
+    p_n_reserved = 0;
+
+    if (p_parent == NULL)
+    {
+        p_arena->reset();
+    }
+}
+
+void SearchNode::clearPoints()
+{
+    p_arena->recycle(p_chunks.fetchAndStoreOrdered(NULL));
+
+    p_n_points = 0;
 }
 
 void SearchNode::setBinsPerSide(int value)
@@ -66,6 +378,21 @@ void SearchNode::setMaxPoints(int value)
     p_max_points = value;
 }
 
+void SearchNode::setMemoryBudget(size_t bytes)
+{
+    p_arena->setBudget(bytes);
+}
+
+void SearchNode::setCompact(bool value)
+{
+    p_is_compact = value;
+}
+
+bool SearchNode::isCompact() const
+{
+    return p_is_compact;
+}
+
 void SearchNode::setMinDataInterdistance(double value)
 {
     p_min_data_interdistance = value;
@@ -73,7 +400,10 @@ void SearchNode::setMinDataInterdistance(double value)
 
 void SearchNode::setExtent(Matrix<double> extent)
 {
-    p_extent = extent;
+    for (int i = 0; i < 6; i++)
+    {
+        p_extent[i] = extent[i];
+    }
 }
 
 void SearchNode::setParent(SearchNode * parent)
@@ -107,88 +437,204 @@ void SearchNode::print()
 //    std::cout << "L" << p_tree_level << "-> n bins: " << p_linked_points.size() << " c: " << 8 << " empt: " << p_is_empty << " msd: = " << p_is_msd << " Ext = [ " << std::setprecision(2) << std::fixed << p_extent[0] << " " << p_extent[1] << " " << p_extent[2] << " " << p_extent[3] << " " << p_extent[4] << " " << p_extent[5] << " ]" << std::endl;
 
     /* Print children */
+    SearchNode * children = p_children.loadAcquire();
+
+    if (!children) return;
+
     for (int i = 0; i < 8; i++)
     {
-        p_children[i].print();
+        children[i].print();
     }
 }
 
 void SearchNode::insert(xyzw32 & point)
 {
-    // If the current node is not msd (max subdivision), then it's private variables will not be changed, and thus it does not need a mutex lock
-    if (p_is_msd)
+    SearchNode * node = this;
+
+    while (true)
     {
-        QMutexLocker lock(p_mutex);
-        p_insert(point);
+        SearchNode * children = node->p_children.loadAcquire();
+
+        // If this is not the maximum subdivision, then proceed to the next octree level
+        if (children)
+        {
+            bool isOutofBounds = false;
+            unsigned int id = node->octant(point, &isOutofBounds);
+
+            if (isOutofBounds)
+            {
+                return;
+            }
+
+            node = children + id;
+        }
+        // Else store the point, unless the node has been split in the meantime
+        else if (node->append(point))
+        {
+            return;
+        }
     }
-    else
+}
+
+int SearchNode::capacity()
+{
+    // A leaf at the deepest level can not be split and takes any number of points, unless it can spill them
+    if ((p_tree_level < MAX_LEVELS - 1) || p_arena->hasBudget())
     {
-        p_insert(point);
+        return p_max_points;
     }
+
+    return std::numeric_limits<int>::max();
 }
 
-void SearchNode::p_insert(xyzw32 & point)
+bool SearchNode::append(xyzw32 & point)
 {
-    // If this is not the maximum subdivision, then proceed to the next octree level
-    if (!p_is_msd)
+    int index = p_n_reserved.fetchAndAddOrdered(1);
+
+    if (index < capacity())
     {
-        bool isOutofBounds = false;
-        unsigned int id = octant(point, &isOutofBounds);
+        storePoint(chunk(index), index % pointsPerChunk(), point);
+        p_n_points.fetchAndAddRelease(1);
+
+        return true;
+    }
 
-        if (!isOutofBounds)
+    // The first thread to overflow the leaf splits it, or spills its points if memory is short. The others wait for
+    // the children, or for the leaf to be emptied, and try again.
+    if (index == capacity())
+    {
+        if ((p_tree_level < MAX_LEVELS - 1) && !p_spills && !p_arena->isOverBudget())
+        {
+            split();
+        }
+        else
         {
-            p_children[id].insert(point);
+            spill();
         }
     }
-    // Else if this is the first data point to be inserted
-    else if (p_data_points.isEmpty() && p_is_msd)
+    else
     {
+        while (!p_children.loadAcquire() && (p_n_reserved.loadAcquire() > capacity()))
+        {
+            QThread::yieldCurrentThread();
+        }
+    }
 
-//        subnode node;
-//        node.data_points << point;
-//        node.index =
-//        p_linked_points << point;
+    return false;
+}
+
+SearchNodeChunk * SearchNode::chunk(int index)
+{
+    // Walk the chunks, linking in new ones as needed. A thread that loses the race for a link recycles its own chunk.
+    QAtomicPointer<SearchNodeChunk> * link = &p_chunks;
+    SearchNodeChunk * current = NULL;
 
-        p_data_points.reserve(p_max_points);
-        p_data_points << point;
-        p_is_empty = false;
+    for (int i = 0; i <= index / pointsPerChunk(); i++)
+    {
+        current = link->loadAcquire();
+
+        if (!current)
+        {
+            SearchNodeChunk * fresh = p_arena->allocateChunk();
+
+            if (link->testAndSetOrdered(NULL, fresh))
+            {
+                current = fresh;
+            }
+            else
+            {
+                p_arena->recycle(fresh);
+                current = link->loadAcquire();
+            }
+        }
+
+        link = &current->next;
     }
-    // Else if there will be too many points and a split is required, and the split wont result in too deep an octree level
-    else if ((p_data_points.size() >= p_max_points - 1) && (p_tree_level < MAX_LEVELS - 1))
+
+    return current;
+}
+
+int SearchNode::pointsPerChunk() const
+{
+    return p_is_compact ? COMPACT_POINTS_PER_CHUNK : POINTS_PER_CHUNK;
+}
+
+void SearchNode::storePoint(SearchNodeChunk * chunk, int index, const xyzw32 & point)
+{
+    if (!p_is_compact)
     {
-        p_data_points << point;
-        split();
-        p_data_points.clear();
-        p_is_msd = false;
+        chunk->points[index] = point;
+        return;
     }
-    // Else if there will be too many points
-//    else if ((p_data_points.size() > MAX_POINTS - 1))
-//    {
-//        p_data_points << point;
-//    }
-    // Else, just insert the point
-    else
+
+    // Rounded to the nearest step, which is 1/65535 of the leaf side. Points are clamped to the leaf.
+    chunk->compact.x[index] = quantize(point.x, p_extent[0], p_extent[1]);
+    chunk->compact.y[index] = quantize(point.y, p_extent[2], p_extent[3]);
+    chunk->compact.z[index] = quantize(point.z, p_extent[4], p_extent[5]);
+    chunk->compact.w[index] = point.w;
+}
+
+xyzw32 SearchNode::loadPoint(const SearchNodeChunk * chunk, int index) const
+{
+    if (!p_is_compact)
     {
-        p_data_points << point;
+        return chunk->points[index];
     }
 
+    xyzw32 point;
+    point.x = dequantize(chunk->compact.x[index], p_extent[0], p_extent[1]);
+    point.y = dequantize(chunk->compact.y[index], p_extent[2], p_extent[3]);
+    point.z = dequantize(chunk->compact.z[index], p_extent[4], p_extent[5]);
+    point.w = chunk->compact.w[index];
+
+    return point;
 }
 
 void SearchNode::weighSamples(xyzw32 & sample, Matrix<double> & sample_extent, float * sum_w, float * sum_wu, float p, float search_radius)
 {
-    if ((p_is_msd) && (!p_is_empty))
+    SearchNode * children = p_children.loadAcquire();
+
+    if (!children)
     {
         float d, w;
 
-        for (unsigned int i = 0; i < p_data_points.size(); i++)
+        int n_points = p_n_points.loadAcquire();
+        int n_per_chunk = pointsPerChunk();
+        int i = 0;
+
+        for (SearchNodeChunk * chunk = p_chunks.loadAcquire(); chunk && (i < n_points); chunk = chunk->next.loadAcquire())
         {
-            d = distance(p_data_points[i], sample);
+            for (int j = 0; (j < n_per_chunk) && (i < n_points); j++, i++)
+            {
+                xyzw32 point = loadPoint(chunk, j);
+
+                d = distance(point, sample);
 
-            if (d <= search_radius)
+                if (d <= search_radius)
+                {
+                    w = 1.0 / d;
+                    *sum_w += w;
+                    *sum_wu += w * point.w;
+                }
+            }
+        }
+
+        for (SearchNodeSpill * spill = p_spills; spill; spill = spill->next)
+        {
+            const xyzw32 * points = p_arena->spilled(spill->offset, spill->n_points);
+
+            for (int j = 0; j < spill->n_points; j++)
             {
-                w = 1.0 / d;
-                *sum_w += w;
-                *sum_wu += w * (p_data_points[i].w);
+                xyzw32 point = points[j];
+
+                d = distance(point, sample);
+
+                if (d <= search_radius)
+                {
+                    w = 1.0 / d;
+                    *sum_w += w;
+                    *sum_wu += w * point.w;
+                }
             }
         }
     }
@@ -196,9 +642,9 @@ void SearchNode::weighSamples(xyzw32 & sample, Matrix<double> & sample_extent, f
     {
         for (int i = 0; i < 8; i++)
         {
-            if (p_children[i].isIntersected(sample_extent))
+            if (children[i].isIntersected(sample_extent))
             {
-                p_children[i].weighSamples(sample, sample_extent, sum_w, sum_wu, p, search_radius);
+                children[i].weighSamples(sample, sample_extent, sum_w, sum_wu, p, search_radius);
             }
         }
     }
@@ -251,32 +697,68 @@ float SearchNode::getIDW(xyzw32 & sample, float p, float search_radius)
 
 bool SearchNode::intersectedItems(Matrix<double> & effective_extent, size_t * accumulated_points, size_t max_points, QList<xyzw32> * point_data)
 {
-    if ((p_is_msd) && (!p_is_empty))
+    SearchNode * children = p_children.loadAcquire();
+
+    if (!children)
     {
-        for (unsigned int i = 0; i < p_data_points.size(); i++)
+        int n_points = p_n_points.loadAcquire();
+        int n_per_chunk = pointsPerChunk();
+        int i = 0;
+
+        for (SearchNodeChunk * chunk = p_chunks.loadAcquire(); chunk && (i < n_points); chunk = chunk->next.loadAcquire())
         {
-            if (
-                ((p_data_points[i].x >= effective_extent.at(0)) && (p_data_points[i].x <= effective_extent.at(1))) &&
-                ((p_data_points[i].y >= effective_extent.at(2)) && (p_data_points[i].y <= effective_extent.at(3))) &&
-                ((p_data_points[i].z >= effective_extent.at(4)) && (p_data_points[i].z <= effective_extent.at(5))))
+            for (int j = 0; (j < n_per_chunk) && (i < n_points); j++, i++)
             {
-                *point_data << p_data_points[i];
-                (*accumulated_points)++;
+                xyzw32 point = loadPoint(chunk, j);
 
-                if (max_points <= *accumulated_points)
+                if (
+                    ((point.x >= effective_extent.at(0)) && (point.x <= effective_extent.at(1))) &&
+                    ((point.y >= effective_extent.at(2)) && (point.y <= effective_extent.at(3))) &&
+                    ((point.z >= effective_extent.at(4)) && (point.z <= effective_extent.at(5))))
                 {
-                    return true;
+                    *point_data << point;
+                    (*accumulated_points)++;
+
+                    if (max_points <= *accumulated_points)
+                    {
+                        return true;
+                    }
+                }
+            }
+        }
+
+        // Then the points that were spilled, in the order they were written
+        for (SearchNodeSpill * spill = p_spills; spill; spill = spill->next)
+        {
+            const xyzw32 * points = p_arena->spilled(spill->offset, spill->n_points);
+
+            for (int j = 0; j < spill->n_points; j++)
+            {
+                const xyzw32 & point = points[j];
+
+                if (
+                    ((point.x >= effective_extent.at(0)) && (point.x <= effective_extent.at(1))) &&
+                    ((point.y >= effective_extent.at(2)) && (point.y <= effective_extent.at(3))) &&
+                    ((point.z >= effective_extent.at(4)) && (point.z <= effective_extent.at(5))))
+                {
+                    *point_data << point;
+                    (*accumulated_points)++;
+
+                    if (max_points <= *accumulated_points)
+                    {
+                        return true;
+                    }
                 }
             }
         }
     }
     else //if ((p_n_children > 0))
     {
-        for (int i = 0; i < p_children.size(); i++)
+        for (int i = 0; i < 8; i++)
         {
-            if (p_children[i].isIntersected(effective_extent))
+            if (children[i].isIntersected(effective_extent))
             {
-                if (p_children[i].intersectedItems(effective_extent, accumulated_points, max_points, point_data))
+                if (children[i].intersectedItems(effective_extent, accumulated_points, max_points, point_data))
                 {
                     return true;
                 }
@@ -359,7 +841,13 @@ void SearchNode::split()
      * children. Then insert the nodes in the children according to
      * octant */
 
-    p_children.resize(8);
+    // Wait for the threads that are still writing points into the slots they reserved
+    while (p_n_points.loadAcquire() < p_max_points)
+    {
+        QThread::yieldCurrentThread();
+    }
+
+    SearchNode * children = static_cast<SearchNode *>(p_arena->allocate(8 * sizeof(SearchNode)));
 
     // For each child
     for (int i = 0; i < 8; i++)
@@ -370,7 +858,7 @@ void SearchNode::split()
 
         double half_side = (p_extent[1] - p_extent[0]) * 0.5;
 
-        Matrix<double> child_extent(1,6);
+        double child_extent[6];
         child_extent[0] = p_extent[0] + half_side * id_x;
         child_extent[1] = p_extent[1] - half_side * (1 - id_x);
         child_extent[2] = p_extent[2] + half_side * id_y;
@@ -378,25 +866,71 @@ void SearchNode::split()
         child_extent[4] = p_extent[4] + half_side * id_z;
         child_extent[5] = p_extent[5] - half_side * (1 - id_z);
 
-        p_children[i].setParent(this);
-        p_children[i].setExtent(child_extent);
-        p_children[i].setMaxPoints(p_max_points);
-        p_children[i].setBinsPerSide(p_bins_per_side);
-        p_children[i].setMinDataInterdistance(p_min_data_interdistance);
+        new (children + i) SearchNode(this, child_extent);
+        children[i].setMaxPoints(p_max_points);
+        children[i].setCompact(p_is_compact);
+        children[i].setBinsPerSide(p_bins_per_side);
+        children[i].setMinDataInterdistance(p_min_data_interdistance);
     }
 
-    // For each point
-    for (size_t i = 0; i < p_data_points.size(); i++)
+    // For each point. The children are not visible to other threads yet.
+    int i = 0;
+
+    int n_per_chunk = pointsPerChunk();
+
+    for (SearchNodeChunk * chunk = p_chunks.loadAcquire(); chunk && (i < p_max_points); chunk = chunk->next.loadAcquire())
     {
-        bool isOutofBounds = false;
+        for (int j = 0; (j < n_per_chunk) && (i < p_max_points); j++, i++)
+        {
+            bool isOutofBounds = false;
+
+            xyzw32 point = loadPoint(chunk, j);
 
-        unsigned int id = octant(p_data_points[i], &isOutofBounds);
+            unsigned int id = octant(point, &isOutofBounds);
 
-        if (!isOutofBounds)
+            if (!isOutofBounds)
+            {
+                children[id].insert(point);
+            }
+        }
+    }
+
+    p_children.storeRelease(children);
+
+    // Nobody writes to the points of this node any more
+    clearPoints();
+}
+
+void SearchNode::spill()
+{
+    // Wait for the threads that are still writing points into the slots they reserved
+    while (p_n_points.loadAcquire() < p_max_points)
+    {
+        QThread::yieldCurrentThread();
+    }
+
+    QVector<xyzw32> points(p_max_points);
+
+    int i = 0;
+    int n_per_chunk = pointsPerChunk();
+
+    for (SearchNodeChunk * chunk = p_chunks.loadAcquire(); chunk && (i < p_max_points); chunk = chunk->next.loadAcquire())
+    {
+        for (int j = 0; (j < n_per_chunk) && (i < p_max_points); j++, i++)
         {
-            p_children[id].insert(p_data_points[i]);
+            points[i] = loadPoint(chunk, j);
         }
     }
+
+    SearchNodeSpill * record = new (p_arena->allocate(sizeof(SearchNodeSpill))) SearchNodeSpill;
+    record->offset = p_arena->spill(points.constData(), p_max_points);
+    record->n_points = p_max_points;
+    record->next = p_spills;
+    p_spills = record;
+
+    // Empty the leaf, and open it to writers again. The chunks are reused by the next leaf to need them.
+    clearPoints();
+    p_n_reserved.storeRelease(0);
 }
 
 //double * SearchNode::getExtent()
@@ -5,6 +5,8 @@
 #include <QLinkedList>
 #include <QMutex>
 #include <QMutexLocker>
+#include <QAtomicInt>
+#include <QAtomicPointer>
 
 #include "../math/matrix.h"
 #include "../misc/smallstuff.h"
@@ -35,9 +37,30 @@ struct subnode
     QLinkedList<xyzw32> data_points;
 };
 
+struct SearchNodeChunk;
+struct SearchNodeSpill;
+class SearchNodeArena;
+
 class SearchNode
 {
-        /* This class represents a node in the "search octree" data structure. It is used in order to create bricks for the GPU octree. */
+        /* This class represents a node in the "search octree" data structure. It is used in order to create bricks for the GPU octree.
+         *
+         * Points can be inserted from many threads at once without locks. A leaf hands out slots in its point buffer with an
+         * atomic counter, and the buffer grows by chunks that are linked in with compare-and-swap. The thread that takes the
+         * first slot past the capacity splits the leaf: it waits for the other writers to finish, moves the points into eight
+         * new children, and then publishes them with a single atomic store. Threads that find the leaf full wait for that
+         * store and continue into the children. Reading the points is only safe once insertion has stopped.
+         *
+         * The nodes and point chunks of a tree are carved out of large slabs owned by the root, and the chunks of a split
+         * leaf are recycled for later leaves. Nodes below the root are never destroyed one by one, so they hold no memory
+         * of their own, and clearing the root releases the whole tree at once.
+         *
+         * With a memory budget, a full leaf stops splitting once the slabs exceed the budget. Its points are appended to a
+         * scratch file instead, and the leaf is emptied and reopened. Reads map the scratch file and visit the spilled
+         * points after those still in memory. As children are visited in octant order, a tree walk visits the leaves in
+         * Morton order. */
+        Q_DISABLE_COPY(SearchNode)
+
     public:
         SearchNode();
         SearchNode(SearchNode * p_parent, double * extent);
@@ -51,6 +74,15 @@ class SearchNode
         void setParent(SearchNode * p_parent);
         void setMaxPoints(int value);
         void setMinDataInterdistance(double value);
+
+        // Limit the memory of the tree, beyond which leaves are spilled to a scratch file. Set on the root of an empty
+        // tree. 0 means no limit.
+        void setMemoryBudget(size_t bytes);
+
+        // Store the points of leaves with 16 bit coordinates relative to the leaf, 10 bytes per point instead of 16. The
+        // coordinates are decoded as they are read. Set on the root of an empty tree, and inherited by new nodes.
+        void setCompact(bool value);
+        bool isCompact() const;
         bool isIntersected(Matrix<double> &sample_extent);
         bool getData(size_t max_points,
                      double * brick_extent,
@@ -63,25 +95,42 @@ class SearchNode
 
 
     private:
-        void p_insert(xyzw32 &point);
+        bool append(xyzw32 &point);
+        SearchNodeChunk * chunk(int index);
+        int pointsPerChunk() const;
+        void storePoint(SearchNodeChunk * chunk, int index, const xyzw32 & point);
+        xyzw32 loadPoint(const SearchNodeChunk * chunk, int index) const;
+        void clearPoints();
+        int capacity();
         void rebin();
 
         void weighSamples(xyzw32 & sample, Matrix<double> &sample_extent, float * sum_w, float * sum_wu, float p, float search_radius);
         bool intersectedItems(Matrix<double> &effective_extent, size_t * accumulated_points, size_t max_points, QList<xyzw32> * point_data);
         float distance(xyzw32 &a, xyzw32 &b);
         void split();
+        void spill();
         unsigned int level();
         unsigned int octant(xyzw32 &point, bool * isOutofBounds);
 
         SearchNode * p_parent;
-        QVector<SearchNode> p_children;
-        QVector<xyzw32> p_data_points;
+
+        // Shared by all the nodes of a tree, and owned by the root
+        SearchNodeArena * p_arena;
+
+        // An array of eight children, or NULL while this is a leaf (msd, max subdivision)
+        QAtomicPointer<SearchNode> p_children;
+
+        // Point buffer of a leaf. Slots are reserved first and then written, so the number of written points lags behind.
+        QAtomicPointer<SearchNodeChunk> p_chunks;
+        QAtomicInt p_n_reserved;
+        QAtomicInt p_n_points;
+
+        // Earlier contents of the leaf, now in the scratch file. Only changed by the thread that spills the leaf.
+        SearchNodeSpill * p_spills;
 
 //        QLinkedList<subnode> p_linked_points;
-        Matrix<double> p_extent;
+        double p_extent[6];
         unsigned int p_tree_level;
-        bool p_is_empty;
-        bool p_is_msd;
 
         bool p_relaxed_rebinning_on_split;
         bool p_strict_rebinning_on_split;
@@ -92,7 +141,6 @@ class SearchNode
 
         int p_bins_per_side;
         int p_max_points;
-
-        QMutex * p_mutex;
+        bool p_is_compact;
 };
 #endif
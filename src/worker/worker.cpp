@@ -8,6 +8,8 @@
 #include <iomanip>
 #include <ctime>
 #include <limits>
+#include <cstring>
+#include <algorithm>
 
 //#include <QtGlobal>
 #include <QCoreApplication> // Remove?
@@ -22,11 +24,19 @@
 #include <QStringList>
 #include <QByteArray>
 #include <QDateTime>
+#include <QVector>
+#include <QList>
 
+#include "file/reconstructionscheduler.h"
 
-static const size_t BRICK_POOL_SOFT_MAX_BYTES = 0.7e9; // Effectively limited by the max allocation size for global memory if the pool resides on the GPU during pool construction. 3D image can be used with OpenCL 1.2, allowing you to use the entire VRAM.
-static const size_t MAX_POINTS_PER_CLUSTER = 10000000;
+
+static const size_t BRICK_POOL_SLAB_MAX_BYTES = 0.25e9; // The pool grows by buffers (slabs) of at most this size, or the max allocation size of the device if smaller
+static const double BRICK_POOL_DEVICE_FRACTION = 0.8; // The share of global memory the pool may take, after the cluster buffers
+static const double BRICK_POOL_HOST_FRACTION = 0.5; // The share of free host memory the pool and the node array may take
+static const size_t BRICK_POOL_MAX_LAYERS = 1024; // Pool ids have 10 bits for the brick layer
+static const size_t MAX_POINTS_PER_CLUSTER = 10000000; // Reduced to fit the max allocation size of the device
 static const size_t MAX_NODES_PER_CLUSTER = 20000;
+static const size_t BIN_DIM_MAX = 12; // As in voxelize.cl
 
 
 // ASCII from http://patorjk.com/software/taag/#p=display&c=c&f=Trek&t=Base%20Class
@@ -112,6 +122,7 @@ void BaseWorker::setSet(SeriesSet set)
 VoxelizeWorker::VoxelizeWorker()
 {
     isCLInitialized = false;
+    is_binned_voxelization = true;
     initializeOpenCLFunctions();
 }
 
@@ -120,6 +131,8 @@ VoxelizeWorker::~VoxelizeWorker()
     if (isCLInitialized)
     {
         err = QOpenCLReleaseKernel(voxelize_kernel);
+        err |= QOpenCLReleaseKernel(voxelize_binned_kernel);
+        err |= QOpenCLReleaseKernel(compact_kernel);
 
         if ( err != CL_SUCCESS)
         {
@@ -128,6 +141,34 @@ VoxelizeWorker::~VoxelizeWorker()
     }
 }
 
+cl_device_id VoxelizeWorker::device()
+{
+    size_t devices_bytes;
+
+    err = QOpenCLGetContextInfo(context_cl.context(), CL_CONTEXT_DEVICES, 0, NULL, &devices_bytes);
+
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    QVector<cl_device_id> devices(devices_bytes / sizeof(cl_device_id));
+
+    err = QOpenCLGetContextInfo(context_cl.context(), CL_CONTEXT_DEVICES, devices_bytes, devices.data(), NULL);
+
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    return devices[0];
+}
+
+void VoxelizeWorker::setBinnedVoxelization(bool value)
+{
+    is_binned_voxelization = value;
+}
+
 unsigned int VoxelizeWorker::getOctIndex(unsigned int msdFlag, unsigned int dataFlag, unsigned int child)
 {
     return (msdFlag << 31) | (dataFlag << 30) | child;
@@ -155,7 +196,28 @@ void VoxelizeWorker::initializeCLKernel()
         qFatal(cl_error_cstring(err));
     }
 
-    context_cl.buildProgram("-Werror -cl-std=CL1.2");
+    // The voxelize kernels load points in tiles to local memory. The tile is the largest power of two of points that takes
+    // at most half of the local memory left next to the reduction array of a brick and the bin cells of voxelize_binned.
+    // The other half is headroom for the local allocations of the OpenCL implementation.
+    cl_ulong local_mem_bytes;
+
+    err = QOpenCLGetDeviceInfo(device(), CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &local_mem_bytes, NULL);
+
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
+    size_t reserved_bytes = 512 * sizeof(cl_float) + (2 * BIN_DIM_MAX * BIN_DIM_MAX * BIN_DIM_MAX + 1) * sizeof(cl_int);
+    size_t tile_bytes = (local_mem_bytes > reserved_bytes) ? local_mem_bytes - reserved_bytes : 0;
+    size_t point_tile_size = 32;
+
+    while ((point_tile_size < 1024) && (point_tile_size * 2 * sizeof(cl_float4) <= tile_bytes / 2))
+    {
+        point_tile_size *= 2;
+    }
+
+    context_cl.buildProgram("-Werror -cl-std=CL1.2 -DPOINT_TILE_SIZE=" + QString::number(point_tile_size));
 
 
     // Kernel handles
@@ -166,6 +228,13 @@ void VoxelizeWorker::initializeCLKernel()
         qFatal(cl_error_cstring(err));
     }
 
+    voxelize_binned_kernel = QOpenCLCreateKernel(context_cl.program(), "voxelize_binned", &err);
+
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
     fill_kernel = QOpenCLCreateKernel(context_cl.program(), "fill", &err);
 
     if ( err != CL_SUCCESS)
@@ -173,6 +242,13 @@ void VoxelizeWorker::initializeCLKernel()
         qFatal(cl_error_cstring(err));
     }
 
+    compact_kernel = QOpenCLCreateKernel(context_cl.program(), "compact", &err);
+
+    if ( err != CL_SUCCESS)
+    {
+        qFatal(cl_error_cstring(err));
+    }
+
     isCLInitialized = true;
 }
 
@@ -215,38 +291,74 @@ void VoxelizeWorker::process()
         // Save initial metadata (just text)
         svo->setMetaData("You can write notes about the dataset here.");
 
-        // Prepare the brick pool in which we will store bricks
+        // Size the brick pool from the memory of the device and the host. The pool is a stack of layers of bricks, and is
+        // kept on the device in slabs of whole layers. A new slab is allocated when the bricks of a cluster would not fit
+        // in the slabs so far.
+        cl_ulong max_alloc_bytes, global_mem_bytes;
+        size_t image3d_max_depth;
+
+        err = QOpenCLGetDeviceInfo(device(), CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc_bytes, NULL);
+        err |= QOpenCLGetDeviceInfo(device(), CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &global_mem_bytes, NULL);
+        err |= QOpenCLGetDeviceInfo(device(), CL_DEVICE_IMAGE3D_MAX_DEPTH, sizeof(size_t), &image3d_max_depth, NULL);
+
+        if ( err != CL_SUCCESS)
+        {
+            qFatal(cl_error_cstring(err));
+        }
+
+        size_t max_points_per_cluster = std::min(MAX_POINTS_PER_CLUSTER, (size_t) (max_alloc_bytes / sizeof(cl_float4)));
+
+        size_t brick_bytes = n_points_brick * sizeof(cl_float);
+        size_t bricks_per_layer = (1 << svo->brickPoolPower()) * (1 << svo->brickPoolPower());
+        size_t layer_bytes = bricks_per_layer * brick_bytes;
+
+        size_t layers_per_slab = std::min((size_t) max_alloc_bytes, BRICK_POOL_SLAB_MAX_BYTES) / layer_bytes;
+
+        if (layers_per_slab < 1)
+        {
+            layers_per_slab = 1;
+        }
+
+        size_t slab_bricks = layers_per_slab * bricks_per_layer;
+        size_t slab_bytes = slab_bricks * brick_bytes;
+
+        // The dimensions of one slab
         Matrix<int> pool_dimension(1, 4, 0);
         pool_dimension[0] = (1 << svo->brickPoolPower()) * svo->brickOuterDimension();
         pool_dimension[1] = (1 << svo->brickPoolPower()) * svo->brickOuterDimension();
-        pool_dimension[2] = (BRICK_POOL_SOFT_MAX_BYTES / (sizeof(cl_float) * svo->brickOuterDimension() * svo->brickOuterDimension() * svo->brickOuterDimension())) / ((1 << svo->brickPoolPower()) * (1 << svo->brickPoolPower()));
+        pool_dimension[2] = layers_per_slab * svo->brickOuterDimension();
+
+        // The device holds the cluster buffers next to the pool
+        size_t cluster_bytes = MAX_NODES_PER_CLUSTER * (brick_bytes + 6 * sizeof(cl_float) + 3 * sizeof(cl_float) + 5 * sizeof(cl_int)) +
+                               max_points_per_cluster * sizeof(cl_float4) * (is_binned_voxelization ? 2 : 1);
+        size_t device_pool_bytes = global_mem_bytes * BRICK_POOL_DEVICE_FRACTION;
+        device_pool_bytes = (device_pool_bytes > cluster_bytes) ? device_pool_bytes - cluster_bytes : slab_bytes;
 
-        if (pool_dimension[2] < 1)
+        size_t n_max_bricks = std::min(device_pool_bytes / brick_bytes, BRICK_POOL_MAX_LAYERS * bricks_per_layer);
+
+        // The volume renderer uploads the whole pool as one 3D image with a spare layer on top, so the pool must fit
+        // within the image depth and the max allocation size of the device as well
+        size_t render_layers = std::min((size_t) (image3d_max_depth / svo->brickOuterDimension()), (size_t) (max_alloc_bytes / layer_bytes));
+        render_layers = (render_layers > 1) ? render_layers - 1 : 1;
+
+        n_max_bricks = std::min(n_max_bricks, render_layers * bricks_per_layer);
+
+        // The host receives the pool and holds up to eight nodes per brick
+        size_t host_pool_bytes = ReconstructionScheduler::availableMemory() * BRICK_POOL_HOST_FRACTION;
+
+        if (host_pool_bytes > 0)
         {
-            pool_dimension[2] = 1;
+            n_max_bricks = std::min(n_max_bricks, host_pool_bytes / (brick_bytes + 8 * sizeof(BrickNode)));
         }
 
-        pool_dimension[2] *= svo->brickOuterDimension();
-
-        size_t BRICK_POOL_HARD_MAX_BYTES = pool_dimension[0] * pool_dimension[1] * pool_dimension[2] * sizeof(float);
+        n_max_bricks = std::max(n_max_bricks, (size_t) 2);
 
         emit changedFormatMemoryUsage(QString("Mem usage: %p% (%v of %m MB)"));
-        emit changedRangeMemoryUsage(0, BRICK_POOL_HARD_MAX_BYTES / 1e6);
+        emit changedRangeMemoryUsage(0, n_max_bricks * brick_bytes / 1e6);
         emit changedMemoryUsage(0);
 
-        size_t n_max_bricks = BRICK_POOL_HARD_MAX_BYTES / (n_points_brick * sizeof(float));
-
         // Prepare the relevant OpenCL buffers
-        cl_mem pool_cl = QOpenCLCreateBuffer(context_cl.context(),
-                                             CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
-                                             BRICK_POOL_HARD_MAX_BYTES,
-                                             NULL,
-                                             &err);
-
-        if ( err != CL_SUCCESS)
-        {
-            qFatal(cl_error_cstring(err));
-        }
+        QList<cl_mem> pool_slabs;
 
         cl_mem pool_cluster_cl = QOpenCLCreateBuffer(context_cl.context(),
                                  CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
@@ -272,7 +384,7 @@ void VoxelizeWorker::process()
 
         cl_mem point_data_cl = QOpenCLCreateBuffer(context_cl.context(),
                                CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
-                               MAX_POINTS_PER_CLUSTER * sizeof(cl_float4),
+                               max_points_per_cluster * sizeof(cl_float4),
                                NULL,
                                &err);
 
@@ -281,6 +393,23 @@ void VoxelizeWorker::process()
             qFatal(cl_error_cstring(err));
         }
 
+        // The points of each brick sorted into bin cells, for voxelize_binned
+        cl_mem point_data_binned_cl = NULL;
+
+        if (is_binned_voxelization)
+        {
+            point_data_binned_cl = QOpenCLCreateBuffer(context_cl.context(),
+                                   CL_MEM_READ_WRITE,
+                                   max_points_per_cluster * sizeof(cl_float4),
+                                   NULL,
+                                   &err);
+
+            if ( err != CL_SUCCESS)
+            {
+                qFatal(cl_error_cstring(err));
+            }
+        }
+
         cl_mem point_data_offset_cl = QOpenCLCreateBuffer(context_cl.context(),
                                       CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
                                       MAX_NODES_PER_CLUSTER * sizeof(cl_int),
@@ -339,6 +468,32 @@ void VoxelizeWorker::process()
             qFatal(cl_error_cstring(err));
         }
 
+        // The pool brick of each brick in the cluster, or -1. Assigned by the compact kernel and used by the fill kernel
+        cl_mem brick_slot_cl = QOpenCLCreateBuffer(context_cl.context(),
+                               CL_MEM_READ_WRITE,
+                               MAX_NODES_PER_CLUSTER * sizeof(cl_int),
+                               NULL,
+                               &err);
+
+        if ( err != CL_SUCCESS)
+        {
+            qFatal(cl_error_cstring(err));
+        }
+
+        // The non-empty bricks of the cluster as listed by the compact kernel: their number, the largest brick sum, and
+        // a (cluster index, max subdivision flag) pair for each
+        Matrix<int> brick_list(1, 2 + 2 * MAX_NODES_PER_CLUSTER, 0);
+        cl_mem brick_list_cl = QOpenCLCreateBuffer(context_cl.context(),
+                               CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
+                               brick_list.bytes(),
+                               NULL,
+                               &err);
+
+        if ( err != CL_SUCCESS)
+        {
+            qFatal(cl_error_cstring(err));
+        }
+
         // Place all data points in an octree data structure from which to construct the bricks in the brick pool
         SearchNode root(NULL, svo->extent().data());
 
@@ -357,7 +512,7 @@ void VoxelizeWorker::process()
         if (!kill_flag)
         {
             /* Create an octree from brick data. The nodes are maintained in a linear array rather than a tree. This is mainly due to (current) lack of proper support for recursion on GPUs */
-            Matrix<BrickNode> gpuHelpOctree(1, n_max_bricks * 16);
+            QVector<BrickNode> gpuHelpOctree(8 * slab_bricks + 8); // Grows with the children
             gpuHelpOctree[0].setParent(0);
 
             // An array to store number of nodes per level
@@ -376,7 +531,7 @@ void VoxelizeWorker::process()
             Matrix<double> brick_extent(1, 6 * MAX_NODES_PER_CLUSTER); // The extent of each brick in a kernel invocation
             Matrix<int> point_data_offset(1, MAX_NODES_PER_CLUSTER); // The data offset for each brick in a kernel invocation
             Matrix<int> point_data_count(1, MAX_NODES_PER_CLUSTER); // The data size for each brick in a kernel invocation
-            Matrix<float> point_data(MAX_POINTS_PER_CLUSTER, 4); // Temporaily holds the data for a single brick
+            Matrix<float> point_data(max_points_per_cluster, 4); // Temporaily holds the data for a single brick
 
 
 
@@ -420,7 +575,7 @@ void VoxelizeWorker::process()
                     size_t n_points_harvested = 0; // The number of xyzi data points gathered
                     size_t n_nodes_treated_in_cluster = 0; // The number of nodes treated in this iteration of the enclosing while loop
 
-                    while (n_points_harvested < MAX_POINTS_PER_CLUSTER)
+                    while (n_points_harvested < max_points_per_cluster)
                     {
                         // The id of the octnode in the octnode array
                         currentId = nodes_prev_lvls + n_nodes_treated + n_nodes_treated_in_cluster;
@@ -428,6 +583,11 @@ void VoxelizeWorker::process()
                         // Set the level
                         gpuHelpOctree[currentId].setLevel(lvl);
 
+                        // The node counts as empty unless the third pass finds data in its brick
+                        gpuHelpOctree[currentId].setDataFlag(0);
+                        gpuHelpOctree[currentId].setMsdFlag(1);
+                        gpuHelpOctree[currentId].setChild(0);
+
                         // Set the brick id
                         gpuHelpOctree[currentId].calcBrickId((n_nodes_treated + n_nodes_treated_in_cluster) % 8 , &gpuHelpOctree[gpuHelpOctree[currentId].getParent()]);
 
@@ -533,100 +693,164 @@ void VoxelizeWorker::process()
 
 
                     // Second pass: calculate the data for each node in the cluster (OpenCL)
-                    // Set kernel arguments
-                    err = QOpenCLSetKernelArg( voxelize_kernel, 0, sizeof(cl_mem), (void *) &point_data_cl);
-                    err |= QOpenCLSetKernelArg( voxelize_kernel, 1, sizeof(cl_mem), (void *) &point_data_offset_cl);
-                    err |= QOpenCLSetKernelArg( voxelize_kernel, 2, sizeof(cl_mem), (void *) &point_data_count_cl);
-                    err |= QOpenCLSetKernelArg( voxelize_kernel, 3, sizeof(cl_mem), (void *) &brick_extent_cl);
-                    err |= QOpenCLSetKernelArg( voxelize_kernel, 4, sizeof(cl_mem), (void *) &pool_cluster_cl);
-                    err |= QOpenCLSetKernelArg( voxelize_kernel, 5, sizeof(cl_mem), (void *) &min_check_cl);
-                    err |= QOpenCLSetKernelArg( voxelize_kernel, 6, sizeof(cl_mem), (void *) &sum_check_cl);
-                    err |= QOpenCLSetKernelArg( voxelize_kernel, 7, sizeof(cl_mem), (void *) &variance_check_cl);
-                    err |= QOpenCLSetKernelArg( voxelize_kernel, 8, svo->brickOuterDimension() * svo->brickOuterDimension() * svo->brickOuterDimension() * sizeof(cl_float), NULL);
+                    // Set kernel arguments. The binned kernel takes the same arguments plus its scratch buffer.
+                    cl_kernel interpolation_kernel = is_binned_voxelization ? voxelize_binned_kernel : voxelize_kernel;
+
+                    err = QOpenCLSetKernelArg( interpolation_kernel, 0, sizeof(cl_mem), (void *) &point_data_cl);
+                    err |= QOpenCLSetKernelArg( interpolation_kernel, 1, sizeof(cl_mem), (void *) &point_data_offset_cl);
+                    err |= QOpenCLSetKernelArg( interpolation_kernel, 2, sizeof(cl_mem), (void *) &point_data_count_cl);
+                    err |= QOpenCLSetKernelArg( interpolation_kernel, 3, sizeof(cl_mem), (void *) &brick_extent_cl);
+                    err |= QOpenCLSetKernelArg( interpolation_kernel, 4, sizeof(cl_mem), (void *) &pool_cluster_cl);
+                    err |= QOpenCLSetKernelArg( interpolation_kernel, 5, sizeof(cl_mem), (void *) &min_check_cl);
+                    err |= QOpenCLSetKernelArg( interpolation_kernel, 6, sizeof(cl_mem), (void *) &sum_check_cl);
+                    err |= QOpenCLSetKernelArg( interpolation_kernel, 7, sizeof(cl_mem), (void *) &variance_check_cl);
+                    err |= QOpenCLSetKernelArg( interpolation_kernel, 8, svo->brickOuterDimension() * svo->brickOuterDimension() * svo->brickOuterDimension() * sizeof(cl_float), NULL);
                     int tmp = svo->brickOuterDimension(); // why a separate variable?
-                    err |= QOpenCLSetKernelArg( voxelize_kernel, 9, sizeof(cl_int), &tmp);
-                    err |= QOpenCLSetKernelArg( voxelize_kernel, 10, sizeof(cl_float), &search_radius);
-                    err |= QOpenCLSetKernelArg( voxelize_kernel, 11, sizeof(cl_float), &suggested_search_radius_high);
+                    err |= QOpenCLSetKernelArg( interpolation_kernel, 9, sizeof(cl_int), &tmp);
+                    err |= QOpenCLSetKernelArg( interpolation_kernel, 10, sizeof(cl_float), &search_radius);
+                    err |= QOpenCLSetKernelArg( interpolation_kernel, 11, sizeof(cl_float), &suggested_search_radius_high);
+
+                    if (is_binned_voxelization)
+                    {
+                        err |= QOpenCLSetKernelArg( interpolation_kernel, 12, sizeof(cl_mem), (void *) &point_data_binned_cl);
+                    }
 
                     if ( err != CL_SUCCESS)
                     {
                         qFatal(cl_error_cstring(err));
                     }
 
-                    err = QOpenCLFinish(context_cl.queue());
+                    // Interpolate data for all bricks in the cluster at once. Each work group is one brick.
+                    size_t loc_ws[3] = {8, 8, 8};
+                    size_t glb_ws[3] = {8, 8, 8 * n_nodes_treated_in_cluster};
+                    err = QOpenCLEnqueueNDRangeKernel(
+                              context_cl.queue(),
+                              interpolation_kernel,
+                              3,
+                              NULL,
+                              glb_ws,
+                              loc_ws,
+                              0, NULL, NULL);
 
                     if ( err != CL_SUCCESS)
                     {
+                        qDebug() << n_nodes_treated_in_cluster << tmp << search_radius;
                         qFatal(cl_error_cstring(err));
                     }
 
-                    // Interpolate data for each brick
-                    for (size_t j = 0; j < n_nodes_treated_in_cluster; j++)
+                    // Grow the pool until all bricks of the cluster would fit. If the device cannot allocate another
+                    // slab, the pool ends with the slabs it has.
+                    size_t n_bricks_needed = std::min(non_empty_node_counter + n_nodes_treated_in_cluster, n_max_bricks);
+
+                    while ((size_t) pool_slabs.size() * slab_bricks < n_bricks_needed)
                     {
-                        // Launch kernel
-                        size_t glb_offset[3] = {0, 0, 8 * j};
-                        size_t loc_ws[3] = {8, 8, 8};
-                        size_t glb_ws[3] = {8, 8, 8};
-                        err = QOpenCLEnqueueNDRangeKernel(
-                                  context_cl.queue(),
-                                  voxelize_kernel,
-                                  3,
-                                  glb_offset,
-                                  glb_ws,
-                                  loc_ws,
-                                  0, NULL, NULL);
+                        cl_mem slab_cl = QOpenCLCreateBuffer(context_cl.context(),
+                                                             CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                                                             slab_bytes,
+                                                             NULL,
+                                                             &err);
 
-                        if ( err != CL_SUCCESS)
+                        if ((err == CL_MEM_OBJECT_ALLOCATION_FAILURE) || (err == CL_OUT_OF_RESOURCES) || (err == CL_OUT_OF_HOST_MEMORY))
+                        {
+                            n_max_bricks = std::max((size_t) pool_slabs.size() * slab_bricks, (size_t) 1);
+                            emit changedRangeMemoryUsage(0, n_max_bricks * brick_bytes / 1e6);
+                            break;
+                        }
+                        else if ( err != CL_SUCCESS)
                         {
-                            qDebug() << j << "of" << n_nodes_treated_in_cluster << tmp << search_radius;
                             qFatal(cl_error_cstring(err));
                         }
 
-                        //                        if (i + j + 1 >= nodes[lvl]) break;
+                        pool_slabs << slab_cl;
                     }
 
-                    err = QOpenCLFinish(context_cl.queue());
+                    // Third pass: transfer non-empty nodes to svo data structure (OpenCL). The compact kernel assigns pool
+                    // bricks to the non-empty bricks and lists them, and the fill kernel moves their data to the pool.
+                    // Only the list comes back to the host.
+                    unsigned int first_pool_brick = non_empty_node_counter;
+                    unsigned int max_pool_bricks = n_max_bricks - 1;
+                    unsigned int n_cluster_bricks = n_nodes_treated_in_cluster;
+                    unsigned int n_points_cluster_brick = n_points_brick;
+                    int is_max_level = (lvl >= svo->levels() - 1);
+                    int is_near_max_level = (svo->levels() - lvl < 3);
+                    size_t compact_ws = 256;
+
+                    err = QOpenCLSetKernelArg( compact_kernel, 0, sizeof(cl_mem), (void *) &min_check_cl);
+                    err |= QOpenCLSetKernelArg( compact_kernel, 1, sizeof(cl_mem), (void *) &sum_check_cl);
+                    err |= QOpenCLSetKernelArg( compact_kernel, 2, sizeof(cl_mem), (void *) &variance_check_cl);
+                    err |= QOpenCLSetKernelArg( compact_kernel, 3, sizeof(cl_mem), (void *) &brick_slot_cl);
+                    err |= QOpenCLSetKernelArg( compact_kernel, 4, sizeof(cl_mem), (void *) &brick_list_cl);
+                    err |= QOpenCLSetKernelArg( compact_kernel, 5, compact_ws * sizeof(cl_int), NULL);
+                    err |= QOpenCLSetKernelArg( compact_kernel, 6, compact_ws * sizeof(cl_float), NULL);
+                    err |= QOpenCLSetKernelArg( compact_kernel, 7, sizeof(cl_uint), &n_cluster_bricks);
+                    err |= QOpenCLSetKernelArg( compact_kernel, 8, sizeof(cl_uint), &first_pool_brick);
+                    err |= QOpenCLSetKernelArg( compact_kernel, 9, sizeof(cl_uint), &max_pool_bricks);
+                    err |= QOpenCLSetKernelArg( compact_kernel, 10, sizeof(cl_uint), &n_points_cluster_brick);
+                    err |= QOpenCLSetKernelArg( compact_kernel, 11, sizeof(cl_int), &is_max_level);
+                    err |= QOpenCLSetKernelArg( compact_kernel, 12, sizeof(cl_int), &is_near_max_level);
 
                     if ( err != CL_SUCCESS)
                     {
                         qFatal(cl_error_cstring(err));
                     }
 
-                    // The minimum value data point in each brick
-                    err = QOpenCLEnqueueReadBuffer ( context_cl.queue(),
-                                                     min_check_cl,
-                                                     CL_TRUE,
-                                                     0,
-                                                     MAX_NODES_PER_CLUSTER * sizeof(float),
-                                                     min_check.data(),
-                                                     0, NULL, NULL);
+                    err = QOpenCLEnqueueNDRangeKernel(
+                              context_cl.queue(),
+                              compact_kernel,
+                              1,
+                              NULL,
+                              &compact_ws,
+                              &compact_ws,
+                              0, NULL, NULL);
 
                     if ( err != CL_SUCCESS)
                     {
                         qFatal(cl_error_cstring(err));
                     }
 
-                    // The sum of data points in each brick
-                    err = QOpenCLEnqueueReadBuffer ( context_cl.queue(),
-                                                     sum_check_cl,
-                                                     CL_TRUE,
-                                                     0,
-                                                     MAX_NODES_PER_CLUSTER * sizeof(float),
-                                                     sum_check.data(),
-                                                     0, NULL, NULL);
+                    // Fill each slab that the bricks of the cluster may go to
+                    size_t last_pool_brick = std::min((size_t) first_pool_brick + n_nodes_treated_in_cluster, (size_t) max_pool_bricks);
 
-                    if ( err != CL_SUCCESS)
+                    for (size_t slab = first_pool_brick / slab_bricks; (slab * slab_bricks < last_pool_brick) && (slab < (size_t) pool_slabs.size()); slab++)
                     {
-                        qFatal(cl_error_cstring(err));
+                        unsigned int slab_first_brick = slab * slab_bricks;
+                        unsigned int n_slab_bricks = slab_bricks;
+
+                        err = QOpenCLSetKernelArg( fill_kernel, 0, sizeof(cl_mem), (void *) &pool_cluster_cl);
+                        err |= QOpenCLSetKernelArg( fill_kernel, 1, sizeof(cl_mem), (void *) &pool_slabs[slab]);
+                        err |= QOpenCLSetKernelArg( fill_kernel, 2, sizeof(cl_int4), pool_dimension.data());
+                        err |= QOpenCLSetKernelArg( fill_kernel, 3, sizeof(cl_uint), &tmp);
+                        err |= QOpenCLSetKernelArg( fill_kernel, 4, sizeof(cl_mem), (void *) &brick_slot_cl);
+                        err |= QOpenCLSetKernelArg( fill_kernel, 5, sizeof(cl_uint), &slab_first_brick);
+                        err |= QOpenCLSetKernelArg( fill_kernel, 6, sizeof(cl_uint), &n_slab_bricks);
+
+                        if ( err != CL_SUCCESS)
+                        {
+                            qFatal(cl_error_cstring(err));
+                        }
+
+                        err = QOpenCLEnqueueNDRangeKernel(
+                                  context_cl.queue(),
+                                  fill_kernel,
+                                  3,
+                                  NULL,
+                                  glb_ws,
+                                  loc_ws,
+                                  0, NULL, NULL);
+
+                        if ( err != CL_SUCCESS)
+                        {
+                            qFatal(cl_error_cstring(err));
+                        }
                     }
 
-                    // The variance of data points in each brick
+                    // The only synchronization per cluster. The list has one entry per treated node at most.
                     err = QOpenCLEnqueueReadBuffer ( context_cl.queue(),
-                                                     variance_check_cl,
+                                                     brick_list_cl,
                                                      CL_TRUE,
                                                      0,
-                                                     MAX_NODES_PER_CLUSTER * sizeof(float),
-                                                     variance_check.data(),
+                                                     (2 + 2 * n_nodes_treated_in_cluster) * sizeof(cl_int),
+                                                     brick_list.data(),
                                                      0, NULL, NULL);
 
                     if ( err != CL_SUCCESS)
@@ -634,119 +858,56 @@ void VoxelizeWorker::process()
                         qFatal(cl_error_cstring(err));
                     }
 
+                    int n_non_empty = brick_list[0];
 
-                    err = QOpenCLFinish(context_cl.queue());
+                    // Find the max sum of a brick
+                    float cluster_max_sum;
+                    memcpy(&cluster_max_sum, brick_list.data() + 1, sizeof(float));
 
-                    if ( err != CL_SUCCESS)
+                    if (cluster_max_sum > max_brick_sum)
                     {
-                        qFatal(cl_error_cstring(err));
+                        max_brick_sum = cluster_max_sum;
                     }
 
-
-                    // Third pass: transfer non-empty nodes to svo data structure (OpenCL)
-                    for (size_t j = 0; j < n_nodes_treated_in_cluster; j++)
+                    for (int n = 0; n < n_non_empty; n++)
                     {
                         // The id of the octnode in the octnode array
-                        currentId = nodes_prev_lvls + n_nodes_treated + j;
+                        currentId = nodes_prev_lvls + n_nodes_treated + brick_list[2 + 2 * n + 0];
 
-                        // If a node has no relevant data
-                        if ((sum_check[j] <= 0.0))
+                        if ((non_empty_node_counter + 1) >= n_max_bricks)
                         {
-                            gpuHelpOctree[currentId].setDataFlag(0);
-                            gpuHelpOctree[currentId].setMsdFlag(1);
-                            gpuHelpOctree[currentId].setChild(0);
+                            emit popup(QString("Warning - Data Overflow"), QString("The dataset you are trying to create grew too large, and exceeded the limit of " + QString::number(n_max_bricks * brick_bytes / 1e6) + " MB set by the available memory. The issue can be remedied by applying more stringent reconstruction parameters or by reducing the octree level."));
+                            kill_flag = true;
+                            break;
                         }
-                        // Else a node has data and possibly qualifies for children
-                        else
-                        {
-                            if ((non_empty_node_counter + 1)*n_points_brick * sizeof(float) >= BRICK_POOL_HARD_MAX_BYTES)
-                            {
-                                emit popup(QString("Warning - Data Overflow"), QString("The dataset you are trying to create grew too large, and exceeded the limit of " + QString::number(BRICK_POOL_HARD_MAX_BYTES / 1e6) + " MB. The issue can be remedied by applying more stringent reconstruction parameters or by reducing the octree level."));
-                                kill_flag = true;
-                                break;
-                            }
-
-                            gpuHelpOctree[currentId].setDataFlag(1);
-                            gpuHelpOctree[currentId].setMsdFlag(0);
-
-                            // Set maximum subdivision if the max level is reached or if the variance of the brick data is small compared to the average.
-                            float average = sum_check[j] / (float)n_points_brick;
-                            float std_dev = sqrt(variance_check[j]);
-
-                            if ((lvl >= svo->levels() - 1) || // Max level
-                                    ((std_dev <= 0.5 * average) && (min_check[j] > 0) && (svo->levels() - lvl < 3 )) || // Voxel data is self-similar and all voxels are non-zero
-                                    ((std_dev <= 0.2 * average) && (svo->levels() - lvl < 3 ))) // Voxel data is self-similar
-                            {
-                                //                                qDebug() << "Terminated brick early at lvl" << lvl << "Average:" << sum_check[j]/(float)n_points_brick << "Variance:" << variance_check[j];
-                                gpuHelpOctree[currentId].setMsdFlag(1);
-                            }
 
-                            // Set the pool id of the brick corresponding to the node
-                            gpuHelpOctree[currentId].calcPoolId(svo->brickPoolPower(), non_empty_node_counter);
+                        // The node has data and possibly qualifies for children
+                        gpuHelpOctree[currentId].setDataFlag(1);
+                        gpuHelpOctree[currentId].setMsdFlag(brick_list[2 + 2 * n + 1]);
 
-                            // Find the max sum of a brick
-                            if (sum_check[j] > max_brick_sum)
-                            {
-                                max_brick_sum = sum_check[j];
-                            }
-
-
-                            // Transfer brick data to pool
-                            err = QOpenCLSetKernelArg( fill_kernel, 0, sizeof(cl_mem), (void *) &pool_cluster_cl);
-                            err |= QOpenCLSetKernelArg( fill_kernel, 1, sizeof(cl_mem), (void *) &pool_cl);
-                            err |= QOpenCLSetKernelArg( fill_kernel, 2, sizeof(cl_int4), pool_dimension.data());
-                            int tmp = svo->brickOuterDimension(); // ?
-                            err |= QOpenCLSetKernelArg( fill_kernel, 3, sizeof(cl_uint), &tmp);
-                            err |= QOpenCLSetKernelArg( fill_kernel, 4, sizeof(cl_uint), &non_empty_node_counter);
-
-                            if ( err != CL_SUCCESS)
-                            {
-                                qFatal(cl_error_cstring(err));
-                            }
+                        // Set the pool id of the brick corresponding to the node. The compact kernel gave it the same brick.
+                        gpuHelpOctree[currentId].calcPoolId(svo->brickPoolPower(), non_empty_node_counter);
 
-                            // Write data to the brick pool
-                            size_t glb_offset[3] = {0, 0, 8 * j};
-                            size_t loc_ws[3] = {8, 8, 8};
-                            size_t glb_ws[3] = {8, 8, 8};
-                            err = QOpenCLEnqueueNDRangeKernel(
-                                      context_cl.queue(),
-                                      fill_kernel,
-                                      3,
-                                      glb_offset,
-                                      glb_ws,
-                                      loc_ws,
-                                      0, NULL, NULL);
+                        non_empty_node_counter++;
 
-                            if ( err != CL_SUCCESS)
-                            {
-                                qFatal(cl_error_cstring(err));
-                            }
-
-                            err = QOpenCLFinish(context_cl.queue());
+                        // Account for children
+                        if (!gpuHelpOctree[currentId].getMsdFlag())
+                        {
+                            unsigned int childId = nodes_prev_lvls + nodes[lvl] + nodes[lvl + 1];
+                            gpuHelpOctree[currentId].setChild(childId); // Index points to first child only
 
-                            if ( err != CL_SUCCESS)
+                            if ((int) childId + 8 > gpuHelpOctree.size())
                             {
-                                qFatal(cl_error_cstring(err));
+                                gpuHelpOctree.resize(std::max(2 * gpuHelpOctree.size(), (int) childId + 8));
                             }
 
-                            non_empty_node_counter++;
-
-                            // Account for children
-                            if (!gpuHelpOctree[currentId].getMsdFlag())
+                            // For each child
+                            for (size_t k = 0; k < 8; k++)
                             {
-                                unsigned int childId = nodes_prev_lvls + nodes[lvl] + nodes[lvl + 1];
-                                gpuHelpOctree[currentId].setChild(childId); // Index points to first child only
-
-                                // For each child
-                                for (size_t k = 0; k < 8; k++)
-                                {
-                                    gpuHelpOctree[childId + k].setParent(currentId);
-                                    nodes[lvl + 1]++;
-                                }
+                                gpuHelpOctree[childId + k].setParent(currentId);
+                                nodes[lvl + 1]++;
                             }
                         }
-
-                        //                        if (i + j + 1 >= nodes[lvl]) break;
                     }
 
                     n_nodes_treated += n_nodes_treated_in_cluster;
@@ -768,7 +929,7 @@ void VoxelizeWorker::process()
                 nodes_prev_lvls += nodes[lvl];
 
                 size_t t = timer.restart();
-                emit message(" ...done (" + QString::number(t) + " ms, " + QString::number(nodes[lvl]) + " nodes)");
+                emit message(" ...done (" + QString::number(t) + " ms, " + QString::number(nodes[lvl]) + " nodes" + QString(is_binned_voxelization ? ", binned" : "") + ")");
             }
 
             if (!kill_flag)
@@ -795,17 +956,23 @@ void VoxelizeWorker::process()
                 svo->setMin(0.0f);
                 svo->setMax(max_brick_sum / (float)(n_points_brick));
 
-                err = QOpenCLEnqueueReadBuffer ( context_cl.queue(),
-                                                 pool_cl,
-                                                 CL_TRUE,
-                                                 0,
-                                                 non_empty_node_counter_rounded_up * n_points_brick * sizeof(float),
-                                                 svo->pool()->data(),
-                                                 0, NULL, NULL);
+                // The slabs follow each other in the pool
+                size_t pool_bytes = non_empty_node_counter_rounded_up * brick_bytes;
 
-                if ( err != CL_SUCCESS)
+                for (int slab = 0; (slab < pool_slabs.size()) && (slab * slab_bytes < pool_bytes); slab++)
                 {
-                    qFatal(cl_error_cstring(err));
+                    err = QOpenCLEnqueueReadBuffer ( context_cl.queue(),
+                                                     pool_slabs[slab],
+                                                     CL_TRUE,
+                                                     0,
+                                                     std::min(slab_bytes, pool_bytes - slab * slab_bytes),
+                                                     svo->pool()->data() + slab * slab_bricks * n_points_brick,
+                                                     0, NULL, NULL);
+
+                    if ( err != CL_SUCCESS)
+                    {
+                        qFatal(cl_error_cstring(err));
+                    }
                 }
             }
 
@@ -823,10 +990,22 @@ void VoxelizeWorker::process()
         err |= QOpenCLReleaseMemObject(point_data_count_cl);
         err |= QOpenCLReleaseMemObject(brick_extent_cl);
         err |= QOpenCLReleaseMemObject(pool_cluster_cl);
-        err |= QOpenCLReleaseMemObject(pool_cl);
+
+        for (int slab = 0; slab < pool_slabs.size(); slab++)
+        {
+            err |= QOpenCLReleaseMemObject(pool_slabs[slab]);
+        }
+
         err |= QOpenCLReleaseMemObject(min_check_cl);
         err |= QOpenCLReleaseMemObject(sum_check_cl);
         err |= QOpenCLReleaseMemObject(variance_check_cl);
+        err |= QOpenCLReleaseMemObject(brick_slot_cl);
+        err |= QOpenCLReleaseMemObject(brick_list_cl);
+
+        if (point_data_binned_cl)
+        {
+            err |= QOpenCLReleaseMemObject(point_data_binned_cl);
+        }
 
         if ( err != CL_SUCCESS)
         {
@@ -86,13 +86,23 @@ class VoxelizeWorker : public BaseWorker
         void process();
         void initializeCLKernel();
 
+        // Bin the points of each brick before the interpolation, see voxelize_binned in voxelize.cl
+        void setBinnedVoxelization(bool value);
+
 
     signals:
         void progressTaskActive(bool value);
 
     protected:
+        bool is_binned_voxelization;
+
         cl_kernel voxelize_kernel;
+        cl_kernel voxelize_binned_kernel;
         cl_kernel fill_kernel;
+        cl_kernel compact_kernel;
+
+        // The device of the OpenCL context
+        cl_device_id device();
 
         unsigned int getOctIndex(unsigned int msdFlag, unsigned int dataFlag, unsigned int child);
         unsigned int getOctBrick(unsigned int poolX, unsigned int poolY, unsigned int poolZ);